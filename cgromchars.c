@@ -2,7 +2,12 @@
 /* cgromchars.c                                   */
 /*                                                */
 /* Utility to show each of the display characters */
-/* in a Sharp MZ series 2K character graphics ROM */
+/* in a Sharp MZ series character graphics ROM.   */
+/* 2K, 4K and larger CGROMs are detected from the */
+/* file size and every 256 character bank shown.  */
+/*                                                */
+/* With -c, compares the glyphs in a set of CGROM */
+/* dumps against the first one given.             */
 /*                                                */
 /* Tim Holyoake, 21st February 2025.              */
 /* MIT licence - see end of file for details.     */
@@ -16,46 +21,167 @@
 #define CROMSIZE 	2048
 #define CHRBYTES	   8
 #define CHRWIDTH           8
+#define BANKCHRS         256
+#define MAXBANKS          32   // Up to 64K of character ROM
 
-int main(int argc, char **argv) 
+/* Read a CGROM into cgrom, returning the number of 256 character banks */
+/* found, or 0 if the file is missing or not a multiple of 2K in size.  */
+uint16_t read_cgrom(char *name, uint8_t *cgrom)
 {
-
   FILE *fp;
-  uint16_t i,j,k;
-  uint8_t cgrom[CROMSIZE];
+  size_t len;
 
-  /* Check we have one and only one argument */
-  if (argc != 2) {
-    fprintf(stderr,"Usage: %s <Sharp MZ CGROM file>\n",argv[0]);
-    exit(1);
+  /* Open file if it exists and is readable */
+  fp = fopen(name, "r");
+  if (fp == NULL) {
+    fprintf(stderr,"Error: %s not found\n",name);
+    return(0);
   }
 
-  /* Open file passed in as argument argv[1] if it exists and is readable */
-  fp = fopen(argv[1], "r");
-  if (fp == NULL) {
-    fprintf(stderr,"Error: %s not found\n",argv[1]);
-    exit(1);
+  /* Read one byte more than the largest ROM allowed to detect oversize */
+  len=fread(cgrom,1,CROMSIZE*MAXBANKS+1,fp);
+  fclose(fp);
+
+  if ((len == 0) || (len%CROMSIZE != 0) || (len > CROMSIZE*MAXBANKS)) {
+    fprintf(stderr,"Error: %s is %zu bytes, not a 2K multiple up to %dK\n",
+            name,len,CROMSIZE*MAXBANKS/1024);
+    return(0);
   }
 
-  /*Read and store the CGROM */
-  for (i=0; i<CROMSIZE; i++)
-    cgrom[i]=getc(fp);
+  return(len/CROMSIZE);
+}
 
-  /* Print the 8x8 character layout */
-  for (i=0; i<CROMSIZE/CHRBYTES; i++) {
-    printf("Sharp MZ display character %d\n\n",i);
+/* Describe the bank layout a CGROM of this size normally has */
+const char *bank_layout(uint16_t banks)
+{
+  switch (banks) {
+    case 1:  return("2K - MZ-80K/MZ-80A single character set");
+    case 2:  return("4K - MZ-700 standard and alternate character sets");
+    case 4:  return("8K - two pairs of standard and alternate character sets");
+    default: return("non-standard size, shown as consecutive banks");
+  }
+}
+
+/* Pack the 8 rows of a glyph into a 64 bit mask, row 0 in the top byte */
+uint64_t glyph_mask(uint8_t *glyph)
+{
+  uint64_t mask=0;
+
+  for (uint8_t j=0; j<CHRBYTES; j++)
+    mask=(mask<<8)|glyph[j];
+
+  return(mask);
+}
+
+/* Print the 8x8 character layout of every bank */
+void show_cgrom(uint8_t *cgrom, uint16_t banks)
+{
+  uint16_t i,j,k;
+
+  printf("CGROM layout: %s\n\n",bank_layout(banks));
+
+  for (i=0; i<banks*BANKCHRS; i++) {
+    if ((banks > 1) && (i%BANKCHRS == 0))
+      printf("Character bank %d\n================\n\n",i/BANKCHRS);
+    printf("Sharp MZ display character %d\n\n",i%BANKCHRS);
     for (j=0; j<CHRBYTES; j++) {
       printf("Row %d is %02x  ",j,cgrom[i*CHRBYTES+j]);
       for (k=0; k<CHRWIDTH; k++) {
-        if ((((cgrom[i*CHRBYTES+j]<<k)&0x80)>>7)&0x01==1) 
+        if ((cgrom[i*CHRBYTES+j]<<k)&0x80)
           printf("X");
-        else 
+        else
           printf(".");
       }
       printf("\n");
     }
     printf("\n");
   }
+}
+
+/* Compare each CGROM named in files[1..n-1] with files[0], glyph by  */
+/* glyph. The popcount of the XOR of two glyph masks is the number of */
+/* pixels that differ. Returns the number of CGROMs that differ.      */
+int compare_cgroms(char **files, int n)
+{
+  static uint64_t ref[MAXBANKS*BANKCHRS];
+  static uint8_t cgrom[CROMSIZE*MAXBANKS+1];
+  uint16_t refbanks, banks;
+  int differ=0;
+
+  refbanks=read_cgrom(files[0],cgrom);
+  if (refbanks == 0)
+    exit(1);
+  for (uint16_t i=0; i<refbanks*BANKCHRS; i++)
+    ref[i]=glyph_mask(&cgrom[i*CHRBYTES]);
+
+  printf("Reference %s: %s\n",files[0],bank_layout(refbanks));
+
+  for (int f=1; f<n; f++) {
+    uint32_t glyphs=0, pixels=0;
+    uint16_t common;
+
+    banks=read_cgrom(files[f],cgrom);
+    if (banks == 0) {
+      ++differ;
+      continue;
+    }
+    common=(banks < refbanks) ? banks : refbanks;
+
+    printf("\n%s: ",files[f]);
+    if (banks != refbanks)
+      printf("%d bank(s) against %d in reference, comparing %d\n",
+             banks,refbanks,common);
+    else
+      printf("%s\n",bank_layout(banks));
+
+    for (uint16_t i=0; i<common*BANKCHRS; i++) {
+      uint8_t dist=__builtin_popcountll(ref[i]^glyph_mask(&cgrom[i*CHRBYTES]));
+      if (dist != 0) {
+        printf("  bank %d character %3d differs by %2d pixel(s)\n",
+               i/BANKCHRS,i%BANKCHRS,dist);
+        ++glyphs;
+        pixels+=dist;
+      }
+    }
+
+    if ((glyphs == 0) && (banks == refbanks))
+      printf("  identical\n");
+    else {
+      printf("  %d character(s), %d pixel(s) differ\n",glyphs,pixels);
+      ++differ;
+    }
+  }
+
+  return(differ);
+}
+
+int main(int argc, char **argv) 
+{
+
+  static uint8_t cgrom[CROMSIZE*MAXBANKS+1];
+  uint16_t banks;
+
+  /* Compare mode takes a reference CGROM and one or more others */
+  if ((argc >= 4) && (strcmp(argv[1],"-c") == 0)) {
+    if (compare_cgroms(&argv[2],argc-2) != 0)
+      return(1);
+    return(0);
+  }
+
+  /* Otherwise check we have one and only one argument */
+  if (argc != 2) {
+    fprintf(stderr,"Usage: %s <Sharp MZ CGROM file>\n",argv[0]);
+    fprintf(stderr,"       %s -c <reference CGROM> <CGROM file> ...\n",argv[0]);
+    exit(1);
+  }
+
+  /* Read and store the CGROM */
+  banks=read_cgrom(argv[1],cgrom);
+  if (banks == 0)
+    exit(1);
+
+  show_cgrom(cgrom,banks);
+
   return(0);
 }
 
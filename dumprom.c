@@ -4,6 +4,9 @@
 /* Utility to dump a Sharp MZ series ROM to       */
 /* stdout for use in emulators.                   */
 /*                                                */
+/* With -p, bundles ROMs and CGROMs into a pack   */
+/* that mzrompack.h reads with a single mmap.     */
+/*                                                */
 /* Tim Holyoake, 19th October 2025.               */
 /* MIT licence - see end of file for details.     */
 /**************************************************/
@@ -12,8 +15,245 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
+#include "mzrompack.h"
 
 #define DUMPWIDTH          8
+#define CROMSIZE        2048   // CGROMs are a 2K multiple, as cgromchars
+#define MAXBANKS          32   // reads them, up to 64K
+#define MAXROMS         4096   // ROMs in a pack
+#define MAXROMSIZE  (1<<24)    // Largest ROM image taken
+
+/* A ROM read for a pack */
+typedef struct {
+  char name[MZPACK_NAME];
+  uint8_t *data;
+  uint32_t size, offset;
+  uint64_t hash;
+  uint8_t kind, banks;
+} packrom;
+
+void put32(uint8_t *p, uint32_t v)
+{
+  p[0]=v;
+  p[1]=v>>8;
+  p[2]=v>>16;
+  p[3]=v>>24;
+}
+
+void put64(uint8_t *p, uint64_t v)
+{
+  put32(p,v);
+  put32(p+4,v>>32);
+}
+
+/* Read a ROM given as [<name>=]<file>, named after the file unless a */
+/* name is given. A CGROM must be a 2K multiple up to 64K in size.    */
+bool read_rom(char *arg, uint8_t kind, packrom *rom)
+{
+  char *eq=strchr(arg,'='), *file=(eq != NULL) ? eq+1 : arg;
+  const char *name=file;
+  size_t namelen;
+  FILE *fp;
+
+  if (eq != NULL) {
+    name=arg;
+    namelen=eq-arg;
+  }
+  else {
+    if (strrchr(file,'/') != NULL)
+      name=strrchr(file,'/')+1;
+    namelen=strlen(name);
+  }
+  if ((namelen == 0) || (namelen >= MZPACK_NAME)) {
+    fprintf(stderr,"Error: %s needs a name of 1 to %d characters\n",arg,
+            MZPACK_NAME-1);
+    return(false);
+  }
+  memset(rom,0,sizeof(packrom));
+  memcpy(rom->name,name,namelen);
+  rom->kind=kind;
+
+  fp = fopen(file, "r");
+  if (fp == NULL) {
+    fprintf(stderr,"Error: %s not found\n",file);
+    return(false);
+  }
+  rom->data=malloc(MAXROMSIZE+1);
+  rom->size=fread(rom->data,1,MAXROMSIZE+1,fp);
+  fclose(fp);
+  if ((rom->size == 0) || (rom->size > MAXROMSIZE)) {
+    fprintf(stderr,"Error: %s is empty or larger than %dM\n",file,
+            MAXROMSIZE>>20);
+    return(false);
+  }
+  if ((kind == MZPACK_CGROM) && ((rom->size%CROMSIZE != 0) ||
+                                 (rom->size > CROMSIZE*MAXBANKS))) {
+    fprintf(stderr,"Error: %s is %u bytes, not a 2K multiple up to %dK\n",
+            file,rom->size,CROMSIZE*MAXBANKS/1024);
+    return(false);
+  }
+  if (kind == MZPACK_CGROM)
+    rom->banks=rom->size/CROMSIZE;
+  rom->data=realloc(rom->data,rom->size);
+  rom->hash=mzpack_hash(rom->data,rom->size);
+
+  return(true);
+}
+
+/* Put entry n+1 in the first free slot of an index from slot s */
+void index_slot(uint8_t *index, uint32_t slots, uint64_t h, uint32_t n)
+{
+  uint32_t s=h&(slots-1);
+
+  while (mzpack_get32(index+4*s) != 0)
+    s=(s+1)&(slots-1);
+  put32(index+4*s,n+1);
+}
+
+/* Build a pack of the ROMs given, those after -g being CGROMs. The */
+/* header, indexes and entries come first and each ROM follows on a */
+/* page boundary. It is written through a temporary file, so that a  */
+/* reader never maps half of one.                                    */
+int build_pack(char *packname, char **args, int n)
+{
+  static packrom roms[MAXROMS];
+  uint8_t kind=MZPACK_ROM, *meta;
+  uint32_t count=0, slots=8, first, offset;
+  char tmp[PATH_MAX+16];
+  FILE *fp;
+  bool ok=true;
+
+  for (int i=0;i<n;i++) {
+    if (strcmp(args[i],"-g") == 0) {
+      kind=MZPACK_CGROM;
+      continue;
+    }
+    if (count == MAXROMS) {
+      fprintf(stderr,"Error: more than %d ROMs\n",MAXROMS);
+      exit(1);
+    }
+    if (!read_rom(args[i],kind,&roms[count]))
+      exit(1);
+    for (uint32_t j=0;j<count;j++)
+      if (strcmp(roms[j].name,roms[count].name) == 0) {
+        fprintf(stderr,"Error: two ROMs are named %s\n",roms[j].name);
+        exit(1);
+      }
+    count++;
+  }
+  if (count == 0) {
+    fprintf(stderr,"Error: no ROMs to pack\n");
+    exit(1);
+  }
+
+  while (slots < 2*count)
+    slots*=2;
+  first=MZPACK_HEADER+8*slots+count*MZPACK_ENTRY;
+  first=(first+MZPACK_ALIGN-1)&~(MZPACK_ALIGN-1);
+  meta=calloc(1,first);
+  memcpy(meta,MZPACK_MAGIC,8);
+  put32(meta+8,count);
+  put32(meta+12,slots);
+  put32(meta+24,first);
+  offset=first;
+  for (uint32_t i=0;i<count;i++) {
+    uint8_t *e=meta+MZPACK_HEADER+8*slots+i*MZPACK_ENTRY;
+    /* Offsets are 32 bits, so the pack must end before 4GB */
+    if ((uint64_t)offset+((roms[i].size+MZPACK_ALIGN-1)&~(MZPACK_ALIGN-1)) >
+        UINT32_MAX) {
+      fprintf(stderr,"Error: %s would end past 4GB into the pack\n",
+              roms[i].name);
+      exit(1);
+    }
+    roms[i].offset=offset;
+    memcpy(e,roms[i].name,MZPACK_NAME);
+    put32(e+MZPACK_NAME,offset);
+    put32(e+MZPACK_NAME+4,roms[i].size);
+    put64(e+48,roms[i].hash);
+    e[56]=roms[i].kind;
+    e[57]=roms[i].banks;
+    index_slot(meta+MZPACK_HEADER,slots,
+               mzpack_hash(roms[i].name,strlen(roms[i].name)),i);
+    index_slot(meta+MZPACK_HEADER+4*slots,slots,roms[i].hash,i);
+    offset+=(roms[i].size+MZPACK_ALIGN-1)&~(MZPACK_ALIGN-1);
+  }
+  put64(meta+16,mzpack_hash(meta+MZPACK_HEADER,first-MZPACK_HEADER));
+
+  snprintf(tmp,sizeof(tmp),"%s.%d",packname,getpid());
+  fp=fopen(tmp,"w");
+  if (fp == NULL) {
+    fprintf(stderr,"Error: unable to write %s\n",packname);
+    exit(1);
+  }
+  ok=(fwrite(meta,1,first,fp) == first);
+  for (uint32_t i=0;ok && (i<count);i++) {
+    static const uint8_t pad[MZPACK_ALIGN];
+    uint32_t padding=((roms[i].size+MZPACK_ALIGN-1)&~(MZPACK_ALIGN-1))-
+                     roms[i].size;
+    ok=(fwrite(roms[i].data,1,roms[i].size,fp) == roms[i].size) &&
+       ((i == count-1) || (fwrite(pad,1,padding,fp) == padding));
+    printf("%-*s 0x%08x %8u %016llx%s\n",MZPACK_NAME-1,roms[i].name,
+           roms[i].offset,roms[i].size,(unsigned long long)roms[i].hash,
+           (roms[i].kind == MZPACK_CGROM) ? " CGROM" : "");
+    free(roms[i].data);
+  }
+  free(meta);
+  if ((fclose(fp) != 0) || !ok || (rename(tmp,packname) != 0)) {
+    fprintf(stderr,"Error: unable to write %s\n",packname);
+    unlink(tmp);
+    exit(1);
+  }
+
+  return(0);
+}
+
+/* List the ROMs in a pack, checking each against its hash */
+int list_pack(char *packname)
+{
+  mzpack pk;
+  int bad=0;
+
+  if (!mzpack_open(packname,&pk)) {
+    fprintf(stderr,"Error: %s is missing or not a ROM pack\n",packname);
+    exit(1);
+  }
+  for (uint32_t n=0;n<pk.count;n++) {
+    mzrom rom;
+    mzpack_entry(&pk,n,&rom);
+    printf("%-*s 0x%08x %8u %016llx%s%s\n",MZPACK_NAME-1,rom.name,
+           (uint32_t)(rom.data-pk.base),rom.size,
+           (unsigned long long)rom.hash,
+           (rom.kind == MZPACK_CGROM) ? " CGROM" : "",
+           mzpack_verify(&rom) ? "" : " damaged");
+    if (!mzpack_verify(&rom))
+      bad++;
+  }
+  mzpack_close(&pk);
+
+  return(bad ? 1 : 0);
+}
+
+/* Dump a ROM from a pack, found by name, as dumprom dumps a file */
+int dump_packed(char *packname, char *name)
+{
+  mzpack pk;
+  mzrom rom;
+
+  if (!mzpack_open(packname,&pk)) {
+    fprintf(stderr,"Error: %s is missing or not a ROM pack\n",packname);
+    exit(1);
+  }
+  if (!mzpack_find(&pk,name,&rom)) {
+    fprintf(stderr,"Error: %s is not in %s\n",name,packname);
+    exit(1);
+  }
+  for (uint32_t i=0;i<rom.size;i++)
+    printf("0x%02x,%s",rom.data[i],((i%DUMPWIDTH) == DUMPWIDTH-1) ? "\n" : "");
+  mzpack_close(&pk);
+
+  return(0);
+}
 
 int main(int argc, char **argv) 
 {
@@ -21,9 +261,21 @@ int main(int argc, char **argv)
   FILE *fp;
   uint8_t i;
 
+  /* ROM packs */
+  if ((argc >= 4) && (strcmp(argv[1],"-p") == 0))
+    return(build_pack(argv[2],&argv[3],argc-3));
+  if ((argc == 3) && (strcmp(argv[1],"-l") == 0))
+    return(list_pack(argv[2]));
+  if ((argc == 4) && (strcmp(argv[1],"-P") == 0))
+    return(dump_packed(argv[2],argv[3]));
+
   /* Check we have one and only one argument */
   if (argc != 2) {
     fprintf(stderr,"Usage: %s <Sharp MZ ROM file\n",argv[0]);
+    fprintf(stderr,"       %s -p <pack file> [<name>=]<ROM file> ..."
+                   " [-g [<name>=]<CGROM file> ...]\n",argv[0]);
+    fprintf(stderr,"       %s -l <pack file>\n",argv[0]);
+    fprintf(stderr,"       %s -P <pack file> <name>\n",argv[0]);
     exit(1);
   }
 
@@ -0,0 +1,526 @@
+/**************************************************/
+/* mzfix.c                                        */
+/*                                                */
+/* Utility to turn Sharp MZ series tape files in  */
+/* any of their containers (mzf, m12, mzt, with   */
+/* or without recorded checksums, one record or   */
+/* several) into canonical .mzf files, one record */
+/* each, repairing their headers if asked.        */
+/*                                                */
+/* Tim Holyoake, 18th October 2026.               */
+/* MIT licence - see end of file for details.     */
+/**************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#define MZFHEADERSIZE 128      // Size of a .mzf file header in bytes
+#define NAMELEN        17      // Name field, bytes 1 to 17
+#define PADDING        24      // Header bytes from here on are padding
+#define MAXRECORDS     64      // Records taken from one file
+#define MAXTAPE (MAXRECORDS*(MZFHEADERSIZE+65540))
+
+/* What was done to a record, for the report */
+#define FIX_CHECKSUMS  0x01    // Recorded checksums taken out
+#define FIX_BADSUMS    0x02    // ... and they were wrong
+#define FIX_NAME       0x04    // Name given its 0x0d terminator
+#define FIX_SIZE       0x08    // Size set from the body found
+#define FIX_PADDING    0x10    // Header bytes 24 to 127 cleared
+
+/* A record found in a tape file */
+typedef struct {
+  uint8_t header[MZFHEADERSIZE];
+  const uint8_t *body;
+  uint32_t size;               // Body bytes, as they will be written
+  uint16_t oldsize;            // Size the header gave
+  size_t offset;               // Of the header in the file
+  uint8_t fixes;
+} record;
+
+bool repair=false;             // -r, fix sizes and names
+bool clearpad=false;           // -z, clear the header padding
+bool dryrun=false;             // -n, only report
+bool inplace=false;            // -i, replace each file with its .mzf
+char *outdir=NULL;             // -o, where to write otherwise
+
+/* Sharp tape checksum, the count of 1 bits */
+uint16_t sharp_checksum(const uint8_t *data, size_t len)
+{
+  uint32_t bits=0;
+
+  for (size_t i=0;i<len;i++)
+    bits+=__builtin_popcount(data[i]);
+
+  return(bits&0xffff);
+}
+
+/* Could another record's header start here? */
+bool looks_like_header(const uint8_t *hd, size_t left)
+{
+  if ((left < MZFHEADERSIZE) || (hd[0] < 0x01) || (hd[0] > 0x06) ||
+      (memchr(hd+1,0x0d,NAMELEN) == NULL))
+    return(false);
+
+  return((size_t)(hd[18]|(hd[19]<<8)) <= left-MZFHEADERSIZE);
+}
+
+/* Terminate a name that runs on with 0x0d after its last character, */
+/* and fill the rest of the field with 0x0d as the monitor does.     */
+bool fix_name(uint8_t *header)
+{
+  int end=NAMELEN;              // Last character of the name
+
+  if (memchr(header+1,0x0d,NAMELEN) != NULL)
+    return(false);
+  while ((end > 0) && ((header[end] == 0x00) || (header[end] == 0x20)))
+    end--;
+  if (end == NAMELEN)
+    end--;
+  memset(header+1+end,0x0d,NAMELEN-end);
+
+  return(true);
+}
+
+/* Find the records in a tape file. The body of each is whatever its   */
+/* header says, except that recorded checksums after the header and    */
+/* body are taken out, and with repair a body that is cut short or has */
+/* bytes after it that are not another record is given the size found. */
+/* Returns the number of records, or 0 with why set.                   */
+int find_records(const uint8_t *tape, size_t size, record *rc,
+                 char *why, size_t whylen)
+{
+  size_t pos=0;
+  int n=0;
+
+  while (pos < size) {
+    record *r=&rc[n];
+    const uint8_t *hd=tape+pos;
+    size_t left=size-pos-MZFHEADERSIZE;
+    uint16_t fs;
+
+    if (n == MAXRECORDS) {
+      snprintf(why,whylen,"more than %d records",MAXRECORDS);
+      return(0);
+    }
+    if (size-pos < MZFHEADERSIZE) {
+      snprintf(why,whylen,"%zu bytes after record %d are not a header",
+               size-pos,n);
+      return(0);
+    }
+    memset(r,0,sizeof(record));
+    memcpy(r->header,hd,MZFHEADERSIZE);
+    r->offset=pos;
+    fs=r->oldsize=hd[18]|(hd[19]<<8);
+    r->size=fs;
+    r->body=hd+MZFHEADERSIZE;
+
+    if ((left >= (size_t)fs+4) &&
+        (((size_t)fs+4 == left) || looks_like_header(hd+MZFHEADERSIZE+fs+4,
+                                                     left-fs-4))) {
+      /* Tape layout: header, checksum, body, checksum. The sizes say */
+      /* so even when a damaged checksum does not match its header.   */
+      const uint8_t *sum=hd+MZFHEADERSIZE+2+fs;
+      r->body=hd+MZFHEADERSIZE+2;
+      r->fixes|=FIX_CHECKSUMS;
+      if ((((hd[MZFHEADERSIZE]<<8)|hd[MZFHEADERSIZE+1]) !=
+           sharp_checksum(hd,MZFHEADERSIZE)) ||
+          (((sum[0]<<8)|sum[1]) != sharp_checksum(r->body,fs)))
+        r->fixes|=FIX_BADSUMS;
+      pos+=MZFHEADERSIZE+fs+4;
+    }
+    else if ((left == fs) ||
+             ((left > fs) && looks_like_header(r->body+fs,left-fs)))
+      pos+=MZFHEADERSIZE+fs;
+    else if (!repair || (left > 0xffff)) {
+      snprintf(why,whylen,"record %d has %zu body bytes, its header says %d",
+               n+1,left,fs);
+      return(0);
+    }
+    else {
+      r->size=left;
+      r->fixes|=FIX_SIZE;
+      pos=size;
+    }
+
+    if (repair && fix_name(r->header))
+      r->fixes|=FIX_NAME;
+    r->header[18]=r->size&0xff;
+    r->header[19]=r->size>>8;
+    if (clearpad) {
+      for (int i=PADDING;i<MZFHEADERSIZE;i++)
+        if (r->header[i] != 0)
+          r->fixes|=FIX_PADDING;
+      memset(r->header+PADDING,0,MZFHEADERSIZE-PADDING);
+    }
+    n++;
+  }
+  if (n == 0)
+    snprintf(why,whylen,"is empty");
+
+  return(n);
+}
+
+/* Move a written file to its name, replacing what is there only if */
+/* asked. Without replace, another file of that name, even one that  */
+/* appears at the same moment, makes it fail with EEXIST.            */
+int place_file(const char *tmp, const char *name, bool replace)
+{
+  if (replace)
+    return((rename(tmp,name) == 0) ? 0 : errno);
+  if (renameat2(AT_FDCWD,tmp,AT_FDCWD,name,RENAME_NOREPLACE) == 0)
+    return(0);
+  /* Filesystems without RENAME_NOREPLACE can still refuse to link */
+  if (errno != EINVAL)
+    return(errno);
+  if (link(tmp,name) != 0)
+    return(errno);
+  unlink(tmp);
+  return(0);
+}
+
+/* Write a record through a temporary file in the same directory, */
+/* then move it to the name given so that no reader sees half a    */
+/* tape. Only the tape itself is replaced, when fixed in place. A  */
+/* record that keeps its body where it was is first cloned from    */
+/* the original, so that a copy on write filesystem shares the     */
+/* body's blocks, and only its header is written. Returns 0 or the */
+/* error that stopped it.                                          */
+int write_record(const char *name, const record *r, int srcfd,
+                 size_t srcsize, bool replace)
+{
+  char tmp[2*PATH_MAX+48];
+  int fd, err=0;
+  bool ok=false;
+
+  snprintf(tmp,sizeof(tmp),"%s.XXXXXX",name);
+  fd=mkstemp(tmp);
+  if (fd < 0)
+    return(errno);
+  fchmod(fd,0644);
+
+  if ((r->offset == 0) && !(r->fixes & FIX_CHECKSUMS) &&
+      (srcsize == MZFHEADERSIZE+(size_t)r->size) &&
+      (ioctl(fd,FICLONE,srcfd) == 0))
+    ok=(pwrite(fd,r->header,MZFHEADERSIZE,0) == MZFHEADERSIZE);
+  else
+    ok=(ftruncate(fd,0) == 0) &&
+       (write(fd,r->header,MZFHEADERSIZE) == MZFHEADERSIZE) &&
+       (write(fd,r->body,r->size) == (ssize_t)r->size);
+  if (inplace && ok)
+    ok=(fdatasync(fd) == 0);
+  if (!ok)
+    err=errno;
+  if ((close(fd) != 0) && (err == 0))
+    err=errno;
+  if ((err != 0) || ((err=place_file(tmp,name,replace)) != 0))
+    unlink(tmp);
+
+  return(err);
+}
+
+/* Where a file's records go: its name without the extension, in its */
+/* own directory with -i or the output directory with -o. Records    */
+/* after the first add -2, -3 and so on to this.                     */
+void target_name(const char *file, char *target, size_t len)
+{
+  char path[PATH_MAX], base[PATH_MAX], *dot;
+
+  snprintf(path,sizeof(path),"%s",file);
+  snprintf(base,sizeof(base),"%s",basename(path));
+  dot=strrchr(base,'.');
+  if ((dot != NULL) && (dot != base))
+    *dot='\0';
+  snprintf(path,sizeof(path),"%s",file);
+  snprintf(target,len,"%s/%s",inplace ? dirname(path) : outdir,base);
+}
+
+/* Normalise one file, returning the report on it. failed is set if it */
+/* could not be read or written. A file whose records would be named   */
+/* the same as those of an earlier one, dupof, is left alone.          */
+char *fix_file(char *file, const char *dupof, bool *failed)
+{
+  static const struct {uint8_t fix; const char *text;} fixnames[] = {
+    {FIX_CHECKSUMS,"recorded checksums removed"},
+    {FIX_BADSUMS,"(they were wrong)"},
+    {FIX_NAME,"name terminated"},
+    {FIX_PADDING,"padding cleared"}
+  };
+  record rc[MAXRECORDS];
+  char *text=NULL, why[128], target[2*PATH_MAX];
+  size_t textlen=0, size;
+  uint8_t *tape;
+  int fd, n;
+  FILE *fp=open_memstream(&text,&textlen);
+  struct stat st;
+  bool overwritten=false;
+
+  *failed=false;
+  target_name(file,target,sizeof(target));
+  if (dupof != NULL) {
+    fprintf(fp,"%s: %s.mzf is also made from %s\n",file,target,dupof);
+    *failed=true;
+    fclose(fp);
+    return(text);
+  }
+  fd=open(file,O_RDONLY);
+  if ((fd < 0) || (fstat(fd,&st) < 0)) {
+    fprintf(fp,"%s: not found\n",file);
+    *failed=true;
+    if (fd >= 0)
+      close(fd);
+    fclose(fp);
+    return(text);
+  }
+  tape=malloc(MAXTAPE+1);
+  size=(size_t)st.st_size;
+  if ((size > MAXTAPE) || (read(fd,tape,size) != (ssize_t)size)) {
+    snprintf(why,sizeof(why),"is unreadable or larger than %d records",MAXRECORDS);
+    n=0;
+  }
+  else
+    n=find_records(tape,size,rc,why,sizeof(why));
+  if (n == 0) {
+    fprintf(fp,"%s: %s\n",file,why);
+    *failed=true;
+  }
+
+  for (int i=0;i<n;i++) {
+    char name[2*PATH_MAX+32];
+    bool same;
+    struct stat ost;
+    record *r=&rc[i];
+    int err;
+
+    if (i == 0)
+      snprintf(name,sizeof(name),"%s.mzf",target);
+    else
+      snprintf(name,sizeof(name),"%s-%d.mzf",target,i+1);
+    same=(stat(name,&ost) == 0) && (ost.st_dev == st.st_dev) &&
+         (ost.st_ino == st.st_ino);
+    if (same)
+      overwritten=true;
+    if ((n == 1) && same && (r->fixes == 0) && (size == MZFHEADERSIZE+r->size) &&
+        (memcmp(r->header,tape,MZFHEADERSIZE) == 0)) {
+      fprintf(fp,"%s: canonical\n",file);
+      continue;
+    }
+    if (dryrun && !same && (stat(name,&ost) == 0)) {
+      fprintf(fp,"%s: %s already exists\n",file,name);
+      *failed=true;
+      continue;
+    }
+
+    fprintf(fp,"%s -> %s:",file,name);
+    for (size_t f=0;f<sizeof(fixnames)/sizeof(fixnames[0]);f++)
+      if (r->fixes & fixnames[f].fix)
+        fprintf(fp," %s",fixnames[f].text);
+    if (r->fixes & FIX_SIZE)
+      fprintf(fp," size %d set to %u",r->oldsize,r->size);
+    if (r->fixes == 0)
+      fprintf(fp," as it was");
+    if (!dryrun && ((err=write_record(name,r,fd,size,same)) != 0)) {
+      fprintf(fp,(err == EEXIST) ? ", not written as it already exists" :
+                                   ", unable to write");
+      *failed=true;
+    }
+    fprintf(fp,"\n");
+  }
+
+  /* In place, the original goes once all its records are written, */
+  /* unless the first was written over it                          */
+  if (inplace && !dryrun && !*failed && (n > 0) && !overwritten)
+    unlink(file);
+  close(fd);
+  free(tape);
+  fclose(fp);
+
+  return(text);
+}
+
+/* Two files given with the same name but for the extension, such as */
+/* game.mzt and game.m12, would write the same .mzf files, so before  */
+/* any thread starts each is matched with the first file of its name, */
+/* or with -i the file that already has it.                           */
+typedef struct {
+  char *target;
+  int file;
+  bool own;                    // The file is its own first .mzf
+} named;
+
+int by_target(const void *a, const void *b)
+{
+  const named *x=a, *y=b;
+  int c=strcmp(x->target,y->target);
+
+  if (c != 0)
+    return(c);
+  if (x->own != y->own)
+    return(x->own ? -1 : 1);
+  return(x->file-y->file);
+}
+
+int *find_duplicates(char **files, int count)
+{
+  named *nm=malloc(count*sizeof(named));
+  int *dupof=malloc(count*sizeof(int));
+
+  for (int n=0;n<count;n++) {
+    char target[2*PATH_MAX], name[2*PATH_MAX+8];
+    struct stat st, ost;
+    target_name(files[n],target,sizeof(target));
+    snprintf(name,sizeof(name),"%s.mzf",target);
+    nm[n].target=strdup(target);
+    nm[n].file=n;
+    nm[n].own=inplace && (stat(files[n],&st) == 0) &&
+              (stat(name,&ost) == 0) && (st.st_dev == ost.st_dev) &&
+              (st.st_ino == ost.st_ino);
+    dupof[n]=-1;
+  }
+  qsort(nm,count,sizeof(named),by_target);
+  for (int n=1;n<count;n++)
+    if (strcmp(nm[n].target,nm[n-1].target) == 0)
+      dupof[nm[n].file]=(dupof[nm[n-1].file] < 0) ? nm[n-1].file :
+                                                    dupof[nm[n-1].file];
+  for (int n=0;n<count;n++)
+    free(nm[n].target);
+  free(nm);
+
+  return(dupof);
+}
+
+/* Files are fixed by a pool of threads, and reported on in order */
+typedef struct {
+  char **files;
+  int count;
+  int *dupof;                  // Earlier file with the same target, or -1
+  atomic_int next;
+  char **reports;
+  bool *failed;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} batch;
+
+void *fixer(void *arg)
+{
+  batch *bt=arg;
+  int n;
+
+  while ((n=atomic_fetch_add(&bt->next,1)) < bt->count) {
+    bool failed;
+    char *report=fix_file(bt->files[n],(bt->dupof[n] < 0) ? NULL :
+                                       bt->files[bt->dupof[n]],&failed);
+    pthread_mutex_lock(&bt->lock);
+    bt->reports[n]=report;
+    bt->failed[n]=failed;
+    pthread_cond_broadcast(&bt->done);
+    pthread_mutex_unlock(&bt->lock);
+  }
+
+  return(NULL);
+}
+
+int main(int argc, char **argv)
+{
+  int nthreads=sysconf(_SC_NPROCESSORS_ONLN), status=0, opt;
+  batch bt={0};
+  pthread_t *threads;
+
+  while ((opt=getopt(argc,argv,"rzno:ij:")) != -1) {
+    switch (opt) {
+      case 'r': repair=true;
+                break;
+      case 'z': clearpad=true;
+                break;
+      case 'n': dryrun=true;
+                break;
+      case 'o': outdir=optarg;
+                break;
+      case 'i': inplace=true;
+                break;
+      case 'j': nthreads=atoi(optarg);
+                break;
+      default:  argc=0;
+    }
+  }
+  if ((argc-optind < 1) || ((outdir == NULL) == !inplace)) {
+    fprintf(stderr,"Usage: %s [-r] [-z] [-n] [-j <threads>]"
+                   " -o <directory> | -i <tape file> ...\n",argv[0]);
+    exit(1);
+  }
+  if (outdir != NULL) {
+    struct stat st;
+    if ((stat(outdir,&st) != 0) || !S_ISDIR(st.st_mode)) {
+      fprintf(stderr,"Error: %s is not a directory\n",outdir);
+      exit(1);
+    }
+  }
+
+  bt.files=&argv[optind];
+  bt.count=argc-optind;
+  bt.dupof=find_duplicates(bt.files,bt.count);
+  bt.reports=calloc(bt.count,sizeof(char *));
+  bt.failed=calloc(bt.count,sizeof(bool));
+  pthread_mutex_init(&bt.lock,NULL);
+  pthread_cond_init(&bt.done,NULL);
+  if (nthreads < 1)
+    nthreads=1;
+  if (nthreads > bt.count)
+    nthreads=bt.count;
+  threads=malloc(nthreads*sizeof(pthread_t));
+  for (int t=0;t<nthreads;t++)
+    pthread_create(&threads[t],NULL,fixer,&bt);
+
+  for (int n=0;n<bt.count;n++) {
+    pthread_mutex_lock(&bt.lock);
+    while (bt.reports[n] == NULL)
+      pthread_cond_wait(&bt.done,&bt.lock);
+    pthread_mutex_unlock(&bt.lock);
+    fputs(bt.reports[n],stdout);
+    if (bt.failed[n])
+      status=1;
+    free(bt.reports[n]);
+  }
+  for (int t=0;t<nthreads;t++)
+    pthread_join(threads[t],NULL);
+  free(threads);
+  free(bt.reports);
+  free(bt.failed);
+  free(bt.dupof);
+
+  return(status);
+}
+
+//MIT License
+
+//Copyright (c) 2026 Tim Holyoake
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
@@ -5,13 +5,15 @@
 /* files (mzf, m12, mzt).                          */
 /*                                                 */
 /* Relies on the mz-ascii.ttf being active in the  */
-/* terminal running the program.                   */
+/* terminal running the program, unless a CGROM is */
+/* given with -g to draw the characters instead.   */
 /*                                                 */
 /* (c) Tim Holyoake, February-March 2025.          */
 /*                                                 */
 /* MIT licence - see end of this file for details. */
 /*                                                 */
 /***************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -20,79 +22,141 @@
 #include <locale.h>
 #include <wchar.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+#include <time.h>
+#include <zlib.h>
 
 #define MZFHEADERSIZE 128      // Size of a .mzf file header in bytes
 #define DISPLAYLEN     16      // Number of bytes to display per hex row
 
 #define MZ80K 1                // Code numbers used for different MZ
-#define MZ80A 2                // series machine types
+#define MZ80A 2                // series machine types and their BASICs
 #define MZ700 3
+#define CHALKWELL 4
+#define DIALECTS  5
 
-uint8_t header[MZFHEADERSIZE]; // Store header as a global variable
-uint8_t mzmc;                  // MZ machine type
+#define CROMSIZE     2048      // Size of one bank of a Sharp MZ CGROM
+#define CHRBYTES        8      // Bytes (pixel rows) per CGROM character
+
+#define SCRCOLS        40      // Sharp MZ screen size in characters
+#define SCRROWS        25
+
+/* Per file state is thread local so files can be processed in parallel */
+_Thread_local uint8_t header[MZFHEADERSIZE]; // Header of the tape being read
+_Thread_local uint8_t mzmc;    // Code number of the BASIC
+_Thread_local FILE *out;       // Stream all output is written to
+
+/* Tokens that decide the flow of a program in each BASIC. Two byte */
+/* tokens are held with their first byte in the high byte.          */
+typedef struct {
+  uint8_t  term;               // Line terminator
+  uint16_t rem, data, ifk, then, gotok, gosub, on, ret, end, stop,
+           restore, run;
+} flowtokens;
+
+/* Registry of BASICs, indexed by code number. Each is recognised from */
+/* the tape header by file type and, unless it is 0, load address, in  */
+/* table order. Everything else about it is then found directly from   */
+/* its code number, so adding a BASIC never slows decoding. A BASIC    */
+/* with no listing function is named but can't be listed.              */
+typedef struct {
+  const char *name;
+  uint8_t type;                // Tape file type
+  uint16_t load;               // Load address, 0 for any
+  uint8_t charset;             // Machine whose character set it uses
+  void (*print)(uint8_t *body, uint16_t fs);
+  uint16_t planes[3];          // First bytes of two byte tokens, 0 if none
+  const char **tables[3];      // Text of the tokens in each plane
+  const flowtokens *flow;
+} basicdef;
+
+extern const basicdef dialects[DIALECTS];
+
+/* Glyph cache for -g, built once from the CGROM. For each display code */
+/* holds the two rows of four braille characters (UTF-8) and the two    */
+/* sixel bands of eight columns that draw the character.                */
+uint8_t cgrom[CROMSIZE];
+char braille[256][2][12];
+char sixels[256][2][CHRBYTES];
+bool usesixel=false;
 
 /* Print Sharp 'ASCII' to stdout. Requires mz-ascii.ttf to be active */
 void mzascii2utf8(uint8_t sharpchar)
 {
   if ((sharpchar >= 0x20) && (sharpchar <= 0x5d))
-    printf("%c",sharpchar);
+    fprintf(out,"%c",sharpchar);
   else
     switch(sharpchar) {
 
       /* Sharp lower case letters are all ok */
       /* but are not contiguous ... convert  */
 
-      case 0xa1: printf("a"); //a
+      case 0xa1: fprintf(out,"a"); //a
                  break;
-      case 0x9a: printf("b"); //b
+      case 0x9a: fprintf(out,"b"); //b
                  break;
-      case 0x9f: printf("c"); //c
+      case 0x9f: fprintf(out,"c"); //c
                  break;
-      case 0x9c: printf("d"); //d
+      case 0x9c: fprintf(out,"d"); //d
                  break;
-      case 0x92: printf("e"); //e
+      case 0x92: fprintf(out,"e"); //e
                  break;
-      case 0xaa: printf("f"); //f
+      case 0xaa: fprintf(out,"f"); //f
                  break;
-      case 0x97: printf("g"); //g
+      case 0x97: fprintf(out,"g"); //g
                  break;
-      case 0x98: printf("h"); //h
+      case 0x98: fprintf(out,"h"); //h
                  break;
-      case 0xa6: printf("i"); //i
+      case 0xa6: fprintf(out,"i"); //i
                  break;
-      case 0xaf: printf("j"); //j
+      case 0xaf: fprintf(out,"j"); //j
                  break;
-      case 0xa9: printf("k"); //k
+      case 0xa9: fprintf(out,"k"); //k
                  break;
-      case 0xb8: printf("l"); //l
+      case 0xb8: fprintf(out,"l"); //l
                  break;
-      case 0xb3: printf("m"); //m
+      case 0xb3: fprintf(out,"m"); //m
                  break;
-      case 0xb0: printf("n"); //n
+      case 0xb0: fprintf(out,"n"); //n
                  break;
-      case 0xb7: printf("o"); //o
+      case 0xb7: fprintf(out,"o"); //o
                  break;
-      case 0x9e: printf("p"); //p
+      case 0x9e: fprintf(out,"p"); //p
                  break;
-      case 0xa0: printf("q"); //q
+      case 0xa0: fprintf(out,"q"); //q
                  break;
-      case 0x9d: printf("r"); //r
+      case 0x9d: fprintf(out,"r"); //r
                  break;
-      case 0xa4: printf("s"); //s
+      case 0xa4: fprintf(out,"s"); //s
                  break;
-      case 0x96: printf("t"); //t
+      case 0x96: fprintf(out,"t"); //t
                  break;
-      case 0xa5: printf("u"); //u
+      case 0xa5: fprintf(out,"u"); //u
                  break;
-      case 0xab: printf("v"); //v
+      case 0xab: fprintf(out,"v"); //v
                  break;
-      case 0xa3: printf("w"); //w
+      case 0xa3: fprintf(out,"w"); //w
                  break;
-      case 0x9b: printf("x"); //x
+      case 0x9b: fprintf(out,"x"); //x
                  break;
-      case 0xbd: printf("y"); //y
+      case 0xbd: fprintf(out,"y"); //y
                  break;
-      case 0xa2: printf("z"); //z
+      case 0xa2: fprintf(out,"z"); //z
                  break;
 
       /* Other stuff is in the Unicode private area 1 at E000 onwards   */
@@ -101,7 +165,7 @@ void mzascii2utf8(uint8_t sharpchar)
       /* Done to make the default printf statement easy ...             */
 
       default:   wchar_t tstr;
-                 if (mzmc == MZ80A) {
+                 if (dialects[mzmc].charset == MZ80A) {
                    if ((sharpchar == 0x80) ||
                        (sharpchar == 0x8b) ||
                        (sharpchar == 0x90) ||
@@ -111,7 +175,7 @@ void mzascii2utf8(uint8_t sharpchar)
                      tstr=0xF000+sharpchar;
                     else
                      tstr=0xE000+sharpchar;
-                 } else if (mzmc == MZ700) {
+                 } else if (dialects[mzmc].charset == MZ700) {
                    if ((sharpchar == 0x6c) ||
                        (sharpchar == 0x7f) ||
                        (sharpchar == 0x80) ||
@@ -125,29 +189,164 @@ void mzascii2utf8(uint8_t sharpchar)
                      tstr=0xE000+sharpchar;
                  } else
                      tstr=0xE000+sharpchar;
-                 printf("%lc",tstr);
+                 fprintf(out,"%lc",tstr);
                  break;
     }
 
   return;
 }
 
+/* SP-5025 BASIC tokens */
+const char *tokens5025[256] = {
+  [0x80]="REM",     [0x81]="DATA",    [0x82]="LIST",    [0x83]="RUN",
+  [0x84]="NEW",     [0x85]="PRINT",   [0x86]="LET",     [0x87]="FOR",
+  [0x88]="IF",      [0x89]="GOTO",    [0x8a]="READ",    [0x8b]="GOSUB",
+  [0x8c]="RETURN",  [0x8d]="NEXT",    [0x8e]="STOP",    [0x8f]="END",
+  [0x90]="ON",      [0x91]="LOAD",    [0x92]="SAVE",    [0x93]="VERIFY",
+  [0x94]="POKE",    [0x95]="DIM",     [0x96]="DEF FN",  [0x97]="INPUT",
+  [0x98]="RESTORE", [0x99]="CLR",     [0x9a]="MUSIC",   [0x9b]="TEMPO",
+  [0x9c]="USR(",    [0x9d]="WOPEN",   [0x9e]="ROPEN",   [0x9f]="CLOSE",
+  [0xa0]="BYE",     [0xa1]="LIMIT",   [0xa2]="CONT",    [0xa3]="SET",
+  [0xa4]="RESET",   [0xa5]="GET",     [0xa6]="INP#",    [0xa7]="OUT#",
+  [0xad]="THEN",    [0xae]="TO",      [0xaf]="STEP",    [0xb0]="><",
+  [0xb1]="<>",      [0xb2]="=<",      [0xb3]="<=",      [0xb4]="=>",
+  [0xb5]=">=",      [0xb6]="=",       [0xb7]=">",       [0xb8]="<",
+  [0xb9]="AND",     [0xba]="OR",      [0xbb]="NOT",     [0xbc]="+",
+  [0xbd]="-",       [0xbe]="*",       [0xbf]="/",       [0xc0]="LEFT$(",
+  [0xc1]="RIGHT$(", [0xc2]="MID$(",   [0xc3]="LEN(",    [0xc4]="CHR$(",
+  [0xc5]="STR$(",   [0xc6]="ASC(",    [0xc7]="VAL(",    [0xc8]="PEEK(",
+  [0xc9]="TAB(",    [0xca]="SPC(",    [0xcb]="SIZE",    [0xcf]="\ue05e",
+  [0xd0]="RND(",    [0xd1]="SIN(",    [0xd2]="COS(",    [0xd3]="TAN(",
+  [0xd4]="ATN(",    [0xd5]="EXP(",    [0xd6]="INT(",    [0xd7]="LOG(",
+  [0xd8]="LN(",     [0xd9]="ABS(",    [0xda]="SGN(",    [0xdb]="SQR("
+};
+
+/* SA-5510 BASIC single byte tokens */
+const char *tokens5510[256] = {
+  [0x2a]="*",           [0x2b]="+",           [0x2d]="-",           [0x2f]="/",
+  [0x5e]="\ue05e",      [0x83]="><",          [0x84]="<>",          [0x85]="=<",
+  [0x86]="<=",          [0x87]="=>",          [0x88]=">=",          [0x89]="=",
+  [0x8a]=">",           [0x8b]="<",           [0x9e]="TO",          [0x9f]="STEP",
+  [0xa0]="LEFT$(",      [0xa1]="RIGHT$(",     [0xa2]="MID$(",       [0xa3]="LEN(",
+  [0xa4]="CHR$",        [0xa5]="STR$(",       [0xa6]="ASC(",        [0xa7]="VAL(",
+  [0xa8]="PEEK(",       [0xa9]="TAB(",        [0xaa]="SPACE$(",     [0xab]="SIZE",
+  [0xaf]="STRING$(",    [0xb1]="CHARACTER$(", [0xb2]="CSR",         [0xc0]="RND(",
+  [0xc1]="SIN(",        [0xc2]="COS(",        [0xc3]="TAN(",        [0xc4]="ATN(",
+  [0xc5]="EXP(",        [0xc6]="INT(",        [0xc7]="LOG(",        [0xc8]="LN(",
+  [0xc9]="ABS(",        [0xca]="SGN(",        [0xcb]="SQR("
+};
+
+/* SA-5510 BASIC two byte tokens, 0x80 then the byte below */
+const char *tokens5510x[256] = {
+  [0x80]="REM",     [0x81]="DATA",    [0x84]="READ",    [0x85]="LIST",
+  [0x86]="RUN",     [0x87]="NEW",     [0x88]="PRINT",   [0x89]="LET",
+  [0x8a]="FOR",     [0x8b]="IF",      [0x8c]="THEN",    [0x8d]="GOTO",
+  [0x8e]="GOSUB",   [0x8f]="RETURN",  [0x90]="NEXT",    [0x91]="STOP",
+  [0x92]="END",     [0x94]="ON",      [0x95]="LOAD",    [0x96]="SAVE",
+  [0x97]="VERIFY",  [0x98]="POKE",    [0x99]="DIM",     [0x9a]="DEF FN",
+  [0x9b]="INPUT",   [0x9c]="RESTORE", [0x9d]="CLR",     [0x9e]="MUSIC",
+  [0x9f]="TEMPO",   [0xa0]="USR(",    [0xa1]="WOPEN",   [0xa2]="ROPEN",
+  [0xa3]="CLOSE",   [0xa4]="MON",     [0xa5]="LIMIT",   [0xa6]="CONT",
+  [0xa7]="GET",     [0xa8]="INP@",    [0xa9]="OUT@",    [0xaa]="CURSOR",
+  [0xab]="SET",     [0xac]="RESET",   [0xb3]="AUTO",    [0xb6]="COPY/P",
+  [0xb7]="PAGE/P"
+};
+
+/* S-BASIC single byte tokens */
+const char *tokenssbasic[256] = {
+  [0x80]="GOTO",    [0x81]="GOSUB",   [0x83]="RUN",     [0x84]="RETURN",
+  [0x85]="RESTORE", [0x86]="RESUME",  [0x87]="LIST",    [0x89]="DELETE",
+  [0x8a]="RENUM",   [0x8b]="AUTO",    [0x8d]="FOR",     [0x8e]="NEXT",
+  [0x8f]="PRINT",   [0x91]="INPUT",   [0x93]="IF",      [0x94]="DATA",
+  [0x95]="READ",    [0x96]="DIM",     [0x97]="REM",     [0x98]="END",
+  [0x99]="STOP",    [0x9a]="CONT",    [0x9b]="CLS",     [0x9d]="ON",
+  [0x9e]="LET",     [0x9f]="NEW",     [0xa0]="POKE",    [0xa1]="OFF",
+  [0xa2]="MODE",    [0xa3]="SKIP",    [0xa4]="PLOT",    [0xa5]="LINE",
+  [0xa6]="RLINE",   [0xa7]="MOVE",    [0xa8]="RMOVE",   [0xa9]="TRON",
+  [0xaa]="TROFF",   [0xab]="INP#",    [0xad]="GET",     [0xae]="PCOLOR",
+  [0xaf]="PHOME",   [0xb0]="HSET",    [0xb1]="GPRINT",  [0xb2]="KEY",
+  [0xb3]="AXIS",    [0xb4]="LOAD",    [0xb5]="SAVE",    [0xb6]="MERGE",
+  [0xb8]="CONSOLE", [0xba]="OUT#",    [0xbb]="CIRCLE",  [0xbc]="TEST",
+  [0xbd]="PAGE",    [0xc0]="ERASE",   [0xc1]="ERROR",   [0xc3]="USR",
+  [0xc4]="BYE",     [0xc7]="DEF",     [0xce]="WOPEN",   [0xcf]="CLOSE",
+  [0xd0]="ROPEN",   [0xd2]="\ue0ff",  [0xd9]="KILL",    [0xe0]="TO",
+  [0xe1]="STEP",    [0xe2]="THEN",    [0xe3]="USING",   [0xe6]="TAB",
+  [0xe7]="SPC",     [0xeb]="OR",      [0xec]="AND",     [0xee]="><",
+  [0xef]="<>",      [0xf0]="=<",      [0xf1]="<=",      [0xf2]="=>",
+  [0xf3]=">=",      [0xf4]="=",       [0xf5]=">",       [0xf6]="<",
+  [0xf7]="+",       [0xf8]="-",       [0xfb]="/",       [0xfc]="*",
+  [0xfd]="\ue05e"
+};
+
+/* S-BASIC two byte tokens, 0xfe then the byte below */
+const char *tokenssbasicfe[256] = {
+  [0x81]="SET",    [0x82]="RESET",  [0x83]="COLOR",  [0xa2]="MUSIC",
+  [0xa3]="TEMPO",  [0xa4]="CURSOR", [0xa5]="VERIFY", [0xa6]="CLR",
+  [0xa7]="LIMIT",  [0xae]="BOOT"
+};
+
+/* S-BASIC two byte tokens, 0xff then the byte below */
+const char *tokenssbasicff[256] = {
+  [0x80]="INT",     [0x81]="ABS",     [0x82]="SIN",     [0x83]="COS",
+  [0x84]="TAN",     [0x85]="LN",      [0x86]="EXP",     [0x87]="SQR",
+  [0x88]="RND",     [0x89]="PEEK",    [0x8a]="ATN",     [0x8b]="SGN",
+  [0x8c]="LOG",     [0x8e]="PAI",     [0x8f]="RAD",     [0x95]="EOF",
+  [0x9e]="JOY",     [0xa0]="CHR$",    [0xa2]="HEX$",    [0xab]="ASC",
+  [0xac]="LEN",     [0xad]="VAL",     [0xb3]="ERN",     [0xb4]="ERL",
+  [0xb5]="SIZE",    [0xba]="LEFT$",   [0xbb]="RIGHT$",  [0xbc]="MID$",
+  [0xc3]="STRING$", [0xc4]="TI$",     [0xc7]="FN"
+};
+
+/* Bodies are followed by BODYGUARD zero bytes, more than the longest  */
+/* item (an S-BASIC variable of 255 characters and its value) takes,   */
+/* so the decoders can read a whole item without checking each byte    */
+/* against the size. Instead each checks once, at the end, whether the */
+/* last item or line ran past the end of the body.                     */
+#define BODYGUARD   264
+
+/* Where a listing was cut short by the end of the body */
+typedef struct {
+  bool truncated;
+  uint16_t line;               // Line number of the line cut short
+  uint32_t offset;             // Body offset of the start of that line
+} listerror;
+
+_Thread_local listerror listerr;
+
+/* Space for a body of fs bytes and its guard */
+uint8_t *new_body(uint16_t fs)
+{
+  return(calloc(fs+BODYGUARD,1));
+}
+
+/* Record whether the listing decoder stopped at position i of a fs byte */
+/* body part way through a line                                          */
+void end_listing(int32_t i, uint16_t fs, uint8_t licount, uint8_t *linum,
+                 uint32_t linestart)
+{
+  listerr.truncated=(i > fs) || (licount == 4);
+  listerr.line=(licount == 4) ? (linum[3]<<8)|linum[2] : 0;
+  listerr.offset=linestart;
+}
+
 void print5025(uint8_t *body, uint16_t fs)
 {
   bool instr=false;
   bool inrem=false;
   uint8_t licount=0;
   uint8_t linum[4];
+  uint32_t linestart=0;
+  int32_t i;
 
-  printf("\n\n");
+  fprintf(out,"\n\n");
 
-  for (int32_t i=0;i<fs;i++) {
+  for (i=0;i<fs;i++) {
     /* BASIC SP-5025 lines are terminated by 0x0d */
     if ((body[i]==0x0d)&&(licount==4)) {
       licount=0;
       instr=false;
       inrem=false;
-      printf("\n");
+      fprintf(out,"\n");
     }
     else if (instr) {
       mzascii2utf8(body[i]);
@@ -160,194 +359,34 @@ void print5025(uint8_t *body, uint16_t fs)
         inrem=false;
     }
     else if (licount < 4) {
+      if (licount == 0)
+        linestart=i;
       linum[licount++]=body[i];
       if (licount == 4) {
         uint16_t linenumber=((linum[3]<<8)|linum[2])&0xffff;
-        printf(" %d ",linenumber);
+        fprintf(out," %d ",linenumber);
       }
     }
     else {
       switch(body[i]) {
         case 0x22: instr=true;
-                   printf("%c",body[i]);
+                   fprintf(out,"%c",body[i]);
                    break;
-        case 0x80: printf("REM");
+        case 0x80: fprintf(out,"%s",tokens5025[body[i]]);
                    inrem=true;
                    break;
-        case 0x81: printf("DATA");
-                   break;
-        case 0x82: printf("LIST");
-                   break;
-        case 0x83: printf("RUN");
-                   break;
-        case 0x84: printf("NEW");
-                   break;
-        case 0x85: printf("PRINT");
-                   break;
-        case 0x86: printf("LET");
-                   break;
-        case 0x87: printf("FOR");
-                   break;
-        case 0x88: printf("IF");
-                   break;
-        case 0x89: printf("GOTO");
-                   break;
-        case 0x8a: printf("READ");
-                   break;
-        case 0x8b: printf("GOSUB");
-                   break;
-        case 0x8c: printf("RETURN");
-                   break;
-        case 0x8d: printf("NEXT");
-                   break;
-        case 0x8e: printf("STOP");
-                   break;
-        case 0x8f: printf("END");
-                   break;
-        case 0x90: printf("ON");
-                   break;
-        case 0x91: printf("LOAD");
-                   break;
-        case 0x92: printf("SAVE");
-                   break;
-        case 0x93: printf("VERIFY");
-                   break;
-        case 0x94: printf("POKE");
-                   break;
-        case 0x95: printf("DIM");
-                   break;
-        case 0x96: printf("DEF FN");
-                   break;
-        case 0x97: printf("INPUT");
-                   break;
-        case 0x98: printf("RESTORE");
-                   break;
-        case 0x99: printf("CLR");
-                   break;
-        case 0x9a: printf("MUSIC");
-                   break;
-        case 0x9b: printf("TEMPO");
-                   break;
-        case 0x9c: printf("USR(");
-                   break;
-        case 0x9d: printf("WOPEN");
-                   break;
-        case 0x9e: printf("ROPEN");
-                   break;
-        case 0x9f: printf("CLOSE");
-                   break;
-        case 0xa0: printf("BYE");
-                   break;
-        case 0xa1: printf("LIMIT");
-                   break;
-        case 0xa2: printf("CONT");
-                   break;
-        case 0xa3: printf("SET");
-                   break;
-        case 0xa4: printf("RESET");
-                   break;
-        case 0xa5: printf("GET");
-                   break;
-        case 0xa6: printf("INP#");
-                   break;
-        case 0xa7: printf("OUT#");
-                   break;
-        case 0xad: printf("THEN");
-                   break;
-        case 0xae: printf("TO");
-                   break;
-        case 0xaf: printf("STEP");
-                   break;
-        case 0xb0: printf("><");
-                   break;
-        case 0xb1: printf("<>");
-                   break;
-        case 0xb2: printf("=<");
-                   break;
-        case 0xb3: printf("<=");
-                   break;
-        case 0xb4: printf("=>");
-                   break;
-        case 0xb5: printf(">=");
-                   break;
-        case 0xb6: printf("=");
-                   break;
-        case 0xb7: printf(">");
-                   break;
-        case 0xb8: printf("<");
-                   break;
-        case 0xb9: printf("AND");
-                   break;
-        case 0xba: printf("OR");
-                   break;
-        case 0xbb: printf("NOT");
-                   break;
-        case 0xbc: printf("+");
-                   break;
-        case 0xbd: printf("-");
-                   break;
-        case 0xbe: printf("*");
-                   break;
-        case 0xbf: printf("/");
-                   break;
-        case 0xc0: printf("LEFT$(");
-                   break;
-        case 0xc1: printf("RIGHT$(");
-                   break;
-        case 0xc2: printf("MID$(");
-                   break;
-        case 0xc3: printf("LEN(");
-                   break;
-        case 0xc4: printf("CHR$(");
-                   break;
-        case 0xc5: printf("STR$(");
-                   break;
-        case 0xc6: printf("ASC(");
-                   break;
-        case 0xc7: printf("VAL(");
-                   break;
-        case 0xc8: printf("PEEK(");
-                   break;
-        case 0xc9: printf("TAB(");
-                   break;
-        case 0xca: printf("SPC(");
-                   break;
-        case 0xcb: printf("SIZE");
-                   break;
-        case 0xcf: printf("\ue05e"); // up arrow = exponentiation
-                   break;
-        case 0xd0: printf("RND(");
-                   break;
-        case 0xd1: printf("SIN(");
-                   break;
-        case 0xd2: printf("COS(");
-                   break;
-        case 0xd3: printf("TAN(");
-                   break;
-        case 0xd4: printf("ATN(");
-                   break;
-        case 0xd5: printf("EXP(");
-                   break;
-        case 0xd6: printf("INT(");
-                   break;
-        case 0xd7: printf("LOG(");
-                   break;
-        case 0xd8: printf("LN(");
-                   break;
-        case 0xd9: printf("ABS(");
-                   break;
-        case 0xda: printf("SGN(");
-                   break;
-        case 0xdb: printf("SQR(");
-                   break;
         default:   /* Not a token - use as a literal value */
-                   mzascii2utf8(body[i]);
+                   if (tokens5025[body[i]] != NULL)
+                     fprintf(out,"%s",tokens5025[body[i]]);
+                   else
+                     mzascii2utf8(body[i]);
                    break;
       }
     }
   }
 
-  printf("\n");
+  end_listing(i,fs,licount,linum,linestart);
+  fprintf(out,"\n");
 }
 
 void print5510(uint8_t *body, uint16_t fs)
@@ -356,16 +395,18 @@ void print5510(uint8_t *body, uint16_t fs)
   bool inrem=false;
   uint8_t licount=0;
   uint8_t linum[4];
+  uint32_t linestart=0;
+  int32_t i;
 
-  printf("\n\n");
+  fprintf(out,"\n\n");
 
-  for (int32_t i=0;i<fs;i++) {
+  for (i=0;i<fs;i++) {
     /* BASIC SA-5510 lines are terminated by 0x0d */
     if ((body[i]==0x0d)&&(licount==4)) {
       licount=0;
       instr=false;
       inrem=false;
-      printf("\n");
+      fprintf(out,"\n");
     }
     else if (instr) {
       mzascii2utf8(body[i]);
@@ -378,208 +419,38 @@ void print5510(uint8_t *body, uint16_t fs)
         inrem=false;
     }
     else if (licount < 4) {
+      if (licount == 0)
+        linestart=i;
       linum[licount++]=body[i];
       if (licount == 4) {
         uint16_t linenumber=((linum[3]<<8)|linum[2])&0xffff;
-        printf(" %d ",linenumber);
+        fprintf(out," %d ",linenumber);
       }
     }
     else {
       switch(body[i]) {
         case 0x80: /* Two byte token found */
-                   switch(body[++i]) {
-                     case 0x80: printf("REM");
-                                inrem=true;
-                                break;
-                     case 0x81: printf("DATA");
-                                break;
-                     case 0x84: printf("READ");
-                                break;
-                     case 0x85: printf("LIST");
-                                break;
-                     case 0x86: printf("RUN");
-                                break;
-                     case 0x87: printf("NEW");
-                                break;
-                     case 0x88: printf("PRINT");
-                                break;
-                     case 0x89: printf("LET");
-                                break;
-                     case 0x8a: printf("FOR");
-                                break;
-                     case 0x8b: printf("IF");
-                                break;
-                     case 0x8c: printf("THEN");
-                                break;
-                     case 0x8d: printf("GOTO");
-                                break;
-                     case 0x8e: printf("GOSUB");
-                                break;
-                     case 0x8f: printf("RETURN");
-                                break;
-                     case 0x90: printf("NEXT");
-                                break;
-                     case 0x91: printf("STOP");
-                                break;
-                     case 0x92: printf("END");
-                                break;
-                     case 0x94: printf("ON");
-                                break;
-                     case 0x95: printf("LOAD");
-                                break;
-                     case 0x96: printf("SAVE");
-                                break;
-                     case 0x97: printf("VERIFY");
-                                break;
-                     case 0x98: printf("POKE");
-                                break;
-                     case 0x99: printf("DIM");
-                                break;
-                     case 0x9a: printf("DEF FN");
-                                break;
-                     case 0x9b: printf("INPUT");
-                                break;
-                     case 0x9c: printf("RESTORE");
-                                break;
-                     case 0x9d: printf("CLR");
-                                break;
-                     case 0x9e: printf("MUSIC");
-                                break;
-                     case 0x9f: printf("TEMPO");
-                                break;
-                     case 0xa0: printf("USR(");
-                                break;
-                     case 0xa1: printf("WOPEN");
-                                break;
-                     case 0xa2: printf("ROPEN");
-                                break;
-                     case 0xa3: printf("CLOSE");
-                                break;
-                     case 0xa4: printf("MON");
-                                break;
-                     case 0xa5: printf("LIMIT");
-                                break;
-                     case 0xa6: printf("CONT");
-                                break;
-                     case 0xa7: printf("GET");
-                                break;
-                     case 0xa8: printf("INP@");
-                                break;
-                     case 0xa9: printf("OUT@");
-                                break;
-                     case 0xaa: printf("CURSOR");
-                                break;
-                     case 0xab: printf("SET");
-                                break;
-                     case 0xac: printf("RESET");
-                                break;
-                     case 0xb3: printf("AUTO");
-                                break;
-                     case 0xb6: printf("COPY/P");
-                                break;
-                     case 0xb7: printf("PAGE/P");
-                                break;
-                     default:   break;
-                   }
+                   ++i;
+                   if (body[i] == 0x80)
+                     inrem=true;
+                   if (tokens5510x[body[i]] != NULL)
+                     fprintf(out,"%s",tokens5510x[body[i]]);
                    break;
-                   /* Single byte tokens */
         case 0x22: instr=true;
-                   printf("%c",body[i]);
-                   break;
-        case 0x2a: printf("*");
-                   break;
-        case 0x2b: printf("+");
-                   break;
-        case 0x2d: printf("-");
-                   break;
-        case 0x2f: printf("/");
-                   break;
-        case 0x5e: printf("\ue05e"); // up arrow = exponentiation
-                   break;
-        case 0x83: printf("><");
-                   break;
-        case 0x84: printf("<>");
-                   break;
-        case 0x85: printf("=<");
-                   break;
-        case 0x86: printf("<=");
-                   break;
-        case 0x87: printf("=>");
-                   break;
-        case 0x88: printf(">=");
-                   break;
-        case 0x89: printf("=");
-                   break;
-        case 0x8a: printf(">");
-                   break;
-        case 0x8b: printf("<");
-                   break;
-        case 0x9e: printf("TO");
-                   break;
-        case 0x9f: printf("STEP");
+                   fprintf(out,"%c",body[i]);
                    break;
-        case 0xa0: printf("LEFT$(");
-                   break;
-        case 0xa1: printf("RIGHT$(");
-                   break;
-        case 0xa2: printf("MID$(");
-                   break;
-        case 0xa3: printf("LEN(");
-                   break;
-        case 0xa4: printf("CHR$");
-                   break;
-        case 0xa5: printf("STR$(");
-                   break;
-        case 0xa6: printf("ASC(");
-                   break;
-        case 0xa7: printf("VAL(");
-                   break;
-        case 0xa8: printf("PEEK(");
-                   break;
-        case 0xa9: printf("TAB(");
-                   break;
-        case 0xaa: printf("SPACE$(");
-                   break;
-        case 0xab: printf("SIZE");
-                   break;
-        case 0xaf: printf("STRING$(");
-                   break;
-        case 0xb1: printf("CHARACTER$(");
-                   break;
-        case 0xb2: printf("CSR");
-                   break;
-        case 0xc0: printf("RND(");
-                   break;
-        case 0xc1: printf("SIN(");
-                   break;
-        case 0xc2: printf("COS(");
-                   break;
-        case 0xc3: printf("TAN(");
-                   break;
-        case 0xc4: printf("ATN(");
-                   break;
-        case 0xc5: printf("EXP(");
-                   break;
-        case 0xc6: printf("INT(");
-                   break;
-        case 0xc7: printf("LOG(");
-                   break;
-        case 0xc8: printf("LN(");
-                   break;
-        case 0xc9: printf("ABS(");
-                   break;
-        case 0xca: printf("SGN(");
-                   break;
-        case 0xcb: printf("SQR(");
-                   break;
-        default:   /* Not a token - use as a literal value */
-                   mzascii2utf8(body[i]);
+        default:   /* Single byte token, or a literal value if not one */
+                   if (tokens5510[body[i]] != NULL)
+                     fprintf(out,"%s",tokens5510[body[i]]);
+                   else
+                     mzascii2utf8(body[i]);
                    break;
       }
     }
   }
 
-  printf("\n");
+  end_listing(i,fs,licount,linum,linestart);
+  fprintf(out,"\n");
 }
 
 void printsbasic(uint8_t *body, uint16_t fs)
@@ -588,16 +459,18 @@ void printsbasic(uint8_t *body, uint16_t fs)
   bool inrem=false;
   uint8_t licount=0;
   uint8_t linum[4];
+  uint32_t linestart=0;
+  int32_t i;
 
-  printf("\n\n");
+  fprintf(out,"\n\n");
 
-  for (int32_t i=0;i<fs;i++) {
+  for (i=0;i<fs;i++) {
     /* S-BASIC lines are terminated by 0x00 */
     if ((body[i]==0x00)&&(licount==4)) {
       licount=0;
       instr=false;
       inrem=false;
-      printf("\n");
+      fprintf(out,"\n");
     }
     else if (instr) {
       mzascii2utf8(body[i]);
@@ -610,10 +483,12 @@ void printsbasic(uint8_t *body, uint16_t fs)
         inrem=false;
     }
     else if (licount < 4) {
+      if (licount == 0)
+        linestart=i;
       linum[licount++]=body[i];
       if (licount == 4) {
         uint16_t linenumber=((linum[3]<<8)|linum[2])&0xffff;
-        printf(" %d ",linenumber);
+        fprintf(out," %d ",linenumber);
       }
     }
     else {
@@ -623,16 +498,16 @@ void printsbasic(uint8_t *body, uint16_t fs)
                    leng=body[++i];
                    /* Output string variable name */
                    for (uint8_t j=0;j<leng;j++)
-                      printf("%c",body[++i]);
+                      fprintf(out,"%c",body[++i]);
                    /* Output a $ symbol */
-                   printf("$");
+                   fprintf(out,"$");
                    break;
         case 0x05: /* Numeric variable - length of name in next byte */
                    leng=body[++i];
-                   int exponent, mantissa;
+                   int exponent;
                    /* Output numeric variable name */
                    for (uint8_t j=0;j<leng;j++)
-                      printf("%c",body[++i]);
+                      fprintf(out,"%c",body[++i]);
         case 0x15: /* Next byte is exponent plus exponent's sign - base 2 */
                    /* If this is 0x00, then value of the number is 0 */
                    if (body[++i] == 0x00)
@@ -664,302 +539,93 @@ void printsbasic(uint8_t *body, uint16_t fs)
                    }
                    /* Multiply by the exponent and print if not 0 */
                    if (exponent == 0)     // S-BASIC 0 indicator
-                     printf("0");
+                     fprintf(out,"0");
                    else {
                      if (positivemantissa)
                        value *= powf(2,exponent);
                      else
                        value *= powf(2,-1*exponent);
-                     printf("%g",value);  // %g removes trailing zeros
+                     fprintf(out,"%g",value);  // %g removes trailing zeros
                    }                      // after the decimal point
                    break;
         case 0x11: /* Hex value */
                    if (body[i+2] != 0x00)
-                     printf("$%02X%02X",body[i+2],body[i+1]);
+                     fprintf(out,"$%02X%02X",body[i+2],body[i+1]);
                    else
-                     printf("$%X",body[i+1]);
+                     fprintf(out,"$%X",body[i+1]);
                    i+=2;
                    break;
         case 0x0b: /* GOTO or GOSUB line number held in next 2 bytes */
-                   printf("%d",((body[i+2]<<8)|body[i+1]))&0xffff;
+                   fprintf(out,"%d",((body[i+2]<<8)|body[i+1])&0xffff);
                    i+=2;
                    break;
         case 0x22: instr=true;
-                   printf("%c",body[i]);
-                   break;
-        case 0x8b: printf("AUTO");
-                   break;
-        case 0xb3: printf("AXIS");
-                   break;
-        case 0xc4: printf("BYE");
-                   break;
-        case 0xbb: printf("CIRCLE");
-                   break;
-        case 0xcf: printf("CLOSE");
-                   break;
-        case 0x9b: printf("CLS");
-                   break;
-        case 0x9a: printf("CONT");
-                   break;
-        case 0xb8: printf("CONSOLE");
-                   break;
-        case 0x94: printf("DATA");
-                   break;
-        case 0xc7: printf("DEF");
-                   break;
-        case 0x89: printf("DELETE");
-                   break;
-        case 0x96: printf("DIM");
-                   break;
-        case 0x98: printf("END");
-                   break;
-        case 0xc0: printf("ERASE");
-                   break;
-        case 0xc1: printf("ERROR");
-                   break;
-        case 0x8d: printf("FOR");
-                   break;
-        case 0xad: printf("GET");
-                   break;
-        case 0x81: printf("GOSUB");
-                   break;
-        case 0x80: printf("GOTO");
-                   break;
-        case 0xb1: printf("GPRINT");
-                   break;
-        case 0xb0: printf("HSET");
-                   break;
-        case 0x93: printf("IF");
-                   break;
-        case 0x91: printf("INPUT");
-                   break;
-        case 0xab: printf("INP#");
-                   break;
-        case 0xb2: printf("KEY");
-                   break;
-        case 0xd9: printf("KILL");
-                   break;
-        case 0x9e: printf("LET");
-                   break;
-        case 0xa5: printf("LINE");
-                   break;
-        case 0x87: printf("LIST");
-                   break;
-        case 0xb4: printf("LOAD");
-                   break;
-        case 0xb6: printf("MERGE");
-                   break;
-        case 0xa2: printf("MODE");
+                   fprintf(out,"%c",body[i]);
                    break;
-        case 0xa7: printf("MOVE");
-                   break;
-        case 0x9f: printf("NEW");
-                   break;
-        case 0x8e: printf("NEXT");
-                   break;
-        case 0xa1: printf("OFF");
-                   break;
-        case 0x9d: printf("ON");
-                   break;
-        case 0xba: printf("OUT#");
-                   break;
-        case 0xbd: printf("PAGE");
-                   break;
-        case 0xae: printf("PCOLOR");
-                   break;
-        case 0xaf: printf("PHOME");
-                   break;
-        case 0xa4: printf("PLOT");
-                   break;
-        case 0xa0: printf("POKE");
-                   break;
-        case 0x8f: printf("PRINT");
-                   break;
-        case 0x95: printf("READ");
-                   break;
-        case 0x97: printf("REM");
+        case 0x97: fprintf(out,"%s",tokenssbasic[body[i]]);
                    inrem=true;
                    break;
-        case 0x8a: printf("RENUM");
-                   break;
-        case 0x85: printf("RESTORE");
-                   break;
-        case 0x86: printf("RESUME");
-                   break;
-        case 0x84: printf("RETURN");
-                   break;
-        case 0xa6: printf("RLINE");
-                   break;
-        case 0xa8: printf("RMOVE");
-                   break;
-        case 0xd0: printf("ROPEN");
-                   break;
-        case 0x83: printf("RUN");
-                   break;
-        case 0xb5: printf("SAVE");
-                   break;
-        case 0xa3: printf("SKIP");
-                   break;
-        case 0x99: printf("STOP");
-                   break;
-        case 0xbc: printf("TEST");
-                   break;
-        case 0xaa: printf("TROFF");
-                   break;
-        case 0xa9: printf("TRON");
-                   break;
-        case 0xc3: printf("USR");
-                   break;
-        case 0xce: printf("WOPEN");
-                   break;
-        case 0xec: printf("AND");
-                   break;
-        case 0xeb: printf("OR");
-                   break;
-        case 0xe7: printf("SPC");
-                   break;
-        case 0xe1: printf("STEP");
-                   break;
-        case 0xe6: printf("TAB");
-                   break;
-        case 0xe2: printf("THEN");
-                   break;
-        case 0xe0: printf("TO");
-                   break;
-        case 0xe3: printf("USING");
-                   break;
-        case 0xd2: printf("\ue0ff"); // pi
-                   break;
-        case 0xee: printf("><");
-                   break;
-        case 0xef: printf("<>");
-                   break;
-        case 0xf0: printf("=<");
-                   break;
-        case 0xf1: printf("<=");
-                   break;
-        case 0xf2: printf("=>");
-                   break;
-        case 0xf3: printf(">=");
-                   break;
-        case 0xf4: printf("=");
-                   break;
-        case 0xf5: printf(">");
-                   break;
-        case 0xf6: printf("<");
-                   break;
-        case 0xf7: printf("+");
-                   break;
-        case 0xf8: printf("-");
-                   break;
-        case 0xfb: printf("/");
-                   break;
-        case 0xfc: printf("*");
-                   break;
-        case 0xfd: printf("\ue05e"); // up arrow = exponentiation
-                   break;
-        case 0xfe: switch(body[++i]) {
-                     case 0xae: printf("BOOT");
-                                break;
-                     case 0xa6: printf("CLR");
-                                break;
-                     case 0x83: printf("COLOR");
-                                break;
-                     case 0xa4: printf("CURSOR");
-                                break;
-                     case 0xa7: printf("LIMIT");
-                                break;
-                     case 0xa2: printf("MUSIC");
-                                break;
-                     case 0x82: printf("RESET");
-                                break;
-                     case 0x81: printf("SET");
-                                break;
-                     case 0xa3: printf("TEMPO");
-                                break;
-                     case 0xa5: printf("VERIFY");
-                                break;
-                     default:   printf("UNKNOWN FE TOKEN");
-                                break;
-                   }
+        case 0xfe: if (tokenssbasicfe[body[++i]] != NULL)
+                     fprintf(out,"%s",tokenssbasicfe[body[i]]);
+                   else
+                     fprintf(out,"UNKNOWN FE TOKEN");
                    break;
-        case 0xff: switch(body[++i]) {
-                     case 0x81: printf("ABS");
-                                break;
-                     case 0xab: printf("ASC");
-                                break;
-                     case 0x8a: printf("ATN");
-                                break;
-                     case 0xa0: printf("CHR$");
-                                break;
-                     case 0x83: printf("COS");
-                                break;
-                     case 0x86: printf("EXP");
-                                break;
-                     case 0xc7: printf("FN");
-                                break;
-                     case 0xa2: printf("HEX$");
-                                break;
-                     case 0x80: printf("INT");
-                                break;
-                     case 0x9e: printf("JOY");
-                                break;
-                     case 0xba: printf("LEFT$");
-                                break;
-                     case 0xac: printf("LEN");
-                                break;
-                     case 0x85: printf("LN");
-                                break;
-                     case 0x8c: printf("LOG");
-                                break;
-                     case 0xbc: printf("MID$");
-                                break;
-                     case 0x8e: printf("PAI");
-                                break;
-                     case 0x89: printf("PEEK");
-                                break;
-                     case 0x8f: printf("RAD");
-                                break;
-                     case 0xbb: printf("RIGHT$");
-                                break;
-                     case 0x88: printf("RND");
-                                break;
-                     case 0x8b: printf("SGN");
-                                break;
-                     case 0x82: printf("SIN");
-                                break;
-                     case 0xb5: printf("SIZE");
-                                break;
-                     case 0x87: printf("SQR");
-                                break;
-                     case 0xc3: printf("STRING$");
-                                break;
-                     case 0x84: printf("TAN");
-                                break;
-                     case 0xad: printf("VAL");
-                                break;
-                     case 0x95: printf("EOF");
-                                break;
-                     case 0xb4: printf("ERL");
-                                break;
-                     case 0xb3: printf("ERN");
-                                break;
-                     case 0xc4: printf("TI$");
-                                break;
-                     default:   printf("UNKNOWN FF TOKEN");
-                                break;
-                   }
+        case 0xff: if (tokenssbasicff[body[++i]] != NULL)
+                     fprintf(out,"%s",tokenssbasicff[body[i]]);
+                   else
+                     fprintf(out,"UNKNOWN FF TOKEN");
                    break;
         default:   /* Not a token - use as a literal value */
-                   mzascii2utf8(body[i]);
+                   if (tokenssbasic[body[i]] != NULL)
+                     fprintf(out,"%s",tokenssbasic[body[i]]);
+                   else
+                     mzascii2utf8(body[i]);
                    break;
       }
     }
   }
 
-  printf("\n");
+  end_listing(i,fs,licount,linum,linestart);
+  fprintf(out,"\n");
+}
+
+/* Description of a tape file type */
+const char *mzf_type_name(uint8_t type)
+{
+  switch (type) {
+    case 0x01: return("machine code");
+    case 0x02: return("MZ-80 BASIC or other high level language");
+    case 0x03: return("MZ-80 data file");
+    case 0x04: return("MZ-700 data file");
+    case 0x05: return("MZ-700 BASIC or other high level language");
+    case 0x06: return("Chalkwell 3K BASIC");
+    default:   return("unknown file type");
+  }
 }
 
+const flowtokens flow5025   = {0x0d,0x80,0x81,0x88,0xad,0x89,0x8b,0x90,
+                               0x8c,0x8f,0x8e,0x98,0x83};
+const flowtokens flow5510   = {0x0d,0x8080,0x8081,0x808b,0x808c,0x808d,
+                               0x808e,0x8094,0x808f,0x8092,0x8091,0x809c,
+                               0x8086};
+const flowtokens flowsbasic = {0x00,0x97,0x94,0x93,0xe2,0x80,0x81,0x9d,
+                               0x84,0x98,0x99,0x85,0x83};
+
+const basicdef dialects[DIALECTS] = {
+  [0]         = {"unknown BASIC",0,0,0,NULL,{0},{NULL},NULL},
+  /* SP-5025 BASIC programs are loaded from 0x4806 onwards */
+  [MZ80K]     = {"SP-5025 BASIC",0x02,0x4806,MZ80K,print5025,
+                 {0},{tokens5025},&flow5025},
+  /* SA-5510 BASIC programs are loaded from 0x505C onwards */
+  [MZ80A]     = {"SA-5510 BASIC",0x02,0x505c,MZ80A,print5510,
+                 {0,0x8000},{tokens5510,tokens5510x},&flow5510},
+  /* S-BASIC programs have a file type of 0x05 */
+  [MZ700]     = {"S-BASIC",0x05,0,MZ700,printsbasic,{0,0xfe00,0xff00},
+                 {tokenssbasic,tokenssbasicfe,tokenssbasicff},&flowsbasic},
+  /* Chalkwell 3K BASIC for the MZ-80K has its own file type */
+  [CHALKWELL] = {"Chalkwell 3K BASIC",0x06,0,MZ80K,NULL,{0},{NULL},NULL}
+};
+
 uint16_t process_mzf_header(FILE *fp, char *mzf)
 {
   uint16_t i;
@@ -968,151 +634,5139 @@ uint16_t process_mzf_header(FILE *fp, char *mzf)
   for (i=0; i<MZFHEADERSIZE; i++)
     header[i]=getc(fp);
 
-  printf("\nTape header information for %s\n",mzf);
-  printf("============================");
+  fprintf(out,"\nTape header information for %s\n",mzf);
+  fprintf(out,"============================");
   for (i=0;i<strlen(mzf);i++)
-    printf("=");
-  printf("\n\nFile type: 0x%02x",header[0]);
-  switch (header[0]) {
-    case 0x01: printf(" - machine code\n");
-               break;
-    case 0x02: printf(" - MZ-80 BASIC or other high level language\n");
-               break;
-    case 0x03: printf(" - MZ-80 data file\n");
-               break;
-    case 0x04: printf(" - MZ-700 data file\n");
-               break;
-    case 0x05: printf(" - MZ-700 BASIC or other high level language\n");
-               break;
-    case 0x06: printf(" - Chalkwell 3K BASIC\n");
-               break;
-    default:   printf(" - unknown file type\n");
-               break;
-  }
+    fprintf(out,"=");
+  fprintf(out,"\n\nFile type: 0x%02x",header[0]);
+  fprintf(out," - %s\n",mzf_type_name(header[0]));
 
   i=1;
-  printf("File name: ");
+  fprintf(out,"File name: ");
   while ((header[i] != 0x0d) && (i<18)) {
     mzascii2utf8(header[i]);
     ++i;
   }
 
-  printf("\nFile size: ");
+  fprintf(out,"\nFile size: ");
   i=((header[19]<<8)&0xff00)|header[18];
-  printf("0x%04x (%d) bytes\n",i,i);
+  fprintf(out,"0x%04x (%d) bytes\n",i,i);
 
-  printf("Load addr: ");
+  fprintf(out,"Load addr: ");
   i=((header[21]<<8)&0xff00)|header[20];
-  printf("0x%04x (%d)\n",i,i);
+  fprintf(out,"0x%04x (%d)\n",i,i);
 
-  printf("Exec addr: ");
+  fprintf(out,"Exec addr: ");
   i=((header[23]<<8)&0xff00)|header[22];
-  printf("0x%04x (%d)\n",i,i);
+  fprintf(out,"0x%04x (%d)\n",i,i);
 
-  printf("\nFull 128 byte header in hexadecimal\n");
-  printf("-----------------------------------\n\n");
+  fprintf(out,"\nFull 128 byte header in hexadecimal\n");
+  fprintf(out,"-----------------------------------\n\n");
   for (i=0;i<MZFHEADERSIZE;i++) {
-    printf("%02x ",header[i]);
+    fprintf(out,"%02x ",header[i]);
     if ((i+1)%DISPLAYLEN==0)
-      printf("\n");
+      fprintf(out,"\n");
   }
 
-  printf("\n");
+  fprintf(out,"\n");
   return(((header[19]<<8)&0xff00)|header[18]);
 }
 
-void process_mzf_body(FILE *fp, uint16_t fs)
+/* Work out which BASIC, if any, the tape header belongs to */
+uint8_t basic_dialect(void)
+{
+  uint16_t load=(header[21]<<8)|header[20];
+
+  for (uint8_t d=1;d<DIALECTS;d++)
+    if ((header[0] == dialects[d].type) &&
+        ((dialects[d].load == 0) || (dialects[d].load == load)))
+      return(d);
+
+  return(0);
+}
+
+/* Data files, types 0x03 and 0x04, hold what a BASIC program wrote   */
+/* with PRINT/T after WOPEN. Each PRINT/T is a record of Sharp        */
+/* characters ended by 0x0d, its items separated by commas, strings   */
+/* perhaps in quotes and numbers as BASIC prints them. A 0x00 where a */
+/* record would start is the unused end of the last block.            */
+#define FIELD_NUMBER  0
+#define FIELD_STRING  1
+
+typedef struct {
+  uint8_t  kind;
+  uint32_t pos, len;           // Body offset and length, without quotes
+  double   value;
+} datafield;
+
+bool is_data_file(void)
+{
+  return((header[0] == 0x03) || (header[0] == 0x04));
+}
+
+/* Data files are in the character set of the machine that wrote them, */
+/* an MZ-80K for type 0x03 and an MZ-700 for type 0x04                 */
+uint8_t data_dialect(void)
+{
+  return((header[0] == 0x04) ? MZ700 : MZ80K);
+}
+
+/* Work out whether body[start..end) is a number or a string */
+void data_field(uint8_t *body, uint32_t start, uint32_t end, datafield *f)
+{
+  uint32_t s=start, e=end, i, digits=0;
+  char number[32];
+
+  while ((s < e) && (body[s] == ' '))
+    s++;
+  while ((e > s) && (body[e-1] == ' '))
+    e--;
+  f->kind=FIELD_STRING;
+  f->pos=start;
+  f->len=end-start;
+  if ((e-s >= 2) && (body[s] == '"') && (body[e-1] == '"')) {
+    f->pos=s+1;
+    f->len=e-s-2;
+    return;
+  }
+
+  i=s;
+  if ((i < e) && ((body[i] == '-') || (body[i] == '+')))
+    i++;
+  for (;(i < e) && (body[i] >= '0') && (body[i] <= '9');i++,digits++);
+  if ((i < e) && (body[i] == '.'))
+    for (i++;(i < e) && (body[i] >= '0') && (body[i] <= '9');i++,digits++);
+  if ((digits > 0) && (i < e) && (body[i] == 'E')) {
+    uint32_t exp=0;
+    if ((++i < e) && ((body[i] == '-') || (body[i] == '+')))
+      i++;
+    for (;(i < e) && (body[i] >= '0') && (body[i] <= '9');i++,exp++);
+    if (exp == 0)
+      digits=0;
+  }
+  if ((digits > 0) && (i == e) && (e-s < sizeof(number))) {
+    memcpy(number,body+s,e-s);
+    number[e-s]='\0';
+    f->value=strtod(number,NULL);
+    if (isfinite(f->value)) {
+      f->kind=FIELD_NUMBER;
+      f->pos=s;
+      f->len=e-s;
+    }
+  }
+}
+
+/* Split the record at body[*pos] into fields, which has room for one */
+/* more than the bytes left, and move *pos past it. Returns the number */
+/* of fields, or -1 at the end of the data.                           */
+int next_record(uint8_t *body, uint16_t fs, uint32_t *pos, datafield *f)
+{
+  uint32_t i=*pos;
+  int n=0;
+
+  if ((i >= fs) || (body[i] == 0x00))
+    return(-1);
+  do {
+    uint32_t start=(n == 0) ? i : ++i;
+    bool quoted=false;
+    while ((i < fs) && (body[i] != 0x0d) && (body[i] != 0x00) &&
+           (quoted || (body[i] != ','))) {
+      if (body[i] == '"')
+        quoted=!quoted;
+      i++;
+    }
+    data_field(body,start,i,&f[n++]);
+  } while ((i < fs) && (body[i] == ','));
+  if ((i < fs) && (body[i] == 0x0d))
+    i++;
+  *pos=i;
+
+  return(n);
+}
+
+/* Print the records of a data file, strings quoted */
+void print_records(uint8_t *body, uint16_t fs)
+{
+  datafield *f=malloc((fs+1)*sizeof(datafield));
+  uint32_t pos=0, r=0;
+  int n;
+
+  mzmc=data_dialect();
+  fprintf(out,"\n\nData records\n\n");
+  while ((n=next_record(body,fs,&pos,f)) >= 0) {
+    fprintf(out,"%5u ",++r);
+    for (int k=0;k<n;k++) {
+      fprintf(out,"%s",(k > 0) ? ", " : "");
+      if (f[k].kind == FIELD_NUMBER)
+        fprintf(out,"%.9g",f[k].value);
+      else {
+        fprintf(out,"\"");
+        for (uint32_t i=f[k].pos;i<f[k].pos+f[k].len;i++)
+          mzascii2utf8(body[i]);
+        fprintf(out,"\"");
+      }
+    }
+    fprintf(out,"\n");
+  }
+  free(f);
+}
+
+/* Print the BASIC listing if the header shows a known BASIC, or the  */
+/* records of a data file. Returns false if there is nothing to list. */
+bool print_listing(uint8_t *body, uint16_t fs)
+{
+  /* Convert BASIC tokens and print file again if it is a known BASIC */
+  mzmc=basic_dialect();
+  listerr.truncated=false;
+  if (dialects[mzmc].print != NULL) {
+    dialects[mzmc].print(body,fs);
+    if (listerr.truncated)
+      fprintf(out,"Listing truncated: line %d at body offset 0x%04x runs past"
+                  " the end of the file\n",listerr.line,listerr.offset);
+    return(true);
+  }
+
+  if (is_data_file()) {
+    print_records(body,fs);
+    return(true);
+  }
+  if (mzmc != 0)
+    fprintf(out,"\n\nUnable to list %s programs\n",dialects[mzmc].name);
+  else if (header[0]==0x02)
+    fprintf(out,"\n\nUnable to determine BASIC (?) type from file header\n");
+
+  return(false);
+}
+
+/* Print the body in hexadecimal, DISPLAYLEN bytes to a row with the */
+/* same bytes as Sharp characters alongside                         */
+void print_hex(uint8_t *body, uint16_t fs)
 {
   int32_t i;
-  uint8_t body[fs];
 
-  printf("\nFile body in hexadecimal and UTF-8\n");
-  printf("---------------------------------\n\n");
-  for (i=0;i<fs;i++)
-    body[i]=getc(fp);
+  fprintf(out,"\nFile body in hexadecimal and UTF-8\n");
+  fprintf(out,"---------------------------------\n\n");
 
   for (i=0;i<fs;i++) {
-    printf("%02x ",body[i]);
+    fprintf(out,"%02x ",body[i]);
     if ((i+1)%DISPLAYLEN==0) {
-      printf("    ");
+      fprintf(out,"    ");
       for (uint8_t j=DISPLAYLEN;j>0;j--) 
         mzascii2utf8(body[(i-j)+1]);
-      printf("\n");
+      fprintf(out,"\n");
     }
   }
 
   if (fs%DISPLAYLEN!=0) {
     int32_t j=i;
     while ((j++)%DISPLAYLEN!=0) 
-      printf("   ");
+      fprintf(out,"   ");
     while (i%DISPLAYLEN!=0)
       --i;
-    printf("    ");
+    fprintf(out,"    ");
     for (j=i;j<fs;j++)
       mzascii2utf8(body[j]);
   }
+}
+
+void process_mzf_body(FILE *fp, uint16_t fs)
+{
+  uint8_t *body=new_body(fs);
+  uint16_t got=fread(body,1,fs,fp);
+
+  if (got < fs)
+    fprintf(out,"\nFile body truncated: %d of %d bytes present\n",got,fs);
+
+  print_hex(body,got);
+  print_listing(body,got);
+
+  fprintf(out,"\n");
+  free(body);
+  return;
+}
+
+/* Read the header of a tape file into header and return its body, with */
+/* its size in fs. That is less than the header says if the file is     */
+/* truncated. Returns NULL if it can't be read.                         */
+uint8_t *read_mzf(char *mzf, uint16_t *fs)
+{
+  uint8_t *body;
+  uint16_t got;
+  FILE *fp;
+
+  fp = fopen(mzf, "r");
+  if (fp == NULL) {
+    fprintf(stderr,"Error: %s not found\n",mzf);
+    return(NULL);
+  }
+  if (fread(header,1,MZFHEADERSIZE,fp) != MZFHEADERSIZE) {
+    fprintf(stderr,"Error: %s has no tape header\n",mzf);
+    fclose(fp);
+    return(NULL);
+  }
+  *fs=((header[19]<<8)&0xff00)|header[18];
+  body=new_body(*fs);
+  got=fread(body,1,*fs,fp);
+  if (got != *fs) {
+    fprintf(stderr,"Warning: %s is shorter than its header says\n",mzf);
+    *fs=got;
+  }
+  fclose(fp);
+
+  return(body);
+}
+
+#define VARNAMELEN   16        // Longest variable name kept, plus $ and \0
+#define VARSLOTS   4096        // Variable hash table size, a power of 2
+#define NOLINE  0xffffffff     // Line number not in the program
+
+/* Kinds of item in a line of tokenised BASIC */
+#define ITEM_CHAR    0         // A character that is not part of anything else
+#define ITEM_STRING  1         // "..." including the quotes
+#define ITEM_TOKEN   2         // Keyword, function or operator token
+#define ITEM_NUMBER  3         // Numeric constant
+#define ITEM_HEX     4         // S-BASIC $ hex constant
+#define ITEM_LINE    5         // S-BASIC line number operand
+#define ITEM_VAR     6         // Variable name
+
+typedef struct {
+  uint8_t  kind;
+  uint16_t tok;                // Token, two byte tokens with first byte high
+  uint32_t pos, len;           // Body offset and length of the item
+  float    value;              // Value of a number, hex value or line number
+  char     name[VARNAMELEN+2]; // Variable name, with $ for strings
+} item;
+
+/* Byte at body[i], or 0 beyond the end of the body */
+uint8_t body_at(uint8_t *body, uint16_t fs, uint32_t i)
+{
+  return((i < fs) ? body[i] : 0);
+}
+
+/* Value of an S-BASIC number held as an exponent byte and a 4 byte */
+/* mantissa, worked out the same way printsbasic does.              */
+float sbasic_value(uint8_t *body, uint16_t fs, uint32_t i)
+{
+  int exponent=body_at(body,fs,i);
+  float value=0.5;
+  bool positivemantissa=true;
 
-  /* Convert SP-BASIC tokens and print file again if the file type is 0x02 */
-  /* SP-5025 BASIC programs are loaded from 0x4806 onwards                 */
-  if ((header[0]==0x02) && (header[20]==0x06) && (header[21]==0x48)) {
-    mzmc=MZ80K;
-    print5025(body,fs);
+  if (exponent == 0)
+    return(0);
+  exponent-=0x80;
+  if (body_at(body,fs,i+1) & 0x80)
+    positivemantissa=false;
+  for (uint8_t j=0;j<4;j++) {
+    uint8_t bits=body_at(body,fs,i+1+j);
+    for (uint8_t k=(j == 0) ? 2 : 1;k<=8;k++)
+      if (bits & (0x100>>k))
+        value += powf(2,-(j*8+k));
   }
+  if (positivemantissa)
+    value *= powf(2,exponent);
+  else
+    value *= powf(2,-1*exponent);
+
+  return(value);
+}
+
+/* Read the next item of a line of BASIC from body[*pos] and move *pos */
+/* past it. Returns false at the end of the line.                     */
+bool next_item(uint8_t dialect, uint8_t *body, uint16_t fs, uint32_t *pos,
+               item *it)
+{
+  uint8_t term=(dialect == MZ700) ? 0x00 : 0x0d;
+  uint32_t i=*pos;
+  uint8_t b, leng;
+
+  if ((i >= fs) || (body[i] == term))
+    return(false);
+
+  b=body[i];
+  it->pos=i;
+  it->tok=0;
+  it->value=0;
 
-  /* Convert SA-BASIC tokens and print file again if the file type is 0x02 */
-  /* SA-5510 BASIC programs are loaded from 0x505C onwards                 */
-  else if ((header[0]==0x02) && (header[20]==0x5C) && (header[21]==0x50)) {
-    mzmc=MZ80A;
-    print5510(body,fs);
+  if (b == 0x22) {
+    /* Strings run to the closing quote or the end of the line */
+    it->kind=ITEM_STRING;
+    ++i;
+    while ((i < fs) && (body[i] != 0x22) && (body[i] != term))
+      ++i;
+    if ((i < fs) && (body[i] == 0x22))
+      ++i;
+  }
+  else if (dialect == MZ700) {
+    switch (b) {
+      case 0x03: /* String and numeric variables, length then name */
+      case 0x05: it->kind=ITEM_VAR;
+                 leng=body_at(body,fs,i+1);
+                 i+=2;
+                 for (uint8_t j=0;(j<leng)&&(j<VARNAMELEN);j++)
+                   it->name[j]=body_at(body,fs,i+j);
+                 it->name[(leng < VARNAMELEN) ? leng : VARNAMELEN]='\0';
+                 if (b == 0x03)
+                   strcat(it->name,"$");
+                 /* Numeric variables are followed by a 5 byte value */
+                 i+=leng+((b == 0x05) ? 5 : 0);
+                 break;
+      case 0x15: it->kind=ITEM_NUMBER;
+                 it->value=sbasic_value(body,fs,i+1);
+                 i+=6;
+                 break;
+      case 0x11: it->kind=ITEM_HEX;
+                 it->value=(body_at(body,fs,i+2)<<8)|body_at(body,fs,i+1);
+                 i+=3;
+                 break;
+      case 0x0b: it->kind=ITEM_LINE;
+                 it->value=(body_at(body,fs,i+2)<<8)|body_at(body,fs,i+1);
+                 i+=3;
+                 break;
+      case 0xfe:
+      case 0xff: it->kind=ITEM_TOKEN;
+                 it->tok=(b<<8)|body_at(body,fs,i+1);
+                 i+=2;
+                 break;
+      default:   it->kind=(b >= 0x80) ? ITEM_TOKEN : ITEM_CHAR;
+                 it->tok=b;
+                 ++i;
+                 break;
+    }
+  }
+  else if (b >= 0x80) {
+    /* SA-5510 keywords are 0x80 followed by a second byte */
+    it->kind=ITEM_TOKEN;
+    if ((dialect == MZ80A) && (b == 0x80)) {
+      it->tok=0x8000|body_at(body,fs,i+1);
+      i+=2;
+    }
+    else {
+      it->tok=b;
+      ++i;
+    }
+  }
+  else if (((b >= '0') && (b <= '9')) ||
+           ((b == '.') && (body_at(body,fs,i+1) >= '0') &&
+                          (body_at(body,fs,i+1) <= '9'))) {
+    /* SP-5025 and SA-5510 numbers and line numbers are ASCII */
+    char num[32];
+    uint8_t n=0;
+    while ((i < fs) && (((body[i] >= '0') && (body[i] <= '9')) ||
+                        (body[i] == '.'))) {
+      if (n < sizeof(num)-1)
+        num[n++]=body[i];
+      ++i;
+    }
+    if ((body_at(body,fs,i) == 'E') && (body_at(body,fs,i+1) >= '0') &&
+                                      (body_at(body,fs,i+1) <= '9'))
+      for (num[n++]=body[i++];(i < fs) && (body[i] >= '0') &&
+                                          (body[i] <= '9');i++)
+        if (n < sizeof(num)-1)
+          num[n++]=body[i];
+    num[n]='\0';
+    it->kind=ITEM_NUMBER;
+    it->value=strtof(num,NULL);
+  }
+  else if ((b >= 'A') && (b <= 'Z')) {
+    /* Variable names are what is left of the letters */
+    uint8_t n=0;
+    it->kind=ITEM_VAR;
+    while ((i < fs) && (((body[i] >= 'A') && (body[i] <= 'Z')) ||
+                        ((body[i] >= '0') && (body[i] <= '9')))) {
+      if (n < VARNAMELEN)
+        it->name[n++]=body[i];
+      ++i;
+    }
+    if ((i < fs) && (body[i] == '$'))
+      it->name[n++]=body[i++];
+    it->name[n]='\0';
+  }
+  else {
+    it->kind=ITEM_CHAR;
+    it->tok=b;
+    ++i;
   }
 
-  else if ((header[0]==0x02))
-    printf("\n\nUnable to determine BASIC (?) type from file header\n");
+  if (i > fs)
+    i=fs;
+  it->len=i-it->pos;
+  *pos=i;
+  return(true);
+}
+
+/* Move *pos on to the end of the line, or to the end of the statement */
+/* if stmt is set, for the text of REM and DATA statements.            */
+void skip_text(uint8_t dialect, uint8_t *body, uint16_t fs, uint32_t *pos,
+               bool stmt)
+{
+  uint8_t term=(dialect == MZ700) ? 0x00 : 0x0d;
+  uint32_t i=*pos;
+  bool instr=false;
 
-  /* Convert S-BASIC tokens and print file again if the file type is 0x05 */
-  else if (header[0]==0x05) {
-    mzmc=MZ700;
-    printsbasic(body,fs);
+  while ((i < fs) && (body[i] != term) &&
+         (!stmt || instr || (body[i] != 0x3a))) {
+    if (body[i] == 0x22)
+      instr=!instr;
+    ++i;
   }
+  *pos=i;
+}
 
-  printf("\n");
-  return;
+/* Index of a BASIC program held in flat arrays. Lines are in program */
+/* order, and references and variable uses in the order they appear, */
+/* so the references from a line are contiguous from refstart[line].  */
+typedef struct {
+  const flowtokens *ft;
+  uint32_t nlines;
+  uint16_t *linenum;           // Line number of each line
+  uint32_t *start;             // Body offset of the line's first token
+  uint32_t *end;               // Body offset of the line's terminator
+  bool *falls;                 // Execution can run on to the next line
+  uint32_t *refstart;          // First reference made from each line
+  uint32_t nrefs;
+  uint32_t *refline;           // Line making each line number reference
+  uint32_t *refpos;            // Body offset of the line number
+  uint16_t *reftarget;         // Line number referenced
+  uint16_t *refkind;           // GOTO, GOSUB etc. token it belongs to
+  uint32_t nvars;
+  char (*varname)[VARNAMELEN+2];
+  uint32_t nuses;
+  uint32_t *usevar;            // Variable used
+  uint32_t *useline;           // Line it is used in
+  uint32_t *lineidx;           // Line number to line, NOLINE if missing
+} program;
+
+/* Add a reference to line number target from the current line */
+void add_ref(program *pg, uint32_t pos, uint16_t target, uint16_t kind)
+{
+  pg->refline[pg->nrefs]=pg->nlines;
+  pg->refpos[pg->nrefs]=pos;
+  pg->reftarget[pg->nrefs]=target;
+  pg->refkind[pg->nrefs++]=kind;
 }
 
-int main(int argc, char **argv)
+/* Add a use of the named variable in the current line */
+void add_var(program *pg, uint32_t *slots, char *name)
+{
+  uint32_t h=2166136261u;
+
+  for (char *c=name;*c;c++)
+    h=(h^(uint8_t)*c)*16777619u;
+
+  for (uint32_t n=0;n<VARSLOTS;n++) {
+    uint32_t *slot=&slots[(h+n)&(VARSLOTS-1)];
+    if (*slot == NOLINE) {
+      *slot=pg->nvars;
+      strcpy(pg->varname[pg->nvars++],name);
+    }
+    if (strcmp(pg->varname[*slot],name) == 0) {
+      pg->usevar[pg->nuses]=*slot;
+      pg->useline[pg->nuses++]=pg->nlines;
+      return;
+    }
+  }
+}
+
+/* Walk the token stream of a BASIC body once, building the line index, */
+/* line number references and variable uses.                           */
+void index_program(program *pg, uint8_t *body, uint16_t fs, uint8_t dialect)
+{
+  /* Every line, reference and variable use takes at least a byte, */
+  /* as little as "A:" or "1," in SP-5025 and SA-5510               */
+  uint32_t most=fs+1;
+  uint32_t *slots=malloc(VARSLOTS*sizeof(uint32_t));
+  uint32_t i=0;
+
+  memset(pg,0,sizeof(program));
+  pg->ft=dialects[dialect].flow;
+  pg->linenum=malloc(most*sizeof(uint16_t));
+  pg->start=malloc(most*sizeof(uint32_t));
+  pg->end=malloc(most*sizeof(uint32_t));
+  pg->falls=malloc(most*sizeof(bool));
+  pg->refstart=malloc((most+1)*sizeof(uint32_t));
+  pg->refline=malloc(most*sizeof(uint32_t));
+  pg->refpos=malloc(most*sizeof(uint32_t));
+  pg->reftarget=malloc(most*sizeof(uint16_t));
+  pg->refkind=malloc(most*sizeof(uint16_t));
+  pg->varname=malloc(most*sizeof(*pg->varname));
+  pg->usevar=malloc(most*sizeof(uint32_t));
+  pg->useline=malloc(most*sizeof(uint32_t));
+  pg->lineidx=malloc(65536*sizeof(uint32_t));
+  memset(slots,0xff,VARSLOTS*sizeof(uint32_t));
+  memset(pg->lineidx,0xff,65536*sizeof(uint32_t));
+
+  const flowtokens *ft=pg->ft;
+
+  /* Each line is a 2 byte link, a 2 byte line number then tokens up */
+  /* to the terminator. A zero link marks the end of the program.    */
+  while ((i+4 <= fs) && ((body[i] != 0x00) || (body[i+1] != 0x00))) {
+    uint16_t first=0, pending=0;
+    bool inon=false;
+    item it;
+
+    pg->linenum[pg->nlines]=(body[i+3]<<8)|body[i+2];
+    pg->refstart[pg->nlines]=pg->nrefs;
+    if (pg->lineidx[pg->linenum[pg->nlines]] == NOLINE)
+      pg->lineidx[pg->linenum[pg->nlines]]=pg->nlines;
+    i+=4;
+    pg->start[pg->nlines]=i;
+
+    while (next_item(dialect,body,fs,&i,&it)) {
+      switch (it.kind) {
+        case ITEM_CHAR:   if (it.tok == 0x3a) {
+                            /* End of statement */
+                            first=pending=0;
+                            inon=false;
+                          }
+                          /* Spaces and commas in ON lists keep a line */
+                          /* number pending                            */
+                          else if ((it.tok != 0x20) &&
+                                   ((it.tok != 0x2c) || !inon))
+                            pending=0;
+                          break;
+        case ITEM_VAR:    add_var(pg,slots,it.name);
+                          pending=0;
+                          break;
+        case ITEM_NUMBER: /* Line numbers are ASCII in SP-5025 and SA-5510 */
+                          if ((pending != 0) && (dialect != MZ700))
+                            add_ref(pg,it.pos,(uint32_t)it.value&0xffff,
+                                    pending);
+                          if (!inon)
+                            pending=0;
+                          break;
+        case ITEM_LINE:   add_ref(pg,it.pos+1,it.value,pending);
+                          if (!inon)
+                            pending=0;
+                          break;
+        case ITEM_TOKEN:  if (first == 0)
+                            first=it.tok;
+                          if (it.tok == ft->rem)
+                            skip_text(dialect,body,fs,&i,false);
+                          else if (it.tok == ft->data)
+                            skip_text(dialect,body,fs,&i,true);
+                          else if ((it.tok == ft->gotok) ||
+                                   (it.tok == ft->gosub) ||
+                                   (it.tok == ft->then) ||
+                                   (it.tok == ft->restore) ||
+                                   (it.tok == ft->run))
+                            pending=it.tok;
+                          else if (it.tok == ft->on)
+                            inon=true;
+                          else
+                            pending=0;
+                          break;
+        default:          pending=0;
+                          break;
+      }
+    }
+
+    /* Execution only stops at the end of a line on an unconditional */
+    /* GOTO, RETURN, END or STOP statement                          */
+    pg->falls[pg->nlines]=!((first == ft->gotok) || (first == ft->ret) ||
+                            (first == ft->end) || (first == ft->stop));
+    pg->end[pg->nlines++]=i++;
+  }
+
+  pg->refstart[pg->nlines]=pg->nrefs;
+  free(slots);
+}
+
+void free_program(program *pg)
+{
+  free(pg->linenum);
+  free(pg->start);
+  free(pg->end);
+  free(pg->falls);
+  free(pg->refstart);
+  free(pg->refline);
+  free(pg->refpos);
+  free(pg->reftarget);
+  free(pg->refkind);
+  free(pg->varname);
+  free(pg->usevar);
+  free(pg->useline);
+  free(pg->lineidx);
+}
+
+/* Name of a flow token */
+const char *flowname(const flowtokens *ft, uint16_t tok)
+{
+  if (tok == ft->gotok)   return("GOTO");
+  if (tok == ft->gosub)   return("GOSUB");
+  if (tok == ft->then)    return("THEN");
+  if (tok == ft->restore) return("RESTORE");
+  if (tok == ft->run)     return("RUN");
+  return("line");
+}
+
+void print_underline(const char *title)
+{
+  fprintf(out,"\n%s\n",title);
+  for (size_t i=0;i<strlen(title);i++)
+    fprintf(out,"-");
+  fprintf(out,"\n\n");
+}
+
+/* Report dangling line number references, unreachable lines, variable */
+/* use and a cross-reference of line numbers. Everything is a single   */
+/* pass over the flat arrays of the program index.                     */
+void analyse_listing(uint8_t *body, uint16_t fs, char *mzf)
+{
+  program pg;
+  uint32_t *stack, *xref, *xstart, sp=0, found;
+  uint8_t *seen;
+
+  fprintf(out,"\nLine number analysis for %s\n",mzf);
+  fprintf(out,"=========================");
+  for (size_t i=0;i<strlen(mzf);i++)
+    fprintf(out,"=");
+  fprintf(out,"\n");
+
+  mzmc=basic_dialect();
+  if (dialects[mzmc].print == NULL) {
+    fprintf(out,"\nNot a BASIC program that can be analysed\n");
+    return;
+  }
+
+  index_program(&pg,body,fs,mzmc);
+  fprintf(out,"\nLines: %u  Line number references: %u  Variables: %u\n",
+          pg.nlines,pg.nrefs,pg.nvars);
+
+  /* Line numbers must go up through the program */
+  print_underline("Lines out of order or repeated");
+  found=0;
+  for (uint32_t l=1;l<pg.nlines;l++)
+    if (pg.linenum[l] <= pg.linenum[l-1]) {
+      fprintf(out," %d follows %d\n",pg.linenum[l],pg.linenum[l-1]);
+      ++found;
+    }
+  if (found == 0)
+    fprintf(out," None\n");
+
+  print_underline("References to lines that do not exist");
+  found=0;
+  for (uint32_t r=0;r<pg.nrefs;r++)
+    if (pg.lineidx[pg.reftarget[r]] == NOLINE) {
+      fprintf(out," %d %s %d\n",pg.linenum[pg.refline[r]],
+              flowname(pg.ft,pg.refkind[r]),pg.reftarget[r]);
+      ++found;
+    }
+  if (found == 0)
+    fprintf(out," None\n");
+
+  /* Follow the control flow graph from the first line. RESTORE only */
+  /* moves the DATA pointer, so it doesn't lead anywhere.             */
+  stack=malloc((pg.nlines+1)*sizeof(uint32_t));
+  seen=calloc(pg.nlines+1,1);
+  if (pg.nlines > 0) {
+    stack[sp++]=0;
+    seen[0]=1;
+  }
+  while (sp > 0) {
+    uint32_t l=stack[--sp];
+    if (pg.falls[l] && (l+1 < pg.nlines) && !seen[l+1]) {
+      seen[l+1]=1;
+      stack[sp++]=l+1;
+    }
+    for (uint32_t r=pg.refstart[l];r<pg.refstart[l+1];r++) {
+      uint32_t t=pg.lineidx[pg.reftarget[r]];
+      if ((pg.refkind[r] != pg.ft->restore) && (t != NOLINE) && !seen[t]) {
+        seen[t]=1;
+        stack[sp++]=t;
+      }
+    }
+  }
+
+  print_underline("Lines that can never be reached");
+  found=0;
+  for (uint32_t l=0;l<pg.nlines;l++)
+    if (!seen[l]) {
+      fprintf(out," %d",pg.linenum[l]);
+      if ((++found)%10 == 0)
+        fprintf(out,"\n");
+    }
+  if (found == 0)
+    fprintf(out," None\n");
+  else if (found%10 != 0)
+    fprintf(out,"\n");
+
+  /* Group references by the line they refer to with a counting sort */
+  xstart=calloc(pg.nlines+1,sizeof(uint32_t));
+  xref=malloc((pg.nrefs+1)*sizeof(uint32_t));
+  for (uint32_t r=0;r<pg.nrefs;r++)
+    if (pg.lineidx[pg.reftarget[r]] != NOLINE)
+      ++xstart[pg.lineidx[pg.reftarget[r]]+1];
+  for (uint32_t l=0;l<pg.nlines;l++)
+    xstart[l+1]+=xstart[l];
+  for (uint32_t r=0;r<pg.nrefs;r++)
+    if (pg.lineidx[pg.reftarget[r]] != NOLINE)
+      xref[xstart[pg.lineidx[pg.reftarget[r]]]++]=r;
+
+  print_underline("Line cross-reference");
+  found=0;
+  for (uint32_t l=0,r=0;l<pg.nlines;l++) {
+    if (r == xstart[l])
+      continue;
+    fprintf(out," %5d <-",pg.linenum[l]);
+    for (;r<xstart[l];r++)
+      fprintf(out," %d %s%s",pg.linenum[pg.refline[xref[r]]],
+              flowname(pg.ft,pg.refkind[xref[r]]),(r+1<xstart[l]) ? "," : "");
+    fprintf(out,"\n");
+    ++found;
+  }
+  if (found == 0)
+    fprintf(out," None\n");
+
+  /* Same again for the lines each variable is used in */
+  print_underline("Variable cross-reference");
+  free(xstart);
+  free(xref);
+  xstart=calloc(pg.nvars+1,sizeof(uint32_t));
+  xref=malloc((pg.nuses+1)*sizeof(uint32_t));
+  for (uint32_t u=0;u<pg.nuses;u++)
+    ++xstart[pg.usevar[u]+1];
+  for (uint32_t v=0;v<pg.nvars;v++)
+    xstart[v+1]+=xstart[v];
+  for (uint32_t u=0;u<pg.nuses;u++)
+    xref[xstart[pg.usevar[u]]++]=pg.useline[u];
+  for (uint32_t v=0,u=0;v<pg.nvars;v++) {
+    fprintf(out," %-8s",pg.varname[v]);
+    for (uint32_t last=NOLINE;u<xstart[v];u++)
+      if (xref[u] != last) {
+        fprintf(out," %d",pg.linenum[xref[u]]);
+        last=xref[u];
+      }
+    fprintf(out,"\n");
+  }
+  if (pg.nvars == 0)
+    fprintf(out," None\n");
+
+  free(xstart);
+  free(xref);
+  free(stack);
+  free(seen);
+  free_program(&pg);
+}
+
+/* Text of a token in a BASIC, or NULL if it is not a token */
+const char *token_text(uint8_t dialect, uint16_t tok)
+{
+  const basicdef *d=&dialects[dialect];
+
+  for (uint8_t p=0;(p<3)&&(d->tables[p]!=NULL);p++)
+    if ((tok&0xff00) == d->planes[p])
+      return(d->tables[p][tok&0xff]);
+
+  return(NULL);
+}
+
+/* Keywords that are spelt differently but do the same thing */
+const char *aliases[][2] = {{"INP#","INP@"},{"OUT#","OUT@"}};
+
+/* Keywords that are the same in each BASIC but whose arguments or */
+/* effect depend on the machine, so need checking after conversion */
+const char *cautions[] = {"MUSIC","TEMPO","SET","RESET","POKE","PEEK(",
+                          "PEEK","USR(","USR","LIMIT","CURSOR","CSR"};
+
+/* Compare keywords, ignoring the ( some BASICs make part of a function */
+bool same_keyword(const char *a, const char *b)
+{
+  size_t la=strlen(a), lb=strlen(b);
+
+  if ((la > 1) && (a[la-1] == '('))
+    --la;
+  if ((lb > 1) && (b[lb-1] == '('))
+    --lb;
+  if ((la == lb) && (strncmp(a,b,la) == 0))
+    return(true);
+
+  for (uint8_t n=0;n<sizeof(aliases)/sizeof(aliases[0]);n++)
+    if (((strcmp(a,aliases[n][0]) == 0) && (strcmp(b,aliases[n][1]) == 0)) ||
+        ((strcmp(a,aliases[n][1]) == 0) && (strcmp(b,aliases[n][0]) == 0)))
+      return(true);
+
+  return(false);
+}
+
+/* Find the token for a keyword in a BASIC, returning 0 if there is none */
+uint16_t find_token(uint8_t dialect, const char *text)
+{
+  for (uint8_t p=0;p<3;p++) {
+    if ((p > 0) && (dialects[dialect].planes[p] == 0))
+      break;
+    for (uint16_t b=0;b<256;b++) {
+      const char *t=token_text(dialect,dialects[dialect].planes[p]|b);
+      if ((t != NULL) && same_keyword(text,t))
+        return(dialects[dialect].planes[p]|b);
+    }
+  }
+  return(0);
+}
+
+/* Output buffer for a converted body */
+typedef struct {
+  uint8_t *b;
+  uint32_t n, max;
+} obuf;
+
+void emit(obuf *o, uint8_t c)
+{
+  if (o->n < o->max)
+    o->b[o->n]=c;
+  ++o->n;
+}
+
+void emit_token(obuf *o, uint16_t tok)
+{
+  if (tok > 0xff)
+    emit(o,tok>>8);
+  emit(o,tok&0xff);
+}
+
+void emit_text(obuf *o, const char *text)
+{
+  /* The up arrow is written as its private use area code point */
+  if (strcmp(text,"") == 0)
+    emit(o,0x5e);
+  else
+    while (*text)
+      emit(o,*text++);
+}
+
+void emit_bytes(obuf *o, uint8_t *body, uint32_t pos, uint32_t len)
+{
+  for (uint32_t i=0;i<len;i++)
+    emit(o,body[pos+i]);
+}
+
+/* Write a number as SP-5025 and SA-5510 BASIC would show it */
+void emit_number(obuf *o, float value)
+{
+  char num[32], *c;
+
+  snprintf(num,sizeof(num),"%g",value);
+  for (c=num;*c;c++)
+    if (*c == 'e')
+      emit(o,'E');
+    else if ((*c != '+') || (c == num))
+      emit(o,*c);
+}
+
+/* Write a number in the 5 byte S-BASIC form, an exponent then a sign */
+/* and mantissa with the top bit of the mantissa taken as read         */
+void emit_sbasic_number(obuf *o, float value)
+{
+  uint32_t mantissa;
+  int exponent;
+  float m;
+
+  if (value == 0) {
+    for (uint8_t j=0;j<5;j++)
+      emit(o,0x00);
+    return;
+  }
+  m=frexpf(fabsf(value),&exponent);
+  mantissa=(uint32_t)ldexpf(m-0.5,32)&0x7fffffff;
+  if (value < 0)
+    mantissa|=0x80000000;
+  emit(o,0x80+exponent);
+  for (int8_t j=24;j>=0;j-=8)
+    emit(o,mantissa>>j);
+}
+
+/* Translation and renumbering state for a program */
+typedef struct {
+  uint8_t from, to;
+  uint16_t tokmap[3*256];      // Source token to target token, 0 for none
+  uint16_t chartok[128];       // Target token for an operator character
+  uint16_t first, step;        // Renumbering, first 0 to keep numbers
+  const flowtokens *ft;
+  uint32_t problems;
+} translation;
+
+/* Index of a source token in the token map */
+uint16_t tokmap_index(uint16_t tok)
+{
+  switch (tok>>8) {
+    case 0x80:
+    case 0xfe: return(0x100|(tok&0xff));
+    case 0xff: return(0x200|(tok&0xff));
+  }
+  return(tok&0xff);
+}
+
+/* Build the token to token map from one BASIC to another. Each token */
+/* is looked up by name once, so translating is a table lookup.       */
+void init_translation(translation *tr, uint8_t from, uint8_t to)
+{
+  memset(tr,0,sizeof(translation));
+  tr->from=from;
+  tr->to=to;
+  tr->ft=dialects[from].flow;
+
+  for (uint8_t p=0;p<3;p++) {
+    if ((p > 0) && (dialects[from].planes[p] == 0))
+      break;
+    for (uint16_t b=0;b<256;b++) {
+      uint16_t tok=dialects[from].planes[p]|b;
+      const char *t=token_text(from,tok);
+      if (t != NULL)
+        tr->tokmap[tokmap_index(tok)]=find_token(to,t);
+    }
+  }
+
+  /* Operators that are plain characters in SA-5510 are tokens elsewhere */
+  for (uint8_t c=0x20;c<0x80;c++) {
+    char op[2]={c,'\0'};
+    if (strchr("*+-/=<>",c) != NULL)
+      tr->chartok[c]=find_token(to,op);
+  }
+  tr->chartok[0x5e]=find_token(to,"");
+}
+
+/* Translate the body of a program from one BASIC to another, renumbering */
+/* it on the way if asked to. Works straight from token to token. Returns */
+/* the size of the new body in o.                                         */
+void translate_program(translation *tr, uint8_t *body, uint16_t fs,
+                       uint16_t loadaddr, obuf *o)
 {
+  const flowtokens *ft=tr->ft;
+  program pg;
+  item it, next;
+
+  index_program(&pg,body,fs,tr->from);
+
+  for (uint32_t l=0;l<pg.nlines;l++) {
+    uint32_t linestart=o->n, i=pg.start[l], la;
+    uint16_t linenum=pg.linenum[l], pending=0;
+    bool inon=false, skipparen=false;
+
+    if (tr->first != 0)
+      linenum=tr->first+l*tr->step;
+
+    /* Link, filled in at the end of the line, then the line number */
+    emit(o,0);
+    emit(o,0);
+    emit(o,linenum&0xff);
+    emit(o,linenum>>8);
+
+    while (next_item(tr->from,body,fs,&i,&it)) {
+      if (skipparen) {
+        skipparen=false;
+        if ((it.kind == ITEM_CHAR) && (it.tok == '('))
+          continue;
+      }
+
+      /* Line numbers, renumbered if they are in the program */
+      if ((it.kind == ITEM_LINE) ||
+          ((it.kind == ITEM_NUMBER) && (pending != 0) && (tr->from != MZ700))) {
+        uint32_t target=pg.lineidx[(uint32_t)it.value&0xffff];
+        uint16_t n=it.value;
+        if ((tr->first != 0) && (target != NOLINE))
+          n=tr->first+target*tr->step;
+        else if (tr->first != 0)
+          fprintf(out," line %d: line %d does not exist, left unchanged\n",
+                  pg.linenum[l],n);
+        if (tr->to == MZ700) {
+          emit(o,0x0b);
+          emit(o,n&0xff);
+          emit(o,n>>8);
+        }
+        else
+          emit_number(o,n);
+        if (!inon)
+          pending=0;
+        continue;
+      }
+
+      switch (it.kind) {
+        case ITEM_CHAR:   if (it.tok == 0x3a) {
+                            pending=0;
+                            inon=false;
+                          }
+                          else if ((it.tok != 0x20) &&
+                                   ((it.tok != 0x2c) || !inon))
+                            pending=0;
+                          if ((it.tok < 0x80) && (tr->chartok[it.tok] != 0))
+                            emit_token(o,tr->chartok[it.tok]);
+                          else
+                            emit(o,it.tok);
+                          break;
+        case ITEM_STRING: emit_bytes(o,body,it.pos,it.len);
+                          pending=0;
+                          break;
+        case ITEM_NUMBER: if (tr->from == tr->to)
+                            emit_bytes(o,body,it.pos,it.len);
+                          else if (tr->to == MZ700) {
+                            emit(o,0x15);
+                            emit_sbasic_number(o,it.value);
+                          }
+                          else if (tr->from == MZ700)
+                            emit_number(o,it.value);
+                          else
+                            emit_bytes(o,body,it.pos,it.len);
+                          pending=0;
+                          break;
+        case ITEM_HEX:    if (tr->to == MZ700)
+                            emit_bytes(o,body,it.pos,it.len);
+                          else
+                            emit_number(o,it.value);
+                          pending=0;
+                          break;
+        case ITEM_VAR:    if (tr->to != MZ700)
+                            emit_text(o,it.name);
+                          else {
+                            /* Name without its $, numbers with a value */
+                            uint8_t leng=strlen(it.name);
+                            bool isstr=(it.name[leng-1] == '$');
+                            emit(o,isstr ? 0x03 : 0x05);
+                            emit(o,leng-isstr);
+                            for (uint8_t j=0;j<leng-isstr;j++)
+                              emit(o,it.name[j]);
+                            if (!isstr && (tr->from == MZ700))
+                              emit_bytes(o,body,it.pos+it.len-5,5);
+                            else if (!isstr)
+                              emit_sbasic_number(o,0);
+                          }
+                          pending=0;
+                          break;
+        case ITEM_TOKEN:  {
+                          const char *src=token_text(tr->from,it.tok);
+                          uint16_t tok=tr->tokmap[tokmap_index(it.tok)];
+                          const char *dst;
+
+                          if (src == NULL) {
+                            /* Not a known token, keep it as it is */
+                            emit_bytes(o,body,it.pos,it.len);
+                            break;
+                          }
+
+                          /* DEF FN is one token in some BASICs, two in */
+                          /* others                                     */
+                          la=i;
+                          if ((tok == 0) && (strchr(src,' ') != NULL)) {
+                            char words[16], *w;
+                            strncpy(words,src,sizeof(words)-1);
+                            words[sizeof(words)-1]='\0';
+                            w=strchr(words,' ');
+                            *w++='\0';
+                            if ((find_token(tr->to,words) != 0) &&
+                                (find_token(tr->to,w) != 0)) {
+                              emit_token(o,find_token(tr->to,words));
+                              emit_token(o,find_token(tr->to,w));
+                              break;
+                            }
+                          }
+                          else if ((tok == 0) &&
+                                   next_item(tr->from,body,fs,&la,&next) &&
+                                   (next.kind == ITEM_TOKEN) &&
+                                   (token_text(tr->from,next.tok) != NULL)) {
+                            char words[32];
+                            snprintf(words,sizeof(words),"%s %s",src,
+                                     token_text(tr->from,next.tok));
+                            if (find_token(tr->to,words) != 0) {
+                              emit_token(o,find_token(tr->to,words));
+                              i=la;
+                              break;
+                            }
+                          }
+
+                          if (tok == 0) {
+                            fprintf(out," line %d: %s has no equivalent in"
+                                    " %s, left as text\n",pg.linenum[l],src,
+                                    dialects[tr->to].name);
+                            ++tr->problems;
+                            emit_text(o,src);
+                            break;
+                          }
+                          emit_token(o,tok);
+
+                          /* Match the ( that some BASICs put in the token */
+                          dst=token_text(tr->to,tok);
+                          if ((src[strlen(src)-1] == '(') &&
+                              (dst[strlen(dst)-1] != '('))
+                            emit(o,'(');
+                          else if ((src[strlen(src)-1] != '(') &&
+                                   (dst[strlen(dst)-1] == '('))
+                            skipparen=true;
+
+                          for (uint8_t n=0;
+                               n<sizeof(cautions)/sizeof(cautions[0]);n++)
+                            if ((tr->from != tr->to) &&
+                                (strcmp(src,cautions[n]) == 0))
+                              fprintf(out," line %d: %s may need its"
+                                      " arguments changing\n",
+                                      pg.linenum[l],src);
+
+                          /* REM and DATA text is copied as it is */
+                          if ((it.tok == ft->rem) || (it.tok == ft->data)) {
+                            uint32_t from=i;
+                            skip_text(tr->from,body,fs,&i,it.tok == ft->data);
+                            emit_bytes(o,body,from,i-from);
+                          }
+                          else if ((it.tok == ft->gotok) ||
+                                   (it.tok == ft->gosub) ||
+                                   (it.tok == ft->then) ||
+                                   (it.tok == ft->restore) ||
+                                   (it.tok == ft->run))
+                            pending=it.tok;
+                          else if (it.tok == ft->on)
+                            inon=true;
+                          else
+                            pending=0;
+                          }
+                          break;
+      }
+    }
+
+    /* Line terminator, then the link - S-BASIC holds the length of the */
+    /* line, the others the address of the next line                   */
+    emit(o,(tr->to == MZ700) ? 0x00 : 0x0d);
+    la=(tr->to == MZ700) ? o->n-linestart : loadaddr+o->n;
+    if (linestart+1 < o->max) {
+      o->b[linestart]=la&0xff;
+      o->b[linestart+1]=(la>>8)&0xff;
+    }
+  }
+
+  /* End of program */
+  emit(o,0x00);
+  emit(o,0x00);
 
+  free_program(&pg);
+}
+
+/* Convert the tape file mzf to the BASIC to, renumbering it if first */
+/* is not 0, and write the result as the tape file newmzf.            */
+bool convert_mzf(char *mzf, char *newmzf, uint8_t to, uint16_t first,
+                 uint16_t step)
+{
+  translation tr;
+  uint8_t *body;
+  uint16_t fs, loadaddr;
+  obuf o;
   FILE *fp;
-  uint16_t filesize;
 
-  /* Set locale */
-  setlocale(LC_CTYPE, "");
+  body=read_mzf(mzf,&fs);
+  if (body == NULL)
+    return(false);
 
-  /* Check we have one and only one argument */
-  if (argc !=2) {
-    fprintf(stderr,"Usage: %s <mzf file>\n",argv[0]);
-    exit(1);
+  mzmc=basic_dialect();
+  if (dialects[mzmc].print == NULL) {
+    fprintf(stderr,"Error: %s is not a BASIC program that can be converted\n",
+            mzf);
+    free(body);
+    return(false);
   }
+  if (to == 0)
+    to=mzmc;
+  if ((first != 0) && (step == 0))
+    step=10;
 
-  printf("%s %s\n",argv[0],argv[1]);
+  fprintf(out,"Converting %s from %s to %s\n",mzf,dialects[mzmc].name,
+          dialects[to].name);
 
-  /* Open file passed in as argument argv[1] if it exists and is readable */
-  fp = fopen(argv[1], "r");
-  if (fp == NULL) {
-    fprintf(stderr,"Error: %s not found\n",argv[1]);
-    exit(1);
+  /* Load addresses the BASICs put their programs at */
+  switch (to) {
+    case MZ80K: header[0]=0x02;
+                loadaddr=0x4806;
+                break;
+    case MZ80A: header[0]=0x02;
+                loadaddr=0x505c;
+                break;
+    /* S-BASIC keeps its own program's address, others go to 0x6bcf */
+    default:    header[0]=0x05;
+                loadaddr=(mzmc == MZ700) ?
+                         (((header[21]<<8)&0xff00)|header[20]) : 0x6bcf;
+                break;
   }
+  header[20]=loadaddr&0xff;
+  header[21]=loadaddr>>8;
 
-  /* Read contents of file header and process it */
-  filesize=process_mzf_header(fp,argv[1]);
+  init_translation(&tr,mzmc,to);
+  tr.first=first;
+  tr.step=step;
+  o.max=65535;
+  o.b=malloc(o.max);
+  o.n=0;
+  translate_program(&tr,body,fs,loadaddr,&o);
+  free(body);
 
-  /* Read contents of file body and process it */
-  process_mzf_body(fp,filesize);
+  if (o.n > o.max) {
+    fprintf(stderr,"Error: converted program is too big for a tape file\n");
+    free(o.b);
+    return(false);
+  }
+  header[18]=o.n&0xff;
+  header[19]=o.n>>8;
 
-  /* Tidy up */
+  fp=fopen(newmzf,"w");
+  if (fp == NULL) {
+    fprintf(stderr,"Error: unable to write %s\n",newmzf);
+    free(o.b);
+    return(false);
+  }
+  fwrite(header,1,MZFHEADERSIZE,fp);
+  fwrite(o.b,1,o.n,fp);
   fclose(fp);
+  free(o.b);
+
+  fprintf(out,"Wrote %u bytes to %s, %u keyword(s) could not be converted\n",
+          o.n,newmzf,tr.problems);
+  return(true);
+}
+
+/* 64 bit FNV-1a hash, carrying on from h */
+uint64_t hash_bytes(uint64_t h, uint8_t *data, size_t len)
+{
+  for (size_t i=0;i<len;i++)
+    h=(h^data[i])*0x100000001b3;
+
+  return(h);
+}
+
+/* Hash of a tape body, to identify its contents */
+uint64_t body_hash(uint8_t *body, uint32_t fs)
+{
+  return(hash_bytes(0xcbf29ce484222325,body,fs));
+}
+
+/* Write len bytes of UTF-8 text as a JSON string */
+void json_string(FILE *fp, const char *text, size_t len)
+{
+  fputc('"',fp);
+  for (size_t i=0;i<len;i++) {
+    uint8_t c=text[i];
+    if ((c == '"') || (c == '\\'))
+      fprintf(fp,"\\%c",c);
+    else if (c < 0x20)
+      fprintf(fp,"\\u%04x",c);
+    else
+      fputc(c,fp);
+  }
+  fputc('"',fp);
+}
+
+/* Write text as a CSV field, quoted if it has to be */
+void csv_field(FILE *fp, const char *text, size_t len)
+{
+  if (strcspn(text,",\"\r\n") >= len)
+    fwrite(text,1,len,fp);
+  else {
+    fputc('"',fp);
+    for (size_t i=0;i<len;i++) {
+      if (text[i] == '"')
+        fputc('"',fp);
+      fputc(text[i],fp);
+    }
+    fputc('"',fp);
+  }
+}
+
+/* Sharp characters as UTF-8, to be freed by the caller */
+char *sharp_text(uint8_t *data, size_t len, size_t *utflen)
+{
+  FILE *save=out;
+  char *text=NULL;
+
+  out=open_memstream(&text,utflen);
+  for (size_t i=0;i<len;i++)
+    mzascii2utf8(data[i]);
+  fclose(out);
+  out=save;
+
+  return(text);
+}
+
+/* Tape file name from the header as UTF-8, to be freed by the caller */
+char *mzf_name(size_t *len)
+{
+  uint8_t i;
+
+  for (i=1;(i<18)&&(header[i] != 0x0d);i++);
+
+  return(sharp_text(header+1,i-1,len));
+}
+
+#define RENDER_TEXT   0        // Output modes for rendered tapes
+#define RENDER_JSON   1
+#define RENDER_HEX    2
+#define RENDER_CSV    3        // Not offered by the server
+#define RENDER_RECORDS 4       // Data records, not offered by the server
+
+#define EXPORT_NDJSON 1        // One JSON object per tape
+#define EXPORT_CSV    2        // One row of header fields per tape
+#define EXPORT_RECORDS 3       // One row per field of each data record
+
+/* Export format of each render mode, and render mode of each format */
+const uint8_t exportformats[5] = {0,EXPORT_NDJSON,0,EXPORT_CSV,EXPORT_RECORDS};
+const uint8_t formatmodes[4] = {RENDER_TEXT,RENDER_JSON,RENDER_CSV,
+                                RENDER_RECORDS};
+
+/* Write the records of a data file as a JSON array of arrays, or as */
+/* CSV rows of file, record, field, kind and value                   */
+void export_records(uint8_t *body, uint16_t fs, char *mzf, uint8_t format)
+{
+  datafield *f=malloc((fs+1)*sizeof(datafield));
+  uint32_t pos=0, r=0;
+  int n;
+
+  mzmc=data_dialect();
+  if (format == EXPORT_NDJSON)
+    fprintf(out,",\"records\":[");
+  while ((n=next_record(body,fs,&pos,f)) >= 0) {
+    if (format == EXPORT_NDJSON)
+      fprintf(out,"%s[",(r > 0) ? "," : "");
+    r++;
+    for (int k=0;k<n;k++) {
+      size_t len;
+      char *text;
+      if (format == EXPORT_RECORDS) {
+        csv_field(out,mzf,strlen(mzf));
+        fprintf(out,",%u,%d,%s,",r,k+1,
+                (f[k].kind == FIELD_NUMBER) ? "number" : "string");
+      }
+      else if (k > 0)
+        fprintf(out,",");
+      if (f[k].kind == FIELD_NUMBER)
+        fprintf(out,"%.9g",f[k].value);
+      else {
+        text=sharp_text(body+f[k].pos,f[k].len,&len);
+        if (format == EXPORT_RECORDS)
+          csv_field(out,text,len);
+        else
+          json_string(out,text,len);
+        free(text);
+      }
+      if (format == EXPORT_RECORDS)
+        fprintf(out,"\n");
+    }
+    if (format == EXPORT_NDJSON)
+      fprintf(out,"]");
+  }
+  if (format == EXPORT_NDJSON)
+    fprintf(out,"]");
+  free(f);
+}
+
+/* First row of the CSV output of a render mode */
+void csv_heading(FILE *fp, uint8_t mode)
+{
+  if (mode == RENDER_CSV)
+    fprintf(fp,"file,type,typename,name,size,load,exec,dialect,hash\n");
+  else if (mode == RENDER_RECORDS)
+    fprintf(fp,"file,record,field,kind,value\n");
+}
+
+/* Write the header, BASIC and body hash of a tape to out, as NDJSON */
+/* with its listing as {line, text} records, or as a CSV row. Output   */
+/* goes straight out as each field is worked out.                      */
+void export_mzf(uint8_t *body, uint16_t fs, char *mzf, uint8_t format)
+{
+  size_t namelen, textlen=0;
+  char *name=mzf_name(&namelen), *text=NULL;
+  uint8_t dialect=basic_dialect();
+  uint64_t hash=body_hash(body,fs);
+
+  if (format == EXPORT_RECORDS) {
+    if (is_data_file())
+      export_records(body,fs,mzf,format);
+    free(name);
+    return;
+  }
+  if (format == EXPORT_CSV) {
+    csv_field(out,mzf,strlen(mzf));
+    fprintf(out,",%d,",header[0]);
+    csv_field(out,mzf_type_name(header[0]),strlen(mzf_type_name(header[0])));
+    fprintf(out,",");
+    csv_field(out,name,namelen);
+    fprintf(out,",%d,%d,%d,%s,%016" PRIx64 "\n",fs,(header[21]<<8)|header[20],
+           (header[23]<<8)|header[22],(dialect != 0) ? dialects[dialect].name : "",
+           hash);
+    free(name);
+    return;
+  }
+
+  fprintf(out,"{\"file\":");
+  json_string(out,mzf,strlen(mzf));
+  fprintf(out,",\"type\":%d,\"typename\":",header[0]);
+  json_string(out,mzf_type_name(header[0]),strlen(mzf_type_name(header[0])));
+  fprintf(out,",\"name\":");
+  json_string(out,name,namelen);
+  fprintf(out,",\"size\":%d,\"load\":%d,\"exec\":%d,\"dialect\":",fs,
+         (header[21]<<8)|header[20],(header[23]<<8)|header[22]);
+  if (dialect != 0)
+    json_string(out,dialects[dialect].name,strlen(dialects[dialect].name));
+  else
+    fprintf(out,"null");
+  fprintf(out,",\"hash\":\"%016" PRIx64 "\",\"listing\":[",hash);
+
+  /* Each listing line is the line number then its text */
+  if (dialects[dialect].print != NULL) {
+    bool firstline=true;
+    FILE *save=out;
+    out=open_memstream(&text,&textlen);
+    print_listing(body,fs);
+    fclose(out);
+    out=save;
+    for (char *l=text,*e;l<text+textlen;l=e+1) {
+      uint32_t linenum=0;
+      char *t=l;
+      e=memchr(l,'\n',text+textlen-l);
+      if (e == NULL)
+        e=text+textlen;
+      if (*t == ' ')
+        ++t;
+      if ((t == e) || (*t < '0') || (*t > '9'))
+        continue;
+      while ((t < e) && (*t >= '0') && (*t <= '9'))
+        linenum=linenum*10+(*t++-'0');
+      if ((t < e) && (*t == ' '))
+        ++t;
+      fprintf(out,"%s{\"line\":%u,\"text\":",firstline ? "" : ",",linenum);
+      json_string(out,t,e-t);
+      fprintf(out,"}");
+      firstline=false;
+    }
+    free(text);
+  }
+  fprintf(out,"]");
+  if ((dialects[dialect].print != NULL) && listerr.truncated)
+    fprintf(out,",\"error\":{\"kind\":\"truncated\",\"line\":%d,"
+                "\"offset\":%u}",listerr.line,listerr.offset);
+  if (is_data_file())
+    export_records(body,fs,mzf,format);
+  fprintf(out,"}\n");
+
+  free(name);
+}
+
+/* Difference between two versions of a program, found first between */
+/* whole lines, then between the tokens of lines that changed.       */
+#define DIFFCONTEXT   1        // Unchanged lines shown around changes
+
+/* Mark the elements of a[a0..a1) deleted and b[b0..b1) inserted to   */
+/* turn one into the other with fewest changes, by Myers' linear space */
+/* method: find the middle snake of the shortest edit script, then do  */
+/* the same either side of it. vf and vb hold n+m+5 entries.           */
+void diff_range(const uint64_t *a, int32_t a0, int32_t a1, const uint64_t *b,
+                int32_t b0, int32_t b1, bool *del, bool *ins,
+                int32_t *vf, int32_t *vb)
+{
+  int32_t n, m, delta, off, x=0, y=0, u=0, v=0;
+  bool found=false;
+
+  /* Matching ends are not part of the problem */
+  while ((a0 < a1) && (b0 < b1) && (a[a0] == b[b0])) {
+    a0++;
+    b0++;
+  }
+  while ((a0 < a1) && (b0 < b1) && (a[a1-1] == b[b1-1])) {
+    a1--;
+    b1--;
+  }
+  if ((a0 == a1) || (b0 == b1)) {
+    for (;a0<a1;a0++)
+      del[a0]=true;
+    for (;b0<b1;b0++)
+      ins[b0]=true;
+    return;
+  }
+
+  n=a1-a0;
+  m=b1-b0;
+  delta=n-m;
+  off=(n+m+1)/2+1;
+  vf[off+1]=0;
+  vb[off+1]=0;
+  for (int32_t d=0;!found;d++) {
+    /* Furthest reaching forward paths */
+    for (int32_t k=-d;(k<=d)&&!found;k+=2) {
+      x=((k == -d) || ((k != d) && (vf[off+k-1] < vf[off+k+1]))) ?
+        vf[off+k+1] : vf[off+k-1]+1;
+      y=x-k;
+      for (u=x,v=y;(u<n)&&(v<m)&&(a[a0+u]==b[b0+v]);u++,v++);
+      vf[off+k]=u;
+      found=(delta & 1) && (delta-k >= -(d-1)) && (delta-k <= d-1) &&
+            (u+vb[off+delta-k] >= n);
+    }
+
+    /* Furthest reaching reverse paths, measured from the ends */
+    for (int32_t k=-d;(k<=d)&&!found;k+=2) {
+      int32_t xr, yr, ur, vr;
+      xr=((k == -d) || ((k != d) && (vb[off+k-1] < vb[off+k+1]))) ?
+         vb[off+k+1] : vb[off+k-1]+1;
+      yr=xr-k;
+      for (ur=xr,vr=yr;(ur<n)&&(vr<m)&&(a[a1-1-ur]==b[b1-1-vr]);ur++,vr++);
+      vb[off+k]=ur;
+      found=!(delta & 1) && (delta-k >= -d) && (delta-k <= d) &&
+            (ur+vf[off+delta-k] >= n);
+      if (found) {
+        x=n-ur;
+        y=m-vr;
+        u=n-xr;
+        v=m-yr;
+      }
+    }
+  }
+
+  if (((x == n) && (y == m)) || ((u == 0) && (v == 0))) {
+    /* No smaller problem to split into, so replace the lot */
+    for (;a0<a1;a0++)
+      del[a0]=true;
+    for (;b0<b1;b0++)
+      ins[b0]=true;
+    return;
+  }
+  diff_range(a,a0,a0+x,b,b0,b0+y,del,ins,vf,vb);
+  diff_range(a,a0+u,a1,b,b0+v,b1,del,ins,vf,vb);
+}
+
+/* Mark what was deleted from a and inserted into b */
+void diff_seq(const uint64_t *a, int32_t n, const uint64_t *b, int32_t m,
+              bool *del, bool *ins)
+{
+  int32_t *vf=malloc((n+m+5)*sizeof(int32_t));
+  int32_t *vb=malloc((n+m+5)*sizeof(int32_t));
+
+  memset(del,0,n*sizeof(bool));
+  memset(ins,0,m*sizeof(bool));
+  diff_range(a,0,n,b,0,m,del,ins,vf,vb);
+  free(vf);
+  free(vb);
+}
+
+/* One version of a program, split into lines */
+typedef struct {
+  char *mzf;
+  uint8_t *body;
+  uint16_t fs;
+  uint8_t dialect;
+  program pg;
+  uint64_t *hash;              // Hash of each line's number and tokens
+} version;
+
+bool load_version(version *ver, char *mzf)
+{
+  ver->mzf=mzf;
+  ver->body=read_mzf(mzf,&ver->fs);
+  if (ver->body == NULL)
+    return(false);
+  ver->dialect=basic_dialect();
+  if (dialects[ver->dialect].print == NULL) {
+    fprintf(stderr,"Error: %s is not a BASIC program that can be listed\n",
+            mzf);
+    free(ver->body);
+    return(false);
+  }
+
+  index_program(&ver->pg,ver->body,ver->fs,ver->dialect);
+  ver->hash=malloc((ver->pg.nlines+1)*sizeof(uint64_t));
+  for (uint32_t l=0;l<ver->pg.nlines;l++)
+    ver->hash[l]=hash_bytes(0xcbf29ce484222325ULL,
+                            ver->body+ver->pg.start[l]-2,
+                            ver->pg.end[l]-ver->pg.start[l]+2);
+
+  return(true);
+}
+
+void free_version(version *ver)
+{
+  free_program(&ver->pg);
+  free(ver->hash);
+  free(ver->body);
+}
+
+/* Print a line as the BASIC's own listing does, after a marker */
+void print_version_line(version *ver, uint32_t l, char mark)
+{
+  uint32_t from=ver->pg.start[l]-4, to=ver->pg.end[l]+1;
+  char *text=NULL, *t;
+  size_t len;
+  FILE *save=out;
+
+  if (to > ver->fs)
+    to=ver->fs;
+  mzmc=ver->dialect;
+  out=open_memstream(&text,&len);
+  dialects[ver->dialect].print(ver->body+from,to-from);
+  fclose(out);
+  out=save;
+
+  for (t=text;(t<text+len)&&(*t=='\n');t++);
+  while ((len > 0) && (text[len-1] == '\n'))
+    len--;
+  fprintf(out,"%c%.*s\n",mark,(int)(text+len-t),t);
+  free(text);
+}
+
+/* The tokens of a line, with REM and DATA text as one item each */
+uint32_t line_items(version *ver, uint32_t l, item **items, uint64_t **keys)
+{
+  const flowtokens *ft=ver->pg.ft;
+  uint32_t i=ver->pg.start[l], n=0;
+  uint32_t most=ver->pg.end[l]-i+1;
+
+  *items=malloc(most*sizeof(item));
+  *keys=malloc(most*sizeof(uint64_t));
+  while (next_item(ver->dialect,ver->body,ver->fs,&i,&(*items)[n])) {
+    item *it=&(*items)[n];
+    if ((it->kind == ITEM_TOKEN) && ((it->tok == ft->rem) ||
+                                     (it->tok == ft->data))) {
+      (*keys)[n]=hash_bytes(0xcbf29ce484222325ULL,ver->body+it->pos,it->len);
+      n++;
+      it=&(*items)[n];
+      it->kind=ITEM_STRING;
+      it->pos=i;
+      skip_text(ver->dialect,ver->body,ver->fs,&i,
+                (*items)[n-1].tok == ft->data);
+      it->len=i-it->pos;
+      if (it->len == 0)
+        continue;
+    }
+    (*keys)[n]=hash_bytes(0xcbf29ce484222325ULL,ver->body+it->pos,it->len);
+    n++;
+  }
+
+  return(n);
+}
+
+void print_item(version *ver, item *it)
+{
+  const char *t;
+
+  switch (it->kind) {
+    case ITEM_TOKEN:  t=token_text(ver->dialect,it->tok);
+                      if (t != NULL)
+                        fprintf(out,"%s",t);
+                      else
+                        fprintf(out,"{%02x}",it->tok);
+                      return;
+    case ITEM_NUMBER: if (ver->dialect != MZ700)
+                        break;
+                      fprintf(out,"%g",it->value);
+                      return;
+    case ITEM_HEX:    fprintf(out,"$%04X",(uint16_t)it->value);
+                      return;
+    case ITEM_LINE:   fprintf(out,"%u",(uint16_t)it->value);
+                      return;
+    case ITEM_VAR:    fprintf(out,"%s",it->name);
+                      return;
+  }
+  for (uint32_t i=it->pos;i<it->pos+it->len;i++)
+    mzascii2utf8(ver->body[i]);
+}
+
+/* Print the tokens removed and added in a changed line, each run of */
+/* them as -[...] or +[...]                                         */
+void print_token_diff(version *a, uint32_t la, version *b, uint32_t lb)
+{
+  item *ia, *ib;
+  uint64_t *ka, *kb;
+  uint32_t na=line_items(a,la,&ia,&ka), nb=line_items(b,lb,&ib,&kb);
+  bool *del=malloc(na+1), *ins=malloc(nb+1);
+  uint32_t i=0, j=0;
+
+  diff_seq(ka,na,kb,nb,del,ins);
+  fprintf(out,"! %u",b->pg.linenum[lb]);
+  while ((i < na) || (j < nb)) {
+    if ((i < na) && del[i]) {
+      fprintf(out," -[");
+      for (mzmc=a->dialect;(i<na)&&del[i];i++)
+        print_item(a,&ia[i]);
+      fprintf(out,"]");
+    }
+    else if ((j < nb) && ins[j]) {
+      fprintf(out," +[");
+      for (mzmc=b->dialect;(j<nb)&&ins[j];j++)
+        print_item(b,&ib[j]);
+      fprintf(out,"]");
+    }
+    else {
+      i++;
+      j++;
+    }
+  }
+  fprintf(out,"\n");
+
+  free(ia);
+  free(ib);
+  free(ka);
+  free(kb);
+  free(del);
+  free(ins);
+}
+
+/* Print a unified diff of two versions of a program in listing form. */
+/* Changed lines with the same line number in both are followed by a  */
+/* line starting ! with the tokens that changed. Returns 0 if they are */
+/* the same, 1 if they differ and 2 if they can't be compared.        */
+int diff_mzf(char *mzfa, char *mzfb)
+{
+  version a, b;
+  uint32_t na, nb, nops=0, *opa, *opb;
+  uint8_t *op;
+  bool *del, *ins, differ=false;
+
+  if (!load_version(&a,mzfa))
+    return(2);
+  if (!load_version(&b,mzfb)) {
+    free_version(&a);
+    return(2);
+  }
+  na=a.pg.nlines;
+  nb=b.pg.nlines;
+  del=malloc(na+1);
+  ins=malloc(nb+1);
+  diff_seq(a.hash,na,b.hash,nb,del,ins);
+
+  /* Edit script as a list of ' ', '-' and '+' with the line of each */
+  op=malloc(na+nb+1);
+  opa=malloc((na+nb+1)*sizeof(uint32_t));
+  opb=malloc((na+nb+1)*sizeof(uint32_t));
+  for (uint32_t i=0,j=0;(i<na)||(j<nb);nops++) {
+    opa[nops]=i;
+    opb[nops]=j;
+    if ((i < na) && del[i]) {
+      op[nops]='-';
+      i++;
+    }
+    else if ((j < nb) && ins[j]) {
+      op[nops]='+';
+      j++;
+    }
+    else {
+      op[nops]=' ';
+      i++;
+      j++;
+    }
+    differ|=(op[nops] != ' ');
+  }
+
+  fprintf(out,"--- %s (%s)\n+++ %s (%s)\n",mzfa,dialects[a.dialect].name,
+          mzfb,dialects[b.dialect].name);
+  for (uint32_t s=0;s<nops;) {
+    uint32_t e, last, from, to;
+    uint32_t ca=0, cb=0;
+
+    if (op[s] == ' ') {
+      s++;
+      continue;
+    }
+
+    /* Hunk runs to the last change within reach of the one before */
+    for (e=last=s;e<nops;e++)
+      if (op[e] != ' ')
+        last=e;
+      else if (e-last > 2*DIFFCONTEXT)
+        break;
+    from=(s > DIFFCONTEXT) ? s-DIFFCONTEXT : 0;
+    to=(last+1+DIFFCONTEXT < nops) ? last+1+DIFFCONTEXT : nops;
+    for (uint32_t k=from;k<to;k++) {
+      ca+=(op[k] != '+');
+      cb+=(op[k] != '-');
+    }
+    fprintf(out,"@@ -%u,%u +%u,%u @@\n",opa[from]+1,ca,opb[from]+1,cb);
+
+    for (uint32_t k=from;k<to;) {
+      uint32_t d0, i0;
+      if (op[k] == ' ') {
+        print_version_line(&a,opa[k++],' ');
+        continue;
+      }
+      /* A run of deletions then insertions */
+      for (d0=k;(k<to)&&(op[k]=='-');k++)
+        print_version_line(&a,opa[k],'-');
+      for (i0=k;(k<to)&&(op[k]=='+');k++)
+        print_version_line(&b,opb[k],'+');
+      for (uint32_t p=i0;p<k;p++)
+        for (uint32_t q=d0;q<i0;q++)
+          if (a.pg.linenum[opa[q]] == b.pg.linenum[opb[p]]) {
+            print_token_diff(&a,opa[q],&b,opb[p]);
+            break;
+          }
+    }
+    s=to;
+  }
+
+  free(op);
+  free(opa);
+  free(opb);
+  free(del);
+  free(ins);
+  free_version(&a);
+  free_version(&b);
+
+  return(differ ? 1 : 0);
+}
+
+/* Convert Sharp 'ASCII' to the display code used to index the CGROM.  */
+/* Codes without a known display code are used unchanged.               */
+uint8_t mzascii2display(uint8_t sharpchar)
+{
+  /* Display codes for Sharp 'ASCII' 0x20 to 0x5f */
+  static const uint8_t printable[64] = {
+    0x00,0x61,0x62,0x63,0x64,0x65,0x66,0x67,  //   ! " # $ % & '
+    0x68,0x69,0x6b,0x6a,0x2f,0x2a,0x2e,0x2d,  // ( ) * + , - . /
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,  // 0 - 7
+    0x28,0x29,0x4f,0x2c,0x51,0x2b,0x57,0x49,  // 8 9 : ; < = > ?
+    0x55,0x01,0x02,0x03,0x04,0x05,0x06,0x07,  // @ A - G
+    0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f,  // H - O
+    0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,  // P - W
+    0x18,0x19,0x1a,0x52,0x59,0x54,0x50,0x45   // X Y Z [ \ ] up left
+  };
+  /* Sharp lower case a to z, display codes 0x81 to 0x9a */
+  static const uint8_t lower[26] = {
+    0xa1,0x9a,0x9f,0x9c,0x92,0xaa,0x97,0x98,0xa6,0xaf,0xa9,0xb8,0xb3,
+    0xb0,0xb7,0x9e,0xa0,0x9d,0xa4,0x96,0xa5,0xab,0xa3,0x9b,0xbd,0xa2
+  };
+
+  if ((sharpchar >= 0x20) && (sharpchar <= 0x5f))
+    return(printable[sharpchar-0x20]);
+
+  for (uint8_t i=0;i<26;i++)
+    if (lower[i] == sharpchar)
+      return(0x81+i);
+
+  return(sharpchar);
+}
+
+/* Read the first bank of a CGROM and build the braille and sixel glyph */
+/* cache from it, so rendering a listing is a lookup per character.    */
+bool load_glyph_cache(char *cgromfile)
+{
+  FILE *fp;
+
+  fp = fopen(cgromfile, "r");
+  if (fp == NULL) {
+    fprintf(stderr,"Error: %s not found\n",cgromfile);
+    return(false);
+  }
+  if (fread(cgrom,1,CROMSIZE,fp) != CROMSIZE) {
+    fprintf(stderr,"Error: %s is smaller than a 2K CGROM\n",cgromfile);
+    fclose(fp);
+    return(false);
+  }
+  fclose(fp);
+
+  for (uint16_t d=0;d<256;d++) {
+    uint8_t *glyph=&cgrom[d*CHRBYTES];
+
+    /* Braille cells are 2 dots wide and 4 high, so 4x2 cells per glyph */
+    for (uint8_t r=0;r<2;r++)
+      for (uint8_t c=0;c<4;c++) {
+        static const uint8_t dots[4][2] = {{0x01,0x08},{0x02,0x10},
+                                           {0x04,0x20},{0x40,0x80}};
+        uint8_t bits=0;
+        for (uint8_t y=0;y<4;y++)
+          for (uint8_t x=0;x<2;x++)
+            if (glyph[r*4+y] & (0x80>>(c*2+x)))
+              bits|=dots[y][x];
+        /* U+2800 + bits in UTF-8 */
+        braille[d][r][c*3]=0xe2;
+        braille[d][r][c*3+1]=0xa0|(bits>>6);
+        braille[d][r][c*3+2]=0x80|(bits&0x3f);
+      }
+
+    /* Sixel bands are 6 pixels high - rows 0-5, then rows 6-7 */
+    for (uint8_t b=0;b<2;b++)
+      for (uint8_t x=0;x<CHRBYTES;x++) {
+        uint8_t bits=0;
+        for (uint8_t y=0;(y<6)&&(b*6+y<CHRBYTES);y++)
+          if (glyph[b*6+y] & (0x80>>x))
+            bits|=1<<y;
+        sixels[d][b][x]=0x3f+bits;
+      }
+  }
+
+  return(true);
+}
+
+/* Draw one line of display codes to stdout from the glyph cache */
+void print_glyph_line(uint8_t *codes, size_t n)
+{
+  if (usesixel) {
+    printf("\033P0;1;0q#1;2;100;100;100#1");
+    for (size_t i=0;i<n;i++)
+      fwrite(sixels[codes[i]][0],1,CHRBYTES,stdout);
+    printf("-#1");
+    for (size_t i=0;i<n;i++)
+      fwrite(sixels[codes[i]][1],1,CHRBYTES,stdout);
+    printf("\033\\\n");
+  }
+  else
+    for (uint8_t r=0;r<2;r++) {
+      for (size_t i=0;i<n;i++)
+        fwrite(braille[codes[i]][r],1,12,stdout);
+      printf("\n");
+    }
+}
+
+/* Decode the next character of UTF-8 text written by mzfview into a   */
+/* display code. Sharp characters are found from the private use area  */
+/* code points mzascii2utf8 uses, or from the plain ASCII around them. */
+/* Returns -1 at the end of a line.                                    */
+int16_t text2display(char *text, size_t len, size_t *pos)
+{
+  size_t i=*pos;
+  uint8_t c=text[i++];
+  uint32_t cp=c;
+
+  /* Decode multibyte UTF-8 sequences */
+  if ((c >= 0xe0) && (i+1 < len)) {
+    cp=((c&0x0f)<<12)|((text[i]&0x3f)<<6)|(text[i+1]&0x3f);
+    i+=2;
+  }
+  else if ((c >= 0xc0) && (i < len)) {
+    cp=((c&0x1f)<<6)|(text[i]&0x3f);
+    ++i;
+  }
+  *pos=i;
+
+  if (cp == '\n')
+    return(-1);
+  else if ((cp >= 'a') && (cp <= 'z'))
+    return(0x81+(cp-'a'));
+  else if (cp < 0x80)
+    return(mzascii2display((cp >= 0x20) ? cp : 0x20));
+  else if (((cp&0xff00) == 0xe000) || ((cp&0xff00) == 0xf000))
+    return(mzascii2display(cp&0xff));
+  else
+    return(mzascii2display(0x20));
+}
+
+/* Redraw UTF-8 text written by mzfview using the glyph cache */
+void print_glyphs(char *text, size_t len)
+{
+  uint8_t *codes=malloc(len+1);
+  size_t n=0;
+
+  for (size_t i=0;i<len;) {
+    int16_t code=text2display(text,len,&i);
+    if (code < 0) {
+      print_glyph_line(codes,n);
+      n=0;
+    }
+    else
+      codes[n++]=code;
+  }
+  if (n > 0)
+    print_glyph_line(codes,n);
+
+  free(codes);
+}
+
+/* Minimal PNG encoder for the 1 bit per pixel screen images. The pixel */
+/* data goes in uncompressed deflate blocks, so encoding is a copy plus */
+/* the CRC-32 and Adler-32 checksums.                                   */
+uint32_t crctable[256];
+
+void init_crctable(void)
+{
+  for (uint32_t n=0;n<256;n++) {
+    uint32_t c=n;
+    for (uint8_t k=0;k<8;k++)
+      c=(c&1) ? 0xedb88320^(c>>1) : c>>1;
+    crctable[n]=c;
+  }
+}
+
+void png_chunk(FILE *fp, const char *type, uint8_t *data, uint32_t len)
+{
+  uint8_t be[4]={len>>24,len>>16,len>>8,len};
+  uint32_t crc=0xffffffff;
+
+  fwrite(be,1,4,fp);
+  fwrite(type,1,4,fp);
+  fwrite(data,1,len,fp);
+  for (uint8_t i=0;i<4;i++)
+    crc=crctable[(crc^type[i])&0xff]^(crc>>8);
+  for (uint32_t i=0;i<len;i++)
+    crc=crctable[(crc^data[i])&0xff]^(crc>>8);
+  crc^=0xffffffff;
+  be[0]=crc>>24; be[1]=crc>>16; be[2]=crc>>8; be[3]=crc;
+  fwrite(be,1,4,fp);
+}
+
+/* A screen image, one byte per 8 pixels, with the PNG filter byte at */
+/* the start of each pixel row and room for the zlib wrapping.        */
+#define PNGROW    (SCRCOLS+1)
+#define PNGPIXELS (PNGROW*SCRROWS*CHRBYTES)
+
+typedef struct {
+  uint8_t zlib[2+5+PNGPIXELS+4];
+  uint8_t *pixels;
+} screen;
+
+bool write_png(char *name, screen *scr)
+{
+  static const uint8_t sig[8]={0x89,'P','N','G',0x0d,0x0a,0x1a,0x0a};
+  uint8_t ihdr[13]={0,0,(SCRCOLS*CHRBYTES)>>8,(SCRCOLS*CHRBYTES)&0xff,
+                    0,0,(SCRROWS*CHRBYTES)>>8,(SCRROWS*CHRBYTES)&0xff,
+                    1,0,0,0,0};   // 1 bit greyscale, no interlace
+  uint32_t a=1, b=0;
+  uint8_t *z=scr->zlib;
+  FILE *fp;
+
+  /* zlib header, then one final stored block holding every pixel row */
+  z[0]=0x78; z[1]=0x01;
+  z[2]=0x01;
+  z[3]=PNGPIXELS&0xff; z[4]=PNGPIXELS>>8;
+  z[5]=~z[3]; z[6]=~z[4];
+  for (uint32_t i=0;i<PNGPIXELS;i++) {
+    a=(a+scr->pixels[i])%65521;
+    b=(b+a)%65521;
+  }
+  z[7+PNGPIXELS]=b>>8; z[8+PNGPIXELS]=b;
+  z[9+PNGPIXELS]=a>>8; z[10+PNGPIXELS]=a;
+
+  fp=fopen(name,"w");
+  if (fp == NULL)
+    return(false);
+  fwrite(sig,1,8,fp);
+  png_chunk(fp,"IHDR",ihdr,13);
+  png_chunk(fp,"IDAT",z,sizeof(scr->zlib));
+  png_chunk(fp,"IEND",NULL,0);
+  return(fclose(fp) == 0);
+}
+
+/* Lay the listing out on a 40x25 Sharp screen and draw it into scr.  */
+/* Long lines wrap onto the next screen line as they would when LIST  */
+/* is typed. A byte of a pixel row is one 8 pixel row of a character, */
+/* so each character row is drawn with one store per character.       */
+void draw_screen(char *text, size_t len, screen *scr)
+{
+  uint8_t codes[SCRROWS][SCRCOLS];
+  uint8_t row=0, col=0;
+  size_t i=0;
+
+  memset(codes,mzascii2display(0x20),sizeof(codes));
+
+  /* Skip the blank lines that come before a listing */
+  while ((i < len) && (text[i] == '\n'))
+    ++i;
+
+  while ((i < len) && (row < SCRROWS)) {
+    int16_t code=text2display(text,len,&i);
+    if ((code < 0) || (col == SCRCOLS)) {
+      ++row;
+      col=0;
+    }
+    if ((code >= 0) && (row < SCRROWS))
+      codes[row][col++]=code;
+  }
+
+  for (row=0;row<SCRROWS;row++)
+    for (uint8_t y=0;y<CHRBYTES;y++) {
+      uint8_t *line=&scr->pixels[(row*CHRBYTES+y)*PNGROW];
+      line[0]=0;  // No PNG filter
+      for (col=0;col<SCRCOLS;col++)
+        line[col+1]=cgrom[codes[row][col]*CHRBYTES+y];
+    }
+}
+
+/* Thumbnail batch state shared by the worker threads */
+char **pngfiles;
+int pngcount;
+char *pngdir;
+atomic_int pngnext;
+
+/* Worker thread - takes the next file from the batch until none are  */
+/* left. Each worker has one screen buffer that it reuses throughout. */
+void *png_worker(void *arg __attribute__((unused)))
+{
+  screen *scr=malloc(sizeof(screen));
+  int n;
+
+  scr->pixels=&scr->zlib[7];
+
+  while ((n=atomic_fetch_add(&pngnext,1)) < pngcount) {
+    char *mzf=pngfiles[n];
+    char *base=strrchr(mzf,'/');
+    char *name, *dot, *text=NULL;
+    size_t textlen=0;
+    uint8_t *body;
+    uint16_t fs;
+    bool listed;
+
+    body=read_mzf(mzf,&fs);
+    if (body == NULL)
+      continue;
+
+    out=open_memstream(&text,&textlen);
+    listed=print_listing(body,fs);
+    fclose(out);
+    free(body);
+
+    if (!listed)
+      fprintf(stderr,"%s: not a BASIC program, no image written\n",mzf);
+    else {
+      /* Image is named after the tape file, with a .png extension */
+      base=(base == NULL) ? mzf : base+1;
+      name=malloc(strlen(pngdir)+strlen(base)+6);
+      sprintf(name,"%s/%s",pngdir,base);
+      dot=strrchr(name,'.');
+      if ((dot != NULL) && (dot > name+strlen(pngdir)+1))
+        *dot='\0';
+      strcat(name,".png");
+
+      draw_screen(text,textlen,scr);
+      if (!write_png(name,scr))
+        fprintf(stderr,"Error: unable to write %s\n",name);
+      free(name);
+    }
+    free(text);
+  }
+
+  free(scr);
+  return(NULL);
+}
+
+/* Write a screen image for every file given, using nthreads workers */
+void make_thumbnails(char **files, int count, char *dir, int nthreads)
+{
+  pthread_t tid[nthreads];
+
+  init_crctable();
+  pngfiles=files;
+  pngcount=count;
+  pngdir=dir;
+  atomic_store(&pngnext,0);
+
+  for (int t=0;t<nthreads;t++)
+    pthread_create(&tid[t],NULL,png_worker,NULL);
+  for (int t=0;t<nthreads;t++)
+    pthread_join(tid[t],NULL);
+}
+
+/* Rendered output cache for the server, kept in least recently used   */
+/* order with a hash table to find entries. Keys are the hash of the   */
+/* tape contents, its name and the output mode.                        */
+#define CACHESLOTS 4096        // Hash table size, a power of 2
+
+typedef struct centry {
+  uint64_t key;
+  char *data;
+  size_t len;
+  struct centry *prev, *next;  // Least recently used list
+  struct centry *chain;        // Hash table chain
+} centry;
+
+centry *cacheslots[CACHESLOTS];
+centry cachelru={0,NULL,0,&cachelru,&cachelru,NULL};
+size_t cachebytes, cachemax=64*1024*1024;
+pthread_mutex_t cachelock=PTHREAD_MUTEX_INITIALIZER;
+
+/* Copy of the cached output for key, or NULL if it isn't cached */
+char *cache_get(uint64_t key, size_t *len)
+{
+  char *data=NULL;
+
+  pthread_mutex_lock(&cachelock);
+  for (centry *e=cacheslots[key&(CACHESLOTS-1)];e!=NULL;e=e->chain)
+    if (e->key == key) {
+      /* Move to the front of the list */
+      e->prev->next=e->next;
+      e->next->prev=e->prev;
+      e->next=cachelru.next;
+      e->prev=&cachelru;
+      cachelru.next->prev=e;
+      cachelru.next=e;
+      data=malloc(e->len);
+      memcpy(data,e->data,e->len);
+      *len=e->len;
+      break;
+    }
+  pthread_mutex_unlock(&cachelock);
+
+  return(data);
+}
+
+/* Add output to the cache, evicting the least recently used entries */
+/* until it fits                                                     */
+void cache_put(uint64_t key, char *data, size_t len)
+{
+  centry *e;
+
+  if (len > cachemax)
+    return;
+
+  pthread_mutex_lock(&cachelock);
+  for (e=cacheslots[key&(CACHESLOTS-1)];e!=NULL;e=e->chain)
+    if (e->key == key) {
+      pthread_mutex_unlock(&cachelock);
+      return;
+    }
+
+  while (cachebytes+len > cachemax) {
+    centry *old=cachelru.prev, **p=&cacheslots[old->key&(CACHESLOTS-1)];
+    while (*p != old)
+      p=&(*p)->chain;
+    *p=old->chain;
+    old->prev->next=&cachelru;
+    cachelru.prev=old->prev;
+    cachebytes-=old->len;
+    free(old->data);
+    free(old);
+  }
+
+  e=malloc(sizeof(centry));
+  e->key=key;
+  e->data=malloc(len);
+  memcpy(e->data,data,len);
+  e->len=len;
+  e->chain=cacheslots[key&(CACHESLOTS-1)];
+  cacheslots[key&(CACHESLOTS-1)]=e;
+  e->next=cachelru.next;
+  e->prev=&cachelru;
+  cachelru.next->prev=e;
+  cachelru.next=e;
+  cachebytes+=len;
+  pthread_mutex_unlock(&cachelock);
+}
+
+
+const char *rendermodes[3] = {"text","json","hex"};
+
+/* Render a tape held in memory as mzfview's usual text, an NDJSON */
+/* object or the header and hex dump alone. Returns the output,    */
+/* which the caller frees.                                         */
+char *render_mzf(uint8_t *tape, size_t size, char *mzf, uint8_t mode,
+                 size_t *len)
+{
+  FILE *fp=fmemopen(tape,size,"r");
+  FILE *save=out;
+  char *text=NULL;
+  uint8_t *body;
+  uint16_t fs;
+
+  /* Sharp characters are drawn in the set of this tape's machine   */
+  /* from the start, not that of the last tape the thread rendered  */
+  memset(header,0,MZFHEADERSIZE);
+  memcpy(header,tape,(size < MZFHEADERSIZE) ? size : MZFHEADERSIZE);
+  mzmc=is_data_file() ? data_dialect() : basic_dialect();
+
+  out=open_memstream(&text,len);
+  if ((mode == RENDER_JSON) || (mode == RENDER_CSV) ||
+      (mode == RENDER_RECORDS)) {
+    memcpy(header,tape,MZFHEADERSIZE);
+    fs=((header[19]<<8)&0xff00)|header[18];
+    body=new_body(fs);
+    if (size-MZFHEADERSIZE < fs)
+      fs=size-MZFHEADERSIZE;
+    memcpy(body,tape+MZFHEADERSIZE,fs);
+    export_mzf(body,fs,mzf,exportformats[mode]);
+    free(body);
+  }
+  else {
+    fs=process_mzf_header(fp,mzf);
+    if (mode == RENDER_TEXT)
+      process_mzf_body(fp,fs);
+    else {
+      body=new_body(fs);
+      fs=fread(body,1,fs,fp);
+      print_hex(body,fs);
+      fprintf(out,"\n");
+      free(body);
+    }
+  }
+  fclose(out);
+  fclose(fp);
+  out=save;
+
+  return(text);
+}
+
+/* Read a whole tape file into memory, returning its size in size */
+uint8_t *read_tape(char *mzf, size_t *size)
+{
+  uint8_t *tape;
+  FILE *fp;
+
+  fp = fopen(mzf, "r");
+  if (fp == NULL)
+    return(NULL);
+  /* Room for the largest body and the checksums recorded on tape */
+  tape=malloc(MZFHEADERSIZE+65536+4);
+  *size=fread(tape,1,MZFHEADERSIZE+65536+4,fp);
+  fclose(fp);
+
+  return(tape);
+}
+
+/* Read from a socket until len bytes have arrived or it is closed */
+size_t read_all(int fd, void *buf, size_t len)
+{
+  size_t got=0;
+  ssize_t n;
+
+  while ((got < len) && ((n=read(fd,(char *)buf+got,len-got)) > 0))
+    got+=n;
+
+  return(got);
+}
+
+/* Sharp tape checksums. On tape the monitor follows the header and the */
+/* body each with a 16 bit count of the 1 bits in them, high byte      */
+/* first. mzf files drop these, but a file of 132 bytes more than its  */
+/* header says (header, checksum, body, checksum, as recorded) keeps   */
+/* them and they are checked. The bits are counted 64 at a time, with  */
+/* the popcnt instruction where the processor has it.                  */
+#define VERIFY_OK      0       // Results of verifying a tape
+#define VERIFY_BADSUM  1
+#define VERIFY_BROKEN  2
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define POPCOUNT_CLONES __attribute__((target_clones("popcnt","default")))
+#else
+#define POPCOUNT_CLONES
+#endif
+
+POPCOUNT_CLONES
+uint16_t sharp_checksum(const uint8_t *data, size_t len)
+{
+  uint32_t bits=0;
+  uint64_t w;
+  size_t i=0;
+
+  for (;i+8<=len;i+=8) {
+    memcpy(&w,data+i,8);
+    bits+=__builtin_popcountll(w);
+  }
+  for (;i<len;i++)
+    bits+=__builtin_popcount(data[i]);
+
+  return(bits&0xffff);
+}
+
+/* Work out the checksums of a tape, checking its size against its */
+/* header first and any checksums it holds after. why says what is */
+/* wrong if it is not VERIFY_OK.                                   */
+uint8_t verify_tape(char *mzf, uint16_t *hsum, uint16_t *bsum,
+                    char *why, size_t whylen)
+{
+  uint8_t *tape;
+  size_t size;
+  uint16_t fs;
+  uint8_t result=VERIFY_OK;
+
+  tape=read_tape(mzf,&size);
+  if (tape == NULL) {
+    snprintf(why,whylen,"not found");
+    return(VERIFY_BROKEN);
+  }
+  if (size < MZFHEADERSIZE) {
+    snprintf(why,whylen,"header truncated at %zu bytes",size);
+    free(tape);
+    return(VERIFY_BROKEN);
+  }
+  fs=(tape[19]<<8)|tape[18];
+  if (size < (size_t)MZFHEADERSIZE+fs) {
+    snprintf(why,whylen,"body truncated at %zu of %d bytes",
+             size-MZFHEADERSIZE,fs);
+    free(tape);
+    return(VERIFY_BROKEN);
+  }
+
+  /* Tape layout with the recorded checksums if it is exactly that   */
+  /* size, or longer and the header's recorded checksum is right     */
+  *hsum=sharp_checksum(tape,MZFHEADERSIZE);
+  if ((size == (size_t)MZFHEADERSIZE+fs+4) ||
+      ((size > (size_t)MZFHEADERSIZE+fs+4) &&
+       (((tape[MZFHEADERSIZE]<<8)|tape[MZFHEADERSIZE+1]) == *hsum))) {
+    uint8_t *body=tape+MZFHEADERSIZE+2;
+    uint16_t hrec=(tape[MZFHEADERSIZE]<<8)|tape[MZFHEADERSIZE+1];
+    uint16_t brec=(body[fs]<<8)|body[fs+1];
+    *bsum=sharp_checksum(body,fs);
+    if ((hrec != *hsum) || (brec != *bsum)) {
+      snprintf(why,whylen,"recorded checksums %04x %04x",hrec,brec);
+      result=VERIFY_BADSUM;
+    }
+  }
+  else
+    *bsum=sharp_checksum(tape+MZFHEADERSIZE,fs);
+  free(tape);
+
+  return(result);
+}
+
+/* Print the checksums of each tape, as lines that -K can check */
+int print_checksums(char **files, int count)
+{
+  uint16_t hsum, bsum;
+  char why[64];
+  int status=VERIFY_OK;
+
+  for (int n=0;n<count;n++) {
+    uint8_t r=verify_tape(files[n],&hsum,&bsum,why,sizeof(why));
+    if (r == VERIFY_BROKEN)
+      fprintf(stderr,"Error: %s %s\n",files[n],why);
+    else {
+      printf("%04x %04x %s\n",hsum,bsum,files[n]);
+      if (r != VERIFY_OK)
+        fprintf(stderr,"Error: %s %s\n",files[n],why);
+    }
+    if (r > status)
+      status=r;
+  }
+
+  return(status);
+}
+
+/* Check tapes against a list of checksums written by -k */
+int check_checksums(char *sums)
+{
+  FILE *fp=fopen(sums,"r");
+  char line[PATH_MAX+16], why[64];
+  uint16_t hwant, bwant, hsum, bsum;
+  int status=VERIFY_OK, skip;
+
+  if (fp == NULL) {
+    fprintf(stderr,"Error: %s not found\n",sums);
+    return(VERIFY_BROKEN);
+  }
+  while (fgets(line,sizeof(line),fp) != NULL) {
+    char *mzf;
+    uint8_t r;
+    line[strcspn(line,"\n")]='\0';
+    if (sscanf(line,"%4hx %4hx %n",&hwant,&bwant,&skip) != 2)
+      continue;
+    mzf=line+skip;
+    r=verify_tape(mzf,&hsum,&bsum,why,sizeof(why));
+    if ((r == VERIFY_OK) && ((hsum != hwant) || (bsum != bwant))) {
+      snprintf(why,sizeof(why),"checksums %04x %04x",hsum,bsum);
+      r=VERIFY_BADSUM;
+    }
+    if (r == VERIFY_OK)
+      printf("%s: OK\n",mzf);
+    else
+      printf("%s: FAILED, %s\n",mzf,why);
+    if (r > status)
+      status=r;
+  }
+  fclose(fp);
+
+  return(status);
+}
+
+/* On-disk cache of rendered output for batch runs. Each output is kept */
+/* in a file named after a key made from the tape contents, its name,  */
+/* the output mode and the version of mzfview, so a changed tape or a  */
+/* new mzfview never finds stale output. A memory mapped index from    */
+/* file name to key, checked against the file's size, time and inode, */
+/* means an unchanged tape is found again with just a stat. The index */
+/* also records when each entry was last used, for trimming the cache, */
+/* as access times are not kept on noatime or relatime mounts.         */
+#define DISKSLOTS  (1<<18)     // Index size, a power of 2
+#define DISKPROBE      16      // Slots searched before one is reused
+
+typedef struct {
+  uint64_t pathkey;            // Hash of file name, output mode and version
+  int64_t  mtime;              // Modification time of the tape in ns
+  uint64_t size, ino;
+  uint64_t key;                // Key of the rendered output
+  int64_t  used;               // When it was last used, in ns
+} dentry;
+
+const char *cacheversion = "mzfview " __DATE__ " " __TIME__;
+char *cachedir;
+dentry *cacheindex;
+bool cachewritten;
+
+bool open_disk_cache(char *dir)
+{
+  size_t size=DISKSLOTS*sizeof(dentry);
+  char name[PATH_MAX];
+  struct stat st;
+  int fd;
+
+  mkdir(dir,0777);
+  snprintf(name,sizeof(name),"%s/index",dir);
+  fd=open(name,O_RDWR|O_CREAT,0666);
+  /* An index of another size is from another layout, so start afresh */
+  if ((fd < 0) || (fstat(fd,&st) < 0) ||
+      ((st.st_size != (off_t)size) &&
+       ((ftruncate(fd,0) < 0) || (ftruncate(fd,size) < 0)))) {
+    fprintf(stderr,"Error: unable to open cache %s\n",name);
+    return(false);
+  }
+  cacheindex=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (cacheindex == MAP_FAILED) {
+    fprintf(stderr,"Error: unable to map cache %s\n",name);
+    return(false);
+  }
+  cachedir=dir;
+
+  return(true);
+}
+
+/* Read cached output, returning NULL if it is not in the cache */
+char *read_cached(uint64_t key, size_t *len)
+{
+  char name[PATH_MAX], *text;
+  struct stat st;
+  int fd;
+
+  snprintf(name,sizeof(name),"%s/%016" PRIx64 ".out",cachedir,key);
+  fd=open(name,O_RDONLY);
+  if (fd < 0)
+    return(NULL);
+  if (fstat(fd,&st) < 0) {
+    close(fd);
+    return(NULL);
+  }
+  text=malloc(st.st_size+1);
+  *len=read_all(fd,text,st.st_size);
+  close(fd);
+  if (*len != (size_t)st.st_size) {
+    free(text);
+    return(NULL);
+  }
+
+  return(text);
+}
+
+/* Write output to the cache through a temporary file, so a reader */
+/* only ever sees a whole entry                                     */
+void write_cached(uint64_t key, char *text, size_t len)
+{
+  char name[PATH_MAX], tmp[PATH_MAX+16];
+  FILE *fp;
+
+  snprintf(name,sizeof(name),"%s/%016" PRIx64 ".out",cachedir,key);
+  snprintf(tmp,sizeof(tmp),"%s.%d",name,getpid());
+  fp=fopen(tmp,"w");
+  if (fp == NULL)
+    return;
+  if ((fwrite(text,1,len,fp) == len) && (fclose(fp) == 0))
+    rename(tmp,name);
+  else
+    unlink(tmp);
+  cachewritten=true;
+}
+
+/* Time now in ns, for the last use of cache entries */
+int64_t cache_clock(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return(ts.tv_sec*1000000000LL+ts.tv_nsec);
+}
+
+/* Rendered output for a tape file, from the cache if it is there and */
+/* rendering and caching it if not. Returns NULL, having said why, if  */
+/* it can't be read or for machine readable output has no header.      */
+char *cached_render(char *mzf, uint8_t mode, size_t *len)
+{
+  uint64_t pathkey, key;
+  char *text;
+  uint8_t *tape;
+  size_t size;
+  dentry *slot=NULL;
+  struct stat st;
+
+  if (stat(mzf,&st) < 0) {
+    fprintf(stderr,"Error: %s not found\n",mzf);
+    return(NULL);
+  }
+
+  pathkey=hash_bytes(hash_bytes(body_hash((uint8_t *)mzf,strlen(mzf)),
+                     (uint8_t *)cacheversion,strlen(cacheversion)),&mode,1);
+
+  /* Unchanged since it was last seen? */
+  for (uint32_t n=0;n<DISKPROBE;n++) {
+    dentry *e=&cacheindex[(pathkey+n)&(DISKSLOTS-1)];
+    if (e->pathkey == pathkey) {
+      slot=e;
+      if ((e->mtime == st.st_mtim.tv_sec*1000000000LL+st.st_mtim.tv_nsec) &&
+          (e->size == (uint64_t)st.st_size) && (e->ino == st.st_ino) &&
+          ((text=read_cached(e->key,len)) != NULL)) {
+        e->used=cache_clock();
+        return(text);
+      }
+      break;
+    }
+    if ((slot == NULL) && (e->pathkey == 0))
+      slot=e;
+  }
+  if (slot == NULL)
+    slot=&cacheindex[pathkey&(DISKSLOTS-1)];
+
+  /* Look for its contents, otherwise render and cache it */
+  tape=read_tape(mzf,&size);
+  if (tape == NULL) {
+    fprintf(stderr,"Error: %s not found\n",mzf);
+    return(NULL);
+  }
+  if ((size < MZFHEADERSIZE) && (mode != RENDER_TEXT) &&
+      (mode != RENDER_HEX)) {
+    fprintf(stderr,"Error: %s has no tape header\n",mzf);
+    free(tape);
+    return(NULL);
+  }
+  key=hash_bytes(pathkey,tape,size);
+  text=read_cached(key,len);
+  if (text == NULL) {
+    text=render_mzf(tape,size,mzf,mode,len);
+    write_cached(key,text,*len);
+  }
+  free(tape);
+
+  slot->pathkey=pathkey;
+  slot->mtime=st.st_mtim.tv_sec*1000000000LL+st.st_mtim.tv_nsec;
+  slot->size=st.st_size;
+  slot->ino=st.st_ino;
+  slot->key=key;
+  slot->used=cache_clock();
+
+  return(text);
+}
+
+typedef struct {
+  uint64_t key;
+  int64_t used;
+  off_t size;
+  char name[32];
+} cachefile;
+
+int by_key(const void *a, const void *b)
+{
+  uint64_t ka=((cachefile *)a)->key, kb=((cachefile *)b)->key;
+  return((ka > kb) - (ka < kb));
+}
+
+int by_used(const void *a, const void *b)
+{
+  int64_t ua=((cachefile *)a)->used, ub=((cachefile *)b)->used;
+  return((ua > ub) - (ua < ub));
+}
+
+/* If anything was added to the cache, remove the least recently used */
+/* entries until it is back within its size limit. An entry was last  */
+/* used when the latest index slot holding its key was, and one that  */
+/* no slot holds any more goes first.                                 */
+void trim_disk_cache(void)
+{
+  cachefile *files=NULL;
+  size_t n=0, max=0, total=0;
+  char name[PATH_MAX];
+  struct dirent *de;
+  struct stat st;
+  DIR *dir;
+
+  if (!cachewritten || ((dir=opendir(cachedir)) == NULL))
+    return;
+
+  while ((de=readdir(dir)) != NULL) {
+    if ((strlen(de->d_name) != 20) || (strstr(de->d_name,".out") == NULL))
+      continue;
+    snprintf(name,sizeof(name),"%s/%s",cachedir,de->d_name);
+    if (stat(name,&st) < 0)
+      continue;
+    if (n == max)
+      files=realloc(files,(max=max*2+1024)*sizeof(cachefile));
+    files[n].key=strtoull(de->d_name,NULL,16);
+    files[n].used=0;
+    files[n].size=st.st_size;
+    strcpy(files[n++].name,de->d_name);
+    total+=st.st_size;
+  }
+  closedir(dir);
+
+  if (n == 0) {
+    free(files);
+    return;
+  }
+  qsort(files,n,sizeof(cachefile),by_key);
+  for (uint32_t e=0;e < DISKSLOTS;e++) {
+    cachefile *f, k={.key=cacheindex[e].key};
+    if ((cacheindex[e].pathkey == 0) ||
+        ((f=bsearch(&k,files,n,sizeof(cachefile),by_key)) == NULL))
+      continue;
+    if (cacheindex[e].used > f->used)
+      f->used=cacheindex[e].used;
+  }
+  qsort(files,n,sizeof(cachefile),by_used);
+  for (size_t i=0;(i<n)&&(total>cachemax);i++) {
+    snprintf(name,sizeof(name),"%s/%s",cachedir,files[i].name);
+    unlink(name);
+    total-=files[i].size;
+  }
+  free(files);
+}
+
+/* Server thread - each waits on accept() on the shared socket, so the */
+/* kernel hands connections out between them. A request is one line,  */
+/* "<mode> <path>" or "<mode> - <size>" followed by size bytes of tape */
+/* file, where mode is text, json or hex. The reply is the output,     */
+/* then the connection is closed.                                      */
+void *server_worker(void *arg)
+{
+  int sock=*(int *)arg;
+
+  for (;;) {
+    char request[4096], modename[8], *nl, *mzf, *text=NULL;
+    uint8_t *tape=NULL, mode;
+    size_t size=0, len=0, got=0;
+    uint64_t key;
+    ssize_t n;
+    int fd;
+
+    fd=accept(sock,NULL,NULL);
+    if (fd < 0)
+      continue;
+
+    /* Read the request line */
+    while ((got < sizeof(request)-1) &&
+           ((n=read(fd,request+got,sizeof(request)-1-got)) > 0)) {
+      got+=n;
+      request[got]='\0';
+      if (strchr(request,'\n') != NULL)
+        break;
+    }
+    request[got]='\0';
+    nl=strchr(request,'\n');
+    mzf=strchr(request,' ');
+    if ((nl == NULL) || (mzf == NULL) || ((size_t)(mzf-request) >= sizeof(modename))) {
+      dprintf(fd,"Error: bad request\n");
+      close(fd);
+      continue;
+    }
+    *nl='\0';
+    *mzf++='\0';
+    strcpy(modename,request);
+    for (mode=0;(mode<3)&&(strcmp(modename,rendermodes[mode]) != 0);mode++);
+
+    /* Tape from the request, or from a file */
+    if ((mzf[0] == '-') && (mzf[1] == ' ')) {
+      size=strtoul(&mzf[2],NULL,10);
+      if (size > MZFHEADERSIZE+65535)
+        size=0;
+      tape=malloc(size+1);
+      got-=(nl+1)-request;
+      memcpy(tape,nl+1,(got < size) ? got : size);
+      if (got < size)
+        got+=read_all(fd,tape+got,size-got);
+      if (got < size)
+        size=0;
+      mzf="-";
+    }
+    else
+      tape=read_tape(mzf,&size);
+
+    if ((mode == 3) || (tape == NULL) || (size < MZFHEADERSIZE)) {
+      dprintf(fd,"Error: %s\n",(mode == 3) ? "unknown mode" :
+                               "tape file not found or too short");
+      free(tape);
+      close(fd);
+      continue;
+    }
+
+    key=hash_bytes(hash_bytes(body_hash(tape,size),(uint8_t *)mzf,
+                              strlen(mzf)),&mode,1);
+    text=cache_get(key,&len);
+    if (text == NULL) {
+      text=render_mzf(tape,size,mzf,mode,&len);
+      cache_put(key,text,len);
+    }
+
+    for (size_t sent=0;(sent < len) && ((n=write(fd,text+sent,len-sent)) > 0);)
+      sent+=n;
+
+    free(text);
+    free(tape);
+    close(fd);
+  }
+
+  return(NULL);
+}
+
+/* Listen on a UNIX domain socket, serving requests with nthreads threads */
+bool run_server(char *path, int nthreads)
+{
+  struct sockaddr_un addr;
+  pthread_t tid[nthreads];
+  struct stat st;
+  int sock;
+
+  signal(SIGPIPE,SIG_IGN);
+
+  sock=socket(AF_UNIX,SOCK_STREAM,0);
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+  /* Only a socket left by an earlier server is replaced */
+  if ((lstat(path,&st) == 0) && S_ISSOCK(st.st_mode))
+    unlink(path);
+  if ((sock < 0) || (bind(sock,(struct sockaddr *)&addr,sizeof(addr)) < 0) ||
+      (listen(sock,128) < 0)) {
+    fprintf(stderr,"Error: unable to listen on %s\n",path);
+    return(false);
+  }
+
+  for (int t=0;t<nthreads;t++)
+    pthread_create(&tid[t],NULL,server_worker,&sock);
+  for (int t=0;t<nthreads;t++)
+    pthread_join(tid[t],NULL);
+
+  return(true);
+}
+
+/* Watch mode. inotify reports tapes written into, moved into or deleted */
+/* from the watched directory. Names are collected until the directory   */
+/* has been quiet for WATCHQUIET ms, so a tape written in several goes   */
+/* or saved repeatedly is only rendered once, then each is rendered to   */
+/* the output directory, or sent to a listener on a UNIX socket.         */
+#define WATCHQUIET   250       // Debounce time in ms
+#define WATCHSLOTS  1024       // Initial size of the pending name set
+
+typedef struct {
+  char **names;                // Open addressed set of pending names
+  uint32_t slots, count;
+} pending;
+
+bool is_tape_name(char *name)
+{
+  char *ext=strrchr(name,'.');
+  return((ext != NULL) && ((strcasecmp(ext,".mzf") == 0) ||
+         (strcasecmp(ext,".m12") == 0) || (strcasecmp(ext,".mzt") == 0)));
+}
+
+void add_pending(pending *p, char *name)
+{
+  uint32_t n;
+
+  if (p->count*2 >= p->slots) {
+    pending bigger={calloc(p->slots*2,sizeof(char *)),p->slots*2,0};
+    for (n=0;n<p->slots;n++)
+      if (p->names[n] != NULL)
+        add_pending(&bigger,p->names[n]);
+    free(p->names);
+    *p=bigger;
+  }
+  n=body_hash((uint8_t *)name,strlen(name))&(p->slots-1);
+  while (p->names[n] != NULL) {
+    if (strcmp(p->names[n],name) == 0) {
+      if (p->names[n] != name)
+        free(name);
+      return;
+    }
+    n=(n+1)&(p->slots-1);
+  }
+  p->names[n]=name;
+  p->count++;
+}
+
+/* Send output to a listening socket, as the file name on a line of its */
+/* own, the size of the output on the next and the output itself        */
+void send_watched(char *sockpath, char *name, char *text, size_t len)
+{
+  struct sockaddr_un addr={.sun_family=AF_UNIX};
+  FILE *fp;
+  int fd;
+
+  strncpy(addr.sun_path,sockpath,sizeof(addr.sun_path)-1);
+  fd=socket(AF_UNIX,SOCK_STREAM,0);
+  if ((fd < 0) || (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0)) {
+    fprintf(stderr,"Error: unable to connect to %s\n",sockpath);
+    if (fd >= 0)
+      close(fd);
+    return;
+  }
+  fp=fdopen(fd,"w");
+  fprintf(fp,"%s\n%zu\n",name,len);
+  fwrite(text,1,len,fp);
+  fclose(fp);
+}
+
+/* Render one tape from the watched directory, or remove its output if */
+/* the tape has gone. One too short to have a header yet is left alone. */
+void render_watched(char *dir, char *name, char *dest, bool tosocket,
+                    uint8_t mode)
+{
+  char mzf[PATH_MAX], outname[PATH_MAX], tmp[PATH_MAX+16];
+  const char *ext=(mode == RENDER_JSON) ? "json" : "txt";
+  uint8_t *tape;
+  size_t size, len;
+  char *text;
+  FILE *fp;
+
+  snprintf(mzf,sizeof(mzf),"%s/%s",dir,name);
+  snprintf(outname,sizeof(outname),"%s/%s.%s",dest,name,ext);
+  tape=read_tape(mzf,&size);
+  if (tape == NULL) {
+    if (!tosocket)
+      unlink(outname);
+    return;
+  }
+  /* Still being written, so wait for the event that finishes it */
+  if (size < MZFHEADERSIZE) {
+    free(tape);
+    return;
+  }
+  text=render_mzf(tape,size,mzf,mode,&len);
+  free(tape);
+
+  if (tosocket)
+    send_watched(dest,name,text,len);
+  else {
+    snprintf(tmp,sizeof(tmp),"%s.%d",outname,getpid());
+    fp=fopen(tmp,"w");
+    if (fp == NULL)
+      fprintf(stderr,"Error: unable to write %s\n",tmp);
+    else if ((fwrite(text,1,len,fp) == len) && (fclose(fp) == 0))
+      rename(tmp,outname);
+    else
+      unlink(tmp);
+  }
+  free(text);
+}
+
+/* Render tapes that have changed since their output was written, then */
+/* follow changes to the directory until killed                         */
+bool watch_directory(char *dir, char *dest, uint8_t mode)
+{
+  const char *ext=(mode == RENDER_JSON) ? "json" : "txt";
+  char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char mzf[PATH_MAX], outname[PATH_MAX];
+  pending p={calloc(WATCHSLOTS,sizeof(char *)),WATCHSLOTS,0};
+  struct pollfd pfd={.events=POLLIN};
+  struct stat st, ost;
+  struct dirent *de;
+  bool tosocket;
+  ssize_t got;
+  DIR *d;
+
+  tosocket=(stat(dest,&st) == 0) && S_ISSOCK(st.st_mode);
+  if (!tosocket && ((stat(dest,&st) < 0) || !S_ISDIR(st.st_mode))) {
+    fprintf(stderr,"Error: %s is not a directory or socket\n",dest);
+    return(false);
+  }
+
+  /* Start watching before the scan, so nothing is missed in between */
+  pfd.fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if ((pfd.fd < 0) ||
+      (inotify_add_watch(pfd.fd,dir,IN_CLOSE_WRITE|IN_MOVED_TO|
+                         IN_MOVED_FROM|IN_DELETE) < 0)) {
+    fprintf(stderr,"Error: unable to watch %s\n",dir);
+    return(false);
+  }
+
+  d=opendir(dir);
+  if (d == NULL) {
+    fprintf(stderr,"Error: %s not found\n",dir);
+    return(false);
+  }
+  while ((de=readdir(d)) != NULL) {
+    if (!is_tape_name(de->d_name))
+      continue;
+    snprintf(mzf,sizeof(mzf),"%s/%s",dir,de->d_name);
+    snprintf(outname,sizeof(outname),"%s/%s.%s",dest,de->d_name,ext);
+    if (tosocket || (stat(outname,&ost) < 0) || (stat(mzf,&st) < 0) ||
+        (st.st_mtime >= ost.st_mtime))
+      render_watched(dir,de->d_name,dest,tosocket,mode);
+  }
+  closedir(d);
+
+  for (;;) {
+    /* Wait for changes, or for quiet if there are changes to render */
+    if (poll(&pfd,1,(p.count > 0) ? WATCHQUIET : -1) < 0)
+      continue;
+
+    if (pfd.revents & POLLIN) {
+      while ((got=read(pfd.fd,buf,sizeof(buf))) > 0)
+        for (char *e=buf;e<buf+got;
+             e+=sizeof(struct inotify_event)+((struct inotify_event *)e)->len) {
+          struct inotify_event *ev=(struct inotify_event *)e;
+          if ((ev->len > 0) && is_tape_name(ev->name))
+            add_pending(&p,strdup(ev->name));
+        }
+      continue;
+    }
+
+    /* Quiet, so render everything that changed */
+    for (uint32_t n=0;n<p.slots;n++)
+      if (p.names[n] != NULL) {
+        render_watched(dir,p.names[n],dest,tosocket,mode);
+        free(p.names[n]);
+        p.names[n]=NULL;
+      }
+    p.count=0;
+    if (p.slots > WATCHSLOTS) {
+      free(p.names);
+      p=(pending){calloc(WATCHSLOTS,sizeof(char *)),WATCHSLOTS,0};
+    }
+  }
+
+  return(true);
+}
+
+/* Reading tapes straight out of tar, gzipped tar and zip archives. One */
+/* thread reads and decompresses the archive in a single pass, handing */
+/* each tape to a queue that the rendering threads take from, and each */
+/* rendering thread waits its turn so output stays in archive order.   */
+#define ARCHBUF    65536       // Archive read buffer size
+#define ARCHQUEUE     64       // Tapes read ahead of rendering
+#define ARCH_NONE     0        // Kinds of archive and disk image
+#define ARCH_TAR      1
+#define ARCH_GZIP     2
+#define ARCH_ZIP      3
+#define DISK_QD       4
+#define DISK_D88      5
+#define DISK_DSK      6
+#define DISK_RAW      7
+
+typedef struct {
+  FILE *fp;
+  bool gz;                     // Decompress as it is read
+  z_stream z;
+  uint8_t in[ARCHBUF];         // Compressed input when gz
+  uint8_t buf[ARCHBUF];        // Archive bytes
+  size_t pos, len;
+} archive;
+
+typedef struct {
+  char *name;
+  uint8_t *tape;
+  size_t size;
+  uint64_t seq;
+} member;
+
+typedef struct {
+  archive a;
+  char *path;
+  uint8_t mode;
+  FILE *dest;                  // Where rendered output goes
+  char *banner;                // Program name for text mode banners
+  uint8_t kind;                // ARCH_ or DISK_ kind
+  member queue[ARCHQUEUE];
+  uint32_t head, tail;
+  uint64_t count;              // Tapes queued so far
+  bool done;
+  uint64_t nextout;
+  pthread_mutex_t lock;
+  pthread_cond_t ready, space, turn;
+} archjob;
+
+/* Refill the archive buffer, returning false at the end of the archive */
+bool archive_fill(archive *a)
+{
+  a->pos=0;
+  a->len=0;
+  if (!a->gz) {
+    a->len=fread(a->buf,1,ARCHBUF,a->fp);
+    return(a->len > 0);
+  }
+
+  a->z.next_out=a->buf;
+  a->z.avail_out=ARCHBUF;
+  while (a->z.avail_out == ARCHBUF) {
+    if (a->z.avail_in == 0) {
+      a->z.next_in=a->in;
+      a->z.avail_in=fread(a->in,1,ARCHBUF,a->fp);
+      if (a->z.avail_in == 0)
+        break;
+    }
+    switch (inflate(&a->z,Z_NO_FLUSH)) {
+      case Z_OK:         break;
+      case Z_STREAM_END: inflateReset(&a->z); // Concatenated gzip members
+                         break;
+      default:           fprintf(stderr,"Error: corrupt gzip data\n");
+                         a->z.avail_in=0;
+                         fseek(a->fp,0,SEEK_END);
+                         break;
+    }
+  }
+  a->len=ARCHBUF-a->z.avail_out;
+
+  return(a->len > 0);
+}
+
+/* Read (or with data NULL, skip) len bytes, returning the number read */
+size_t archive_read(archive *a, void *data, size_t len)
+{
+  size_t got=0, n;
+
+  while (got < len) {
+    if ((a->pos == a->len) && !archive_fill(a))
+      break;
+    n=(a->len-a->pos < len-got) ? a->len-a->pos : len-got;
+    if (data != NULL)
+      memcpy((uint8_t *)data+got,a->buf+a->pos,n);
+    a->pos+=n;
+    got+=n;
+  }
+
+  return(got);
+}
+
+/* Inflate a zip member of unknown size, stopping at the end of its */
+/* deflate stream. Only the first max bytes are kept.               */
+size_t archive_inflate(archive *a, uint8_t *data, size_t max)
+{
+  uint8_t scratch[ARCHBUF];
+  z_stream z={0};
+  size_t got=0;
+  int ret=Z_OK;
+
+  inflateInit2(&z,-MAX_WBITS);
+  while (ret == Z_OK) {
+    if ((a->pos == a->len) && !archive_fill(a))
+      break;
+    z.next_in=a->buf+a->pos;
+    z.avail_in=a->len-a->pos;
+    do {
+      bool keep=(got < max);
+      z.next_out=keep ? data+got : scratch;
+      z.avail_out=keep ? max-got : ARCHBUF;
+      ret=inflate(&z,Z_NO_FLUSH);
+      if (keep)
+        got=max-z.avail_out;
+    } while ((ret == Z_OK) && (z.avail_in > 0));
+    a->pos=a->len-z.avail_in;
+  }
+  inflateEnd(&z);
+
+  return(got);
+}
+
+/* Skip a zip member whose size is only given by the data descriptor  */
+/* after it, by looking for a signed descriptor whose compressed size */
+/* matches the bytes passed over. Returns false if none is found.     */
+bool archive_skip_member(archive *a)
+{
+  uint8_t w[16];
+  uint64_t count=0;
+  size_t have=0;
+
+  while ((have < 16) || (memcmp(w,"PK\7\10",4) != 0) ||
+         ((w[8]|(w[9]<<8)|(w[10]<<16)|((uint32_t)w[11]<<24)) !=
+          (uint32_t)count)) {
+    if (have == 16) {
+      memmove(w,w+1,15);
+      have--;
+      count++;
+    }
+    if (archive_read(a,w+have,1) != 1)
+      return(false);
+    have++;
+  }
+
+  return(true);
+}
+
+/* Hand a tape to the rendering threads, waiting if they are behind */
+void queue_member(archjob *job, char *name, uint8_t *tape, size_t size)
+{
+  if (((job->kind < DISK_QD) && !is_tape_name(name)) ||
+      (size < MZFHEADERSIZE)) {
+    free(tape);
+    return;
+  }
+  pthread_mutex_lock(&job->lock);
+  while (job->tail-job->head == ARCHQUEUE)
+    pthread_cond_wait(&job->space,&job->lock);
+  job->queue[job->tail%ARCHQUEUE]=(member){NULL,tape,size,job->count++};
+  asprintf(&job->queue[job->tail%ARCHQUEUE].name,"%s/%s",job->path,name);
+  job->tail++;
+  pthread_cond_signal(&job->ready);
+  pthread_mutex_unlock(&job->lock);
+}
+
+/* Numeric tar header field, in octal with optional leading spaces */
+uint64_t octal(uint8_t *field, size_t len)
+{
+  uint64_t v=0;
+  size_t n=0;
+
+  while ((n < len) && (field[n] == ' '))
+    n++;
+  for (;(n<len)&&(field[n]>='0')&&(field[n]<='7');n++)
+    v=(v<<3)|(field[n]-'0');
+
+  return(v);
+}
+
+void read_tar(archjob *job)
+{
+  uint8_t block[512];
+  char name[PATH_MAX], longname[PATH_MAX]="";
+  uint64_t size, keep;
+  uint8_t *tape;
+
+  while (archive_read(&job->a,block,512) == 512) {
+    if (block[0] == 0)
+      break;
+    size=octal(block+124,12);
+    if (longname[0] != '\0') {
+      strcpy(name,longname);
+      longname[0]='\0';
+    }
+    else if ((memcmp(block+257,"ustar",5) == 0) && (block[345] != 0))
+      snprintf(name,sizeof(name),"%.155s/%.100s",block+345,block);
+    else
+      snprintf(name,sizeof(name),"%.100s",block);
+
+    if ((block[156] == '0') || (block[156] == '\0')) {
+      keep=(size < MZFHEADERSIZE+65536) ? size : MZFHEADERSIZE+65536;
+      tape=malloc(keep);
+      keep=archive_read(&job->a,tape,keep);
+      archive_read(&job->a,NULL,size-keep);
+      queue_member(job,name,tape,keep);
+    }
+    else if (block[156] == 'L') {
+      /* GNU long name for the next entry */
+      keep=(size < sizeof(longname)) ? size : sizeof(longname)-1;
+      archive_read(&job->a,longname,keep);
+      longname[keep]='\0';
+      archive_read(&job->a,NULL,size-keep);
+    }
+    else
+      archive_read(&job->a,NULL,size);
+    archive_read(&job->a,NULL,(512-(size%512))%512);
+  }
+}
+
+void read_zip(archjob *job)
+{
+  uint8_t local[30];
+  char name[PATH_MAX];
+  uint32_t csize, namelen;
+  uint16_t flags, method;
+  size_t size, got;
+  uint8_t *tape;
+
+  while ((archive_read(&job->a,local,30) == 30) &&
+         (memcmp(local,"PK\3\4",4) == 0)) {
+    flags=local[6]|(local[7]<<8);
+    method=local[8]|(local[9]<<8);
+    csize=local[18]|(local[19]<<8)|(local[20]<<16)|((uint32_t)local[21]<<24);
+    namelen=local[26]|(local[27]<<8);
+    /* Names longer than a path are cut short and the rest skipped */
+    got=archive_read(&job->a,name,(namelen < sizeof(name)) ? namelen :
+                                                             sizeof(name)-1);
+    name[got]='\0';
+    archive_read(&job->a,NULL,namelen-got+(local[28]|(local[29]<<8)));
+
+    tape=malloc(MZFHEADERSIZE+65536);
+    if (method == 8) {
+      size=archive_inflate(&job->a,tape,MZFHEADERSIZE+65536);
+      if (flags & 0x08) {
+        /* Data descriptor, with or without its signature */
+        uint8_t desc[16];
+        archive_read(&job->a,desc,12);
+        if (memcmp(desc,"PK\7\10",4) == 0)
+          archive_read(&job->a,desc+12,4);
+      }
+    }
+    else if ((method == 0) && !(flags & 0x08)) {
+      size=(csize < MZFHEADERSIZE+65536) ? csize : MZFHEADERSIZE+65536;
+      size=archive_read(&job->a,tape,size);
+      archive_read(&job->a,NULL,csize-size);
+    }
+    else {
+      if (method == 0)
+        fprintf(stderr,"Warning: %s/%s skipped, stored with a data "
+                "descriptor\n",job->path,name);
+      else
+        fprintf(stderr,"Error: %s/%s compressed with unsupported method %d\n",
+                job->path,name,method);
+      free(tape);
+      if (!(flags & 0x08))
+        archive_read(&job->a,NULL,csize);
+      else if (!archive_skip_member(&job->a)) {
+        fprintf(stderr,"Error: %s/%s has no data descriptor to skip to\n",
+                job->path,name);
+        break;
+      }
+      continue;
+    }
+    queue_member(job,name,tape,size);
+  }
+}
+
+/* Quick Disk and floppy disk images. The whole image is mapped, its  */
+/* directory read and each file turned into a tape, a 128 byte header */
+/* followed by the body, which then goes through the rendering        */
+/* threads as if it had come from an archive.                         */
+/*                                                                    */
+/* A Quick Disk image is "-QD format-" and five 0xff bytes followed   */
+/* by the raw disk, a series of blocks each starting with a 0x16 sync */
+/* and 0xa5 mark, then a block type, 16 bit length, data and CRC.     */
+/* Block type 0x00 is a file header, type 0x05 the body that follows. */
+/*                                                                    */
+/* Floppies use the Disk BASIC filesystem of 256 byte sectors, 16 to  */
+/* a track and sides interleaved, with a directory of 32 byte entries */
+/* in the 8 sectors from sector 16. Each file is held in consecutive  */
+/* sectors. Images may be D88, extended CPC DSK or raw sectors, and   */
+/* the MZ-80B and MZ-2000 store every byte inverted.                  */
+/*                                                                    */
+/* File headers on both have the layout of a tape header, except for  */
+/* two extra bytes after the name, so size, load and exec addresses   */
+/* are at 20, 22 and 24. Floppy directory entries add the first       */
+/* sector at 30.                                                      */
+#define SECSIZE     256        // Disk BASIC sector size
+#define SECTRACK     16        // Sectors per track
+#define MAXSECTORS (2*84*SECTRACK)
+#define DIRSECTOR    16        // First directory sector
+#define DIRSECTORS    8
+
+/* Make a tape from a disk file header and body, and queue it */
+void queue_disk_file(archjob *job, uint8_t *dirent, uint8_t *body,
+                     size_t size, bool invert)
+{
+  uint8_t *tape=calloc(MZFHEADERSIZE+size,1);
+  char name[18];
+  uint8_t n;
+
+  /* Type and name, then size, load and exec from after 2 unused bytes */
+  for (n=0;n<26;n++)
+    if ((n < 18) || (n >= 20))
+      tape[(n < 18) ? n : n-2]=dirent[n]^(invert ? 0xff : 0);
+  memcpy(tape+MZFHEADERSIZE,body,size);
+  if (invert)
+    for (size_t i=0;i<size;i++)
+      tape[MZFHEADERSIZE+i]^=0xff;
+
+  /* Member name from the file name, up to its 0x0d terminator */
+  for (n=0;(n<17)&&(tape[n+1]!=0x0d)&&(tape[n+1]!=0);n++)
+    name[n]=((tape[n+1] >= 0x20) && (tape[n+1] < 0x7f) &&
+             (tape[n+1] != '/')) ? tape[n+1] : '_';
+  name[n]='\0';
+  queue_member(job,name,tape,MZFHEADERSIZE+size);
+}
+
+void read_qd(archjob *job, uint8_t *image, size_t size)
+{
+  uint8_t *hdr=NULL;
+  size_t i, len;
+
+  for (i=1;i+4<size;i++) {
+    if ((image[i] != 0xa5) || (image[i-1] != 0x16))
+      continue;
+    len=image[i+2]|(image[i+3]<<8);
+    if (i+4+len > size)
+      break;
+    if ((image[i+1] == 0x00) && (len >= 26))
+      hdr=image+i+4;
+    else if ((image[i+1] == 0x05) && (hdr != NULL)) {
+      queue_disk_file(job,hdr,image+i+4,len,false);
+      hdr=NULL;
+    }
+    i+=4+len+1;                // Past the data and CRC
+  }
+}
+
+/* Find each sector of a D88 or extended DSK image, as sector[logical] */
+/* Entries in the track table of a D88 image, or 0 if it isn't one. The */
+/* header gives the image's size and a known write protect and media    */
+/* byte, and each track lies within the image after the table, which    */
+/* ends where the first track starts (some images have 160 entries).    */
+uint32_t d88_tracks(uint8_t *image, size_t size)
+{
+  uint32_t tracks=164;
+
+  if ((size < 0x2b0) ||
+      ((image[0x1c]|(image[0x1d]<<8)|(image[0x1e]<<16)|
+        ((size_t)image[0x1f]<<24)) != size) ||
+      ((image[0x1a] != 0x00) && (image[0x1a] != 0x10)) ||
+      ((image[0x1b]&0x0f) != 0) || (image[0x1b] > 0x40))
+    return(0);
+  for (uint32_t t=0;t<tracks;t++) {
+    uint8_t *e=image+0x20+4*t;
+    size_t pos=e[0]|(e[1]<<8)|(e[2]<<16)|((size_t)e[3]<<24);
+    if (pos == 0)
+      continue;
+    if ((pos < 0x20+4*(t+1)) || (pos >= size))
+      return(0);
+    if ((pos-0x20)/4 < tracks)
+      tracks=(pos-0x20)/4;
+  }
+
+  return(tracks);
+}
+
+void d88_sectors(uint8_t *image, size_t size, uint8_t **sector)
+{
+  uint32_t tracks=d88_tracks(image,size);
+
+  for (uint32_t t=0;t<tracks;t++) {
+    uint8_t *e=image+0x20+4*t;
+    size_t pos=e[0]|(e[1]<<8)|(e[2]<<16)|((size_t)e[3]<<24);
+    uint16_t count=1;
+    for (uint16_t s=0;(s<count)&&(pos!=0)&&(pos+16<=size);s++) {
+      uint8_t *sh=image+pos;
+      uint16_t len=sh[14]|(sh[15]<<8);
+      uint32_t n=(sh[0]*2+sh[1])*SECTRACK+sh[2]-1;
+      count=sh[4]|(sh[5]<<8);
+      if ((n < MAXSECTORS) && (len >= SECSIZE) && (pos+16+SECSIZE <= size))
+        sector[n]=sh+16;
+      pos+=16+len;
+    }
+  }
+}
+
+void dsk_sectors(uint8_t *image, size_t size, uint8_t **sector)
+{
+  uint32_t tracks, s, sectors;
+  size_t pos=0x100;
+
+  /* The track size table has to fit in the 256 byte disk header */
+  if (size < 0x100)
+    return;
+  tracks=image[0x30]*image[0x31];
+  if (tracks > 0x100-0x34)
+    return;
+
+  for (uint32_t t=0;(t<tracks)&&(pos+0x100 <= size);t++) {
+    uint8_t *ti=image+pos;
+    size_t data=pos+0x100;
+    if (image[0x34+t] == 0)
+      continue;
+    /* As many sectors as the 256 byte track header has room for */
+    sectors=(ti[0x15] < (0x100-0x18)/8) ? ti[0x15] : (0x100-0x18)/8;
+    for (s=0;s<sectors;s++) {
+      uint8_t *si=ti+0x18+8*s;
+      uint16_t len=si[6]|(si[7]<<8);
+      uint32_t n=(si[0]*2+si[1])*SECTRACK+si[2]-1;
+      if ((n < MAXSECTORS) && (len >= SECSIZE) && (data+SECSIZE <= size))
+        sector[n]=image+data;
+      data+=len;
+    }
+    pos+=image[0x34+t]<<8;
+  }
+}
+
+/* Is this a Disk BASIC directory, and is it stored inverted? */
+bool disk_directory(uint8_t **sector, bool *invert)
+{
+  for (int inv=0;inv<2;inv++) {
+    uint8_t x=inv ? 0xff : 0;
+    int files=0, bad=0;
+    for (uint32_t s=DIRSECTOR;s<DIRSECTOR+DIRSECTORS;s++) {
+      if (sector[s] == NULL)
+        return(false);
+      for (uint32_t e=0;e<SECSIZE;e+=32) {
+        uint8_t mode=sector[s][e]^x;
+        if ((mode == 0) || (mode >= 0x80))
+          continue;
+        if ((mode <= 5) && (memchr(sector[s]+e+1,0x0d^x,17) != NULL))
+          files++;
+        else
+          bad++;
+      }
+    }
+    if ((files > 0) && (bad == 0)) {
+      *invert=inv;
+      return(true);
+    }
+  }
+
+  return(false);
+}
+
+void read_floppy(archjob *job, uint8_t *image, size_t size, uint8_t kind)
+{
+  uint8_t **sector=calloc(MAXSECTORS,sizeof(uint8_t *));
+  uint8_t *body=malloc(65536);
+  bool invert;
+
+  if (kind == DISK_D88)
+    d88_sectors(image,size,sector);
+  else if (kind == DISK_DSK)
+    dsk_sectors(image,size,sector);
+  else
+    for (size_t n=0;(n<MAXSECTORS)&&((n+1)*SECSIZE<=size);n++)
+      sector[n]=image+n*SECSIZE;
+
+  if (!disk_directory(sector,&invert))
+    fprintf(stderr,"Error: no Disk BASIC directory in %s\n",job->path);
+  else
+    for (uint32_t s=DIRSECTOR;s<DIRSECTOR+DIRSECTORS;s++)
+      for (uint32_t e=0;e<SECSIZE;e+=32) {
+        uint8_t *d=sector[s]+e, x=invert ? 0xff : 0;
+        uint16_t fs=(d[20]^x)|((d[21]^x)<<8);
+        uint16_t start=(d[30]^x)|((d[31]^x)<<8);
+        if (((d[0]^x) == 0) || ((d[0]^x) >= 0x80))
+          continue;
+        /* Gather the body from its sectors, which may be scattered */
+        /* through a D88 or DSK image                               */
+        for (uint32_t n=0;n*SECSIZE<fs;n++) {
+          uint32_t len=(fs-n*SECSIZE < SECSIZE) ? fs-n*SECSIZE : SECSIZE;
+          if ((start+n < MAXSECTORS) && (sector[start+n] != NULL))
+            memcpy(body+n*SECSIZE,sector[start+n],len);
+          else
+            memset(body+n*SECSIZE,x,len);
+        }
+        queue_disk_file(job,d,body,fs,invert);
+      }
+
+  free(body);
+  free(sector);
+}
+
+void read_disk(archjob *job, uint8_t kind)
+{
+  struct stat st;
+  uint8_t *image;
+  int fd=fileno(job->a.fp);
+
+  if ((fstat(fd,&st) < 0) || (st.st_size == 0))
+    return;
+  image=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  if (image == MAP_FAILED) {
+    fprintf(stderr,"Error: unable to map %s\n",job->path);
+    return;
+  }
+  if (kind == DISK_QD)
+    read_qd(job,image,st.st_size);
+  else
+    read_floppy(job,image,st.st_size,kind);
+  munmap(image,st.st_size);
+}
+
+/* What kind of archive or disk image a file starting with start[len] */
+/* is, if any. filesize is the size of the whole file.                */
+uint8_t archive_kind_of(uint8_t *start, size_t len, char *path,
+                        off_t filesize)
+{
+  char *ext=strrchr(path,'.');
+  uint8_t padded[0x2b0]={0};
+
+  if (len < sizeof(padded)) {
+    memcpy(padded,start,len);
+    start=padded;
+  }
+  if ((start[0] == 0x1f) && (start[1] == 0x8b))
+    return(ARCH_GZIP);
+  if (memcmp(start,"PK\3\4",4) == 0)
+    return(ARCH_ZIP);
+  if (memcmp(start+257,"ustar",5) == 0)
+    return(ARCH_TAR);
+  if (memcmp(start,"-QD format-",11) == 0)
+    return(DISK_QD);
+  if (memcmp(start,"EXTENDED CPC DSK File",21) == 0)
+    return(DISK_DSK);
+  if (d88_tracks(start,filesize) > 0)
+    return(DISK_D88);
+  if ((ext != NULL) && ((strcasecmp(ext,".qdf") == 0) ||
+                        (strcasecmp(ext,".mzq") == 0)))
+    return(DISK_QD);
+  if ((ext != NULL) && ((strcasecmp(ext,".2d") == 0) ||
+                        (strcasecmp(ext,".img") == 0) ||
+                        (strcasecmp(ext,".dsk") == 0)))
+    return(DISK_RAW);
+
+  return(ARCH_NONE);
+}
+
+/* What kind of archive or disk image, if any, is a file? */
+uint8_t archive_kind(char *path)
+{
+  uint8_t start[0x2b0]={0};
+  struct stat st;
+  FILE *fp=fopen(path,"r");
+
+  if (fp == NULL)
+    return(ARCH_NONE);
+  if ((fread(start,1,sizeof(start),fp) == 0) || (fstat(fileno(fp),&st) < 0))
+    st.st_size=0;
+  fclose(fp);
+
+  return(archive_kind_of(start,sizeof(start),path,st.st_size));
+}
+
+/* Reading thread */
+void *archive_reader(void *arg)
+{
+  archjob *job=arg;
+
+  if (job->kind >= DISK_QD)
+    read_disk(job,job->kind);
+  else {
+    archive_fill(&job->a);
+    if (job->kind == ARCH_GZIP) {
+      /* Start again, this time decompressing */
+      job->a.gz=true;
+      inflateInit2(&job->a.z,16+MAX_WBITS);
+      job->a.z.next_in=job->a.in;
+      job->a.z.avail_in=job->a.len;
+      memcpy(job->a.in,job->a.buf,job->a.len);
+      job->a.len=job->a.pos=0;
+    }
+    if (job->kind == ARCH_ZIP)
+      read_zip(job);
+    else
+      read_tar(job);
+  }
+  if (job->a.gz)
+    inflateEnd(&job->a.z);
+
+  pthread_mutex_lock(&job->lock);
+  job->done=true;
+  pthread_cond_broadcast(&job->ready);
+  pthread_mutex_unlock(&job->lock);
+
+  return(NULL);
+}
+
+/* Rendering thread */
+void *archive_renderer(void *arg)
+{
+  archjob *job=arg;
+  member m;
+  size_t len;
+  char *text;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    while ((job->head == job->tail) && !job->done)
+      pthread_cond_wait(&job->ready,&job->lock);
+    if (job->head == job->tail) {
+      pthread_mutex_unlock(&job->lock);
+      return(NULL);
+    }
+    m=job->queue[job->head++%ARCHQUEUE];
+    pthread_cond_signal(&job->space);
+    pthread_mutex_unlock(&job->lock);
+
+    text=render_mzf(m.tape,m.size,m.name,job->mode,&len);
+
+    pthread_mutex_lock(&job->lock);
+    while (job->nextout != m.seq)
+      pthread_cond_wait(&job->turn,&job->lock);
+    if (job->banner != NULL)
+      fprintf(job->dest,"%s %s\n",job->banner,m.name);
+    fwrite(text,1,len,job->dest);
+    job->nextout++;
+    pthread_cond_broadcast(&job->turn);
+    pthread_mutex_unlock(&job->lock);
+
+    free(text);
+    free(m.tape);
+    free(m.name);
+  }
+}
+
+/* Does a file look like an archive or disk image? */
+bool is_archive(char *path)
+{
+  return(archive_kind(path) != ARCH_NONE);
+}
+
+/* Render every tape in an archive to dest, in archive order */
+bool process_archive(char *path, uint8_t mode, FILE *dest, char *banner,
+                     int nthreads)
+{
+  archjob *job=calloc(1,sizeof(archjob));
+  pthread_t reader, *renderers=calloc(nthreads,sizeof(pthread_t));
+
+  job->a.fp=fopen(path,"r");
+  if (job->a.fp == NULL) {
+    fprintf(stderr,"Error: %s not found\n",path);
+    free(job);
+    free(renderers);
+    return(false);
+  }
+  job->path=path;
+  job->kind=archive_kind(path);
+  job->mode=mode;
+  job->dest=dest;
+  job->banner=banner;
+  pthread_mutex_init(&job->lock,NULL);
+  pthread_cond_init(&job->ready,NULL);
+  pthread_cond_init(&job->space,NULL);
+  pthread_cond_init(&job->turn,NULL);
+
+  pthread_create(&reader,NULL,archive_reader,job);
+  for (int n=0;n<nthreads;n++)
+    pthread_create(&renderers[n],NULL,archive_renderer,job);
+  pthread_join(reader,NULL);
+  for (int n=0;n<nthreads;n++)
+    pthread_join(renderers[n],NULL);
+
+  fclose(job->a.fp);
+  free(job);
+  free(renderers);
+
+  return(true);
+}
+
+/* Read ahead for batch runs. Opening and reading small tape files is */
+/* mostly waiting on the disk, so PREFETCHERS threads open and read   */
+/* whole files, PREFETCHBATCH at a time, keeping up to PREFETCHAHEAD  */
+/* ahead of the file being rendered. Files are handed out in order.   */
+#define PREFETCHERS    32
+#define PREFETCHAHEAD 256
+#define PREFETCHBATCH   8      // Files each thread reads at a time
+
+typedef struct {
+  uint8_t *tape;               // NULL if the file can't be read
+  size_t size;                 // Bytes read
+  off_t filesize;              // Size of the whole file
+  bool ready;
+} fetched;
+
+typedef struct {
+  char **files;
+  int count;
+  int next;                    // Next file to be read
+  int taken;                   // Files handed out so far
+  fetched slot[PREFETCHAHEAD];
+  pthread_mutex_t lock;
+  pthread_cond_t ready, space;
+  pthread_t thread[PREFETCHERS];
+  int nthreads;
+} prefetch;
+
+void *prefetcher(void *arg)
+{
+  prefetch *pf=arg;
+  fetched f[PREFETCHBATCH];
+
+  for (;;) {
+    struct stat st;
+    int first, n;
+
+    pthread_mutex_lock(&pf->lock);
+    while ((pf->next < pf->count) &&
+           (pf->next+PREFETCHBATCH-pf->taken > PREFETCHAHEAD))
+      pthread_cond_wait(&pf->space,&pf->lock);
+    first=pf->next;
+    pf->next+=PREFETCHBATCH;
+    pthread_mutex_unlock(&pf->lock);
+    if (first >= pf->count)
+      return(NULL);
+
+    /* The most of a file a tape can use is its header and a 64K body */
+    for (n=0;(n<PREFETCHBATCH)&&(first+n<pf->count);n++) {
+      int fd=open(pf->files[first+n],O_RDONLY);
+      f[n]=(fetched){NULL,0,0,true};
+      if ((fd >= 0) && (fstat(fd,&st) == 0)) {
+        size_t want=(st.st_size < MZFHEADERSIZE+65536) ? st.st_size :
+                    MZFHEADERSIZE+65536;
+        f[n].filesize=st.st_size;
+        f[n].tape=malloc(want+1);
+        f[n].size=read_all(fd,f[n].tape,want);
+      }
+      if (fd >= 0)
+        close(fd);
+    }
+
+    pthread_mutex_lock(&pf->lock);
+    while (n-- > 0)
+      pf->slot[(first+n)%PREFETCHAHEAD]=f[n];
+    pthread_cond_signal(&pf->ready);
+    pthread_mutex_unlock(&pf->lock);
+  }
+}
+
+prefetch *start_prefetch(char **files, int count)
+{
+  prefetch *pf=calloc(1,sizeof(prefetch));
+
+  pf->files=files;
+  pf->count=count;
+  pf->nthreads=(count/PREFETCHBATCH < PREFETCHERS) ?
+               count/PREFETCHBATCH+1 : PREFETCHERS;
+  pthread_mutex_init(&pf->lock,NULL);
+  pthread_cond_init(&pf->ready,NULL);
+  pthread_cond_init(&pf->space,NULL);
+  for (int n=0;n<pf->nthreads;n++)
+    pthread_create(&pf->thread[n],NULL,prefetcher,pf);
+
+  return(pf);
+}
+
+/* The contents of the next file, waiting for it to be read if need be. */
+/* Returns NULL if it can't be read.                                    */
+uint8_t *next_prefetched(prefetch *pf, size_t *size, off_t *filesize)
+{
+  fetched *f=&pf->slot[pf->taken%PREFETCHAHEAD];
+  uint8_t *tape;
+
+  pthread_mutex_lock(&pf->lock);
+  while (!f->ready)
+    pthread_cond_wait(&pf->ready,&pf->lock);
+  tape=f->tape;
+  *size=f->size;
+  *filesize=f->filesize;
+  f->ready=false;
+  pf->taken++;
+  pthread_cond_signal(&pf->space);
+  pthread_mutex_unlock(&pf->lock);
+
+  return(tape);
+}
+
+void end_prefetch(prefetch *pf)
+{
+  for (int n=0;n<pf->nthreads;n++)
+    pthread_join(pf->thread[n],NULL);
+  free(pf);
+}
+
+/* Near duplicate tapes. Each tape is cut into shingles, runs of three */
+/* tokens of a BASIC listing, line numbers left out, or eight bytes of */
+/* any other body, and summed up by a MinHash signature: the smallest  */
+/* of each of MINHASHES hashes of its shingles. Tapes whose signatures */
+/* agree in all rows of any band share an LSH bucket, and those that  */
+/* agree in at least NEARSIMILAR% of the signature are put in the same */
+/* cluster. Only the signatures and buckets are kept, so a whole      */
+/* archive is clustered in one pass.                                  */
+#define MINHASHES    64        // Hashes in a signature
+#define BANDS        16        // LSH bands of MINHASHES/BANDS rows
+#define SHINGLE       3        // Tokens in a BASIC shingle
+#define NEARSIMILAR  70        // Percentage of the signature to agree
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MINHASH_CLONES __attribute__((target_clones("avx2","default")))
+#else
+#define MINHASH_CLONES
+#endif
+
+typedef struct {
+  uint32_t sig[MINHASHES];
+  uint32_t shingles;
+  uint32_t size;
+} nearsig;
+
+typedef struct {
+  uint64_t key;                // Band number and the hash of its rows
+  uint32_t tape;               // First tape in the bucket, plus 1
+} bucket;
+
+uint32_t mhmul[MINHASHES], mhadd[MINHASHES];
+
+/* The shingles of a tape body, as 32 bit hashes */
+uint32_t *tape_shingles(uint8_t *body, uint16_t fs, uint32_t *n)
+{
+  uint32_t *sh=malloc((fs+1)*sizeof(uint32_t));
+  uint8_t dialect=basic_dialect();
+
+  *n=0;
+  if (((header[0] == 0x02) || (header[0] == 0x05)) &&
+      (dialects[dialect].print != NULL)) {
+    uint64_t keys[SHINGLE]={0};
+    uint32_t got=0;
+    program pg;
+    item it;
+    index_program(&pg,body,fs,dialect);
+    for (uint32_t l=0;l<pg.nlines;l++)
+      for (uint32_t i=pg.start[l];next_item(dialect,body,fs,&i,&it);) {
+        uint64_t h=0xcbf29ce484222325ULL;
+        memmove(keys,keys+1,(SHINGLE-1)*sizeof(uint64_t));
+        keys[SHINGLE-1]=hash_bytes(h,body+it.pos,it.len);
+        if (++got < SHINGLE)
+          continue;
+        h=hash_bytes(h,(uint8_t *)keys,sizeof(keys));
+        sh[(*n)++]=(uint32_t)(h^(h>>32));
+      }
+    free_program(&pg);
+  }
+  else
+    for (uint32_t i=0;(i == 0) || (i+8 <= fs);i++) {
+      uint64_t h=hash_bytes(0xcbf29ce484222325ULL,body+i,(fs < 8) ? fs : 8);
+      sh[(*n)++]=(uint32_t)(h^(h>>32));
+      if (fs < 8)
+        break;
+    }
+
+  return(sh);
+}
+
+/* The MinHash signature of n shingles. Each hash is a multiply and add */
+/* followed by a mix, the same sum across the signature so it can be    */
+/* worked out several at a time.                                        */
+MINHASH_CLONES
+void minhash(const uint32_t *sh, uint32_t n, uint32_t *sig)
+{
+  for (int i=0;i<MINHASHES;i++)
+    sig[i]=UINT32_MAX;
+  for (uint32_t s=0;s<n;s++) {
+    uint32_t x=sh[s];
+    for (int i=0;i<MINHASHES;i++) {
+      uint32_t h=mhmul[i]*x+mhadd[i];
+      h=(h^(h>>16))*0x45d9f3bu;
+      h^=h>>16;
+      sig[i]=(h < sig[i]) ? h : sig[i];
+    }
+  }
+}
+
+/* Percentage of two signatures that agree */
+int similarity(nearsig *a, nearsig *b)
+{
+  int same=0;
+
+  for (int i=0;i<MINHASHES;i++)
+    same+=(a->sig[i] == b->sig[i]);
+
+  return(same*100/MINHASHES);
+}
+
+uint32_t cluster_root(uint32_t *parent, uint32_t t)
+{
+  while (parent[t] != t)
+    t=parent[t]=parent[parent[t]];
+
+  return(t);
+}
+
+typedef struct {
+  uint32_t root, tape;
+} clustered;
+
+int by_root(const void *a, const void *b)
+{
+  const clustered *x=a, *y=b;
+
+  if (x->root != y->root)
+    return((x->root < y->root) ? -1 : 1);
+  return((x->tape < y->tape) ? -1 : (x->tape > y->tape));
+}
+
+typedef struct {
+  uint32_t first, count;
+} cluster;
+
+int by_count(const void *a, const void *b)
+{
+  const cluster *x=a, *y=b;
+
+  if (x->count != y->count)
+    return((x->count > y->count) ? -1 : 1);
+  return((x->first < y->first) ? -1 : (x->first > y->first));
+}
+
+/* Cluster near duplicates among count files and report each cluster */
+/* with the copy to keep, the one with the most shingles and then the */
+/* longest body.                                                      */
+int cluster_tapes(char **files, int count)
+{
+  nearsig *ns=calloc(count+1,sizeof(nearsig));
+  uint32_t *parent=malloc((count+1)*sizeof(uint32_t));
+  uint32_t nslots=1024, nclusters=0, n=0;
+  uint64_t seed=0x9e3779b97f4a7c15ULL;
+  clustered *m=malloc((count+1)*sizeof(clustered));
+  cluster *cl;
+  bucket *slots;
+  prefetch *pf;
+
+  while (nslots < 2u*BANDS*count)
+    nslots<<=1;
+  slots=calloc(nslots,sizeof(bucket));
+  for (int i=0;i<MINHASHES;i++) {
+    seed=(seed^(seed>>31))*0xbf58476d1ce4e5b9ULL+i;
+    mhmul[i]=(uint32_t)(seed>>32)|1;
+    mhadd[i]=(uint32_t)seed;
+  }
+
+  pf=start_prefetch(files,count);
+  for (int t=0;t<count;t++) {
+    size_t size;
+    off_t filesize;
+    uint8_t *tape=next_prefetched(pf,&size,&filesize), *body;
+    uint32_t *sh;
+    uint16_t fs;
+
+    parent[t]=t;
+    if (tape == NULL) {
+      fprintf(stderr,"Error: %s not found\n",files[t]);
+      continue;
+    }
+    if (size < MZFHEADERSIZE) {
+      fprintf(stderr,"Error: %s is too short to be a tape\n",files[t]);
+      free(tape);
+      continue;
+    }
+    memcpy(header,tape,MZFHEADERSIZE);
+    fs=((header[19]<<8)&0xff00)|header[18];
+    if (size-MZFHEADERSIZE < fs)
+      fs=size-MZFHEADERSIZE;
+    body=new_body(fs);
+    memcpy(body,tape+MZFHEADERSIZE,fs);
+    free(tape);
+    sh=tape_shingles(body,fs,&ns[t].shingles);
+    ns[t].size=fs;
+    free(body);
+    if (ns[t].shingles > 0)
+      minhash(sh,ns[t].shingles,ns[t].sig);
+    free(sh);
+    if ((ns[t].shingles == 0) || (fs == 0))
+      continue;
+
+    /* Join the cluster of anything similar met in a bucket */
+    for (uint32_t b=0;b<BANDS;b++) {
+      uint32_t rows=MINHASHES/BANDS;
+      uint64_t key=hash_bytes(0xcbf29ce484222325ULL+b,
+                              (uint8_t *)&ns[t].sig[b*rows],
+                              rows*sizeof(uint32_t));
+      uint32_t s=key&(nslots-1);
+      while ((slots[s].tape != 0) && (slots[s].key != key))
+        s=(s+1)&(nslots-1);
+      if (slots[s].tape == 0) {
+        slots[s].key=key;
+        slots[s].tape=t+1;
+      }
+      else if (similarity(&ns[t],&ns[slots[s].tape-1]) >= NEARSIMILAR)
+        parent[cluster_root(parent,t)]=cluster_root(parent,slots[s].tape-1);
+    }
+  }
+  end_prefetch(pf);
+  free(slots);
+
+  for (int t=0;t<count;t++) {
+    m[t].root=cluster_root(parent,t);
+    m[t].tape=t;
+  }
+  qsort(m,count,sizeof(clustered),by_root);
+  cl=malloc((count+1)*sizeof(cluster));
+  for (int t=0;t<count;t=n) {
+    for (n=t+1;(n < (uint32_t)count)&&(m[n].root == m[t].root);n++);
+    if (n-t > 1) {
+      cl[nclusters].first=t;
+      cl[nclusters++].count=n-t;
+    }
+  }
+  qsort(cl,nclusters,sizeof(cluster),by_count);
+
+  for (uint32_t c=0;c<nclusters;c++) {
+    clustered *first=&m[cl[c].first];
+    nearsig *keep;
+    uint32_t k=0;
+    for (uint32_t i=1;i<cl[c].count;i++) {
+      nearsig *a=&ns[first[i].tape], *b=&ns[first[k].tape];
+      if ((a->shingles > b->shingles) ||
+          ((a->shingles == b->shingles) && (a->size > b->size)))
+        k=i;
+    }
+    keep=&ns[first[k].tape];
+    fprintf(out,"Cluster %u, %u tapes, keep %s\n",c+1,cl[c].count,
+            files[first[k].tape]);
+    for (uint32_t i=0;i<cl[c].count;i++)
+      fprintf(out,"  %3d%% %5u bytes  %s\n",
+              similarity(&ns[first[i].tape],keep),ns[first[i].tape].size,
+              files[first[i].tape]);
+  }
+  fprintf(out,"%u clusters of near duplicates among %d tapes\n",nclusters,
+          count);
+
+  free(cl);
+  free(m);
+  free(parent);
+  free(ns);
+
+  return(0);
+}
+
+/* Corpus statistics for -T. Each worker thread is a map stage that     */
+/* counts into a histogram of its own, so no locks are taken however    */
+/* many files there are; once the workers are done the histograms are   */
+/* added together and sorted. Counted for each BASIC are its keyword    */
+/* and operator tokens, the constant addresses given to POKE and USR,   */
+/* and for S-BASIC its decimal constants, keyed by their float bits.    */
+#define TOKENS  (3*256)        // Token map indexes, as tokmap_index gives
+#define CONSTSLOTS 1024        // First size of a constant table, a power of 2
+
+typedef struct {
+  uint32_t bits, count;        // Float bits of a constant, count 0 if free
+} constcount;
+
+typedef struct {
+  uint32_t slots, used;
+  constcount *c;
+} consttable;
+
+typedef struct {
+  uint64_t tapes, programs[DIALECTS], lines[DIALECTS];
+  uint64_t tokens[DIALECTS][TOKENS];
+  uint32_t inprograms[DIALECTS][TOKENS]; // Programs using each token
+  uint32_t poke[DIALECTS][65536], usr[DIALECTS][65536];
+  consttable consts;           // S-BASIC constants
+} histogram;
+
+/* What one program holds, its feature vector */
+typedef struct {
+  uint32_t lines, tokens[TOKENS];
+  uint16_t *poke, *usr;
+  float *consts;
+  uint32_t npoke, nusr, nconsts;
+} features;
+
+char **statfiles;
+int statcount;
+atomic_int statnext;
+char **statvectors;            // Feature vector of each file, or NULL
+uint16_t poketok[DIALECTS], usrtok[DIALECTS];
+
+/* Add n to the count of a constant, growing the table at half full */
+void count_const(consttable *t, uint32_t bits, uint32_t n)
+{
+  uint32_t h=bits*0x9e3779b1u;
+
+  if (2*(t->used+1) > t->slots) {
+    consttable g={(t->slots == 0) ? CONSTSLOTS : 2*t->slots,0,NULL};
+    g.c=calloc(g.slots,sizeof(constcount));
+    for (uint32_t s=0;s<t->slots;s++)
+      if (t->c[s].count != 0)
+        count_const(&g,t->c[s].bits,t->c[s].count);
+    free(t->c);
+    *t=g;
+  }
+  for (h=(h^(h>>16))&(t->slots-1);t->c[h].count != 0;h=(h+1)&(t->slots-1))
+    if (t->c[h].bits == bits) {
+      t->c[h].count+=n;
+      return;
+    }
+  t->c[h].bits=bits;
+  t->c[h].count=n;
+  t->used++;
+}
+
+/* Token for a token map index in a BASIC */
+uint16_t index_token(uint8_t dialect, uint16_t idx)
+{
+  return(dialects[dialect].planes[idx>>8]|(idx&0xff));
+}
+
+/* Walk a program line by line, as the listing does, collecting its */
+/* features. A POKE or USR address is the first number after the    */
+/* keyword, with only spaces or a bracket between them.             */
+void program_features(features *fv, uint8_t *body, uint16_t fs,
+                      uint8_t dialect)
+{
+  const flowtokens *ft=dialects[dialect].flow;
+  uint32_t i=0;
+
+  while ((i+4 <= fs) && ((body[i] != 0x00) || (body[i+1] != 0x00))) {
+    uint16_t want=0;
+    item it;
+
+    fv->lines++;
+    i+=4;
+    while (next_item(dialect,body,fs,&i,&it)) {
+      if ((it.kind == ITEM_NUMBER) || (it.kind == ITEM_HEX)) {
+        if ((want != 0) && (it.value >= 0) && (it.value <= 0xffff)) {
+          if (want == poketok[dialect])
+            fv->poke[fv->npoke++]=it.value;
+          else
+            fv->usr[fv->nusr++]=it.value;
+        }
+        if ((dialect == MZ700) && (it.kind == ITEM_NUMBER))
+          fv->consts[fv->nconsts++]=it.value;
+        want=0;
+      }
+      else if (it.kind == ITEM_TOKEN) {
+        if (token_text(dialect,it.tok) != NULL)
+          fv->tokens[tokmap_index(it.tok)]++;
+        want=((it.tok == poketok[dialect]) || (it.tok == usrtok[dialect])) ?
+             it.tok : 0;
+        if (it.tok == ft->rem)
+          skip_text(dialect,body,fs,&i,false);
+        else if (it.tok == ft->data)
+          skip_text(dialect,body,fs,&i,true);
+      }
+      else if ((it.kind != ITEM_CHAR) || ((it.tok != 0x20) && (it.tok != 0x28)))
+        want=0;
+    }
+    ++i;
+  }
+}
+
+int by_address(const void *a, const void *b)
+{
+  return(*(const uint16_t *)a-*(const uint16_t *)b);
+}
+
+int by_value(const void *a, const void *b)
+{
+  float x=*(const float *)a, y=*(const float *)b;
+
+  return((x > y)-(x < y));
+}
+
+/* Write addresses as a JSON object of counts, sorting them first */
+void json_addresses(FILE *fp, const char *name, uint16_t *addr, uint32_t n)
+{
+  fprintf(fp,",\"%s\":{",name);
+  qsort(addr,n,sizeof(uint16_t),by_address);
+  for (uint32_t i=0,j;i<n;i=j) {
+    for (j=i+1;(j < n)&&(addr[j] == addr[i]);j++);
+    fprintf(fp,"%s\"%u\":%u",(i == 0) ? "" : ",",addr[i],j-i);
+  }
+  fprintf(fp,"}");
+}
+
+/* The feature vector of a program as one line of JSON */
+char *feature_vector(features *fv, char *mzf, uint8_t dialect)
+{
+  char *text=NULL;
+  size_t len=0;
+  FILE *fp=open_memstream(&text,&len);
+  bool any=false;
+
+  fprintf(fp,"{\"file\":");
+  json_string(fp,mzf,strlen(mzf));
+  fprintf(fp,",\"basic\":\"%s\",\"lines\":%u,\"tokens\":{",
+          dialects[dialect].name,fv->lines);
+  for (uint16_t t=0;t<TOKENS;t++)
+    if (fv->tokens[t] != 0) {
+      const char *kw=token_text(dialect,index_token(dialect,t));
+      fprintf(fp,"%s",any ? "," : "");
+      json_string(fp,kw,strlen(kw));
+      fprintf(fp,":%u",fv->tokens[t]);
+      any=true;
+    }
+  fprintf(fp,"}");
+  json_addresses(fp,"poke",fv->poke,fv->npoke);
+  json_addresses(fp,"usr",fv->usr,fv->nusr);
+  if (dialect == MZ700) {
+    fprintf(fp,",\"constants\":{");
+    qsort(fv->consts,fv->nconsts,sizeof(float),by_value);
+    for (uint32_t i=0,j;i<fv->nconsts;i=j) {
+      for (j=i+1;(j < fv->nconsts)&&(fv->consts[j] == fv->consts[i]);j++);
+      fprintf(fp,"%s\"%g\":%u",(i == 0) ? "" : ",",fv->consts[i],j-i);
+    }
+    fprintf(fp,"}");
+  }
+  fprintf(fp,"}\n");
+  fclose(fp);
+
+  return(text);
+}
+
+/* Map stage - takes the next file until none are left and adds its */
+/* features to this worker's histogram                              */
+void *stats_worker(void *arg)
+{
+  histogram *hg=arg;
+  features *fv=malloc(sizeof(features));
+  int n;
+
+  while ((n=atomic_fetch_add(&statnext,1)) < statcount) {
+    uint8_t *body, dialect;
+    uint16_t fs;
+
+    body=read_mzf(statfiles[n],&fs);
+    if (body == NULL)
+      continue;
+    hg->tapes++;
+    dialect=basic_dialect();
+    if (dialects[dialect].print == NULL) {
+      free(body);
+      continue;
+    }
+
+    memset(fv,0,sizeof(features));
+    fv->poke=malloc((fs+1)*sizeof(uint16_t));
+    fv->usr=malloc((fs+1)*sizeof(uint16_t));
+    fv->consts=malloc((fs+1)*sizeof(float));
+    program_features(fv,body,fs,dialect);
+    free(body);
+
+    hg->programs[dialect]++;
+    hg->lines[dialect]+=fv->lines;
+    for (uint16_t t=0;t<TOKENS;t++)
+      if (fv->tokens[t] != 0) {
+        hg->tokens[dialect][t]+=fv->tokens[t];
+        hg->inprograms[dialect][t]++;
+      }
+    for (uint32_t i=0;i<fv->npoke;i++)
+      hg->poke[dialect][fv->poke[i]]++;
+    for (uint32_t i=0;i<fv->nusr;i++)
+      hg->usr[dialect][fv->usr[i]]++;
+    for (uint32_t i=0;i<fv->nconsts;i++) {
+      uint32_t bits;
+      memcpy(&bits,&fv->consts[i],sizeof(bits));
+      count_const(&hg->consts,bits,1);
+    }
+    if (statvectors != NULL)
+      statvectors[n]=feature_vector(fv,statfiles[n],dialect);
+    free(fv->poke);
+    free(fv->usr);
+    free(fv->consts);
+  }
+
+  free(fv);
+  return(NULL);
+}
+
+/* One row of a frequency table */
+typedef struct {
+  uint64_t count;
+  uint32_t key, programs;
+} frequency;
+
+int by_frequency(const void *a, const void *b)
+{
+  const frequency *x=a, *y=b;
+
+  if (x->count != y->count)
+    return((x->count > y->count) ? -1 : 1);
+  return((x->key > y->key)-(x->key < y->key));
+}
+
+/* Print the addresses in counts, most used first */
+void print_addresses(const char *title, uint32_t *counts)
+{
+  frequency *f=malloc(65536*sizeof(frequency));
+  uint32_t n=0;
+
+  for (uint32_t a=0;a<65536;a++)
+    if (counts[a] != 0) {
+      f[n].count=counts[a];
+      f[n++].key=a;
+    }
+  if (n > 0) {
+    print_underline(title);
+    qsort(f,n,sizeof(frequency),by_frequency);
+    fprintf(out,"     Count  Address\n");
+    for (uint32_t i=0;i<n;i++)
+      fprintf(out,"%10" PRIu64 "  0x%04x (%u)\n",f[i].count,f[i].key,
+              f[i].key);
+  }
+  free(f);
+}
+
+/* Count the tokens, POKE and USR addresses and S-BASIC constants of */
+/* every program given, using nthreads workers, and print sorted     */
+/* frequency tables for each BASIC. With vectors, write the features */
+/* of each program there as a line of JSON, in the order given.      */
+int corpus_stats(char **files, int count, int nthreads, char *vectors)
+{
+  histogram **hist=malloc(nthreads*sizeof(histogram *));
+  pthread_t tid[nthreads];
+  histogram *all;
+  uint64_t programs=0;
+  FILE *fp=NULL;
+
+  if ((vectors != NULL) && ((fp=fopen(vectors,"w")) == NULL)) {
+    fprintf(stderr,"Error: unable to write %s\n",vectors);
+    free(hist);
+    return(1);
+  }
+  for (uint8_t d=1;d<DIALECTS;d++)
+    if (dialects[d].print != NULL) {
+      poketok[d]=find_token(d,"POKE");
+      usrtok[d]=find_token(d,"USR");
+    }
+  statfiles=files;
+  statcount=count;
+  statvectors=(fp != NULL) ? calloc(count,sizeof(char *)) : NULL;
+  atomic_store(&statnext,0);
+
+  /* Map */
+  for (int t=0;t<nthreads;t++) {
+    hist[t]=calloc(1,sizeof(histogram));
+    pthread_create(&tid[t],NULL,stats_worker,hist[t]);
+  }
+  for (int t=0;t<nthreads;t++)
+    pthread_join(tid[t],NULL);
+
+  /* Reduce */
+  all=hist[0];
+  for (int t=1;t<nthreads;t++) {
+    histogram *hg=hist[t];
+    all->tapes+=hg->tapes;
+    for (uint8_t d=0;d<DIALECTS;d++) {
+      all->programs[d]+=hg->programs[d];
+      all->lines[d]+=hg->lines[d];
+      for (uint16_t k=0;k<TOKENS;k++) {
+        all->tokens[d][k]+=hg->tokens[d][k];
+        all->inprograms[d][k]+=hg->inprograms[d][k];
+      }
+      for (uint32_t a=0;a<65536;a++) {
+        all->poke[d][a]+=hg->poke[d][a];
+        all->usr[d][a]+=hg->usr[d][a];
+      }
+    }
+    for (uint32_t s=0;s<hg->consts.slots;s++)
+      if (hg->consts.c[s].count != 0)
+        count_const(&all->consts,hg->consts.c[s].bits,hg->consts.c[s].count);
+    free(hg->consts.c);
+    free(hg);
+  }
+
+  for (uint8_t d=1;d<DIALECTS;d++)
+    programs+=all->programs[d];
+  fprintf(out,"%" PRIu64 " tapes, %" PRIu64 " BASIC programs\n",all->tapes,
+          programs);
+
+  for (uint8_t d=1;d<DIALECTS;d++) {
+    frequency f[TOKENS];
+    char title[80];
+    uint32_t n=0;
+
+    if (all->programs[d] == 0)
+      continue;
+    fprintf(out,"\n%s: %" PRIu64 " programs, %" PRIu64 " lines\n",
+            dialects[d].name,all->programs[d],all->lines[d]);
+    snprintf(title,sizeof(title),"%s keywords",dialects[d].name);
+    print_underline(title);
+    for (uint16_t k=0;k<TOKENS;k++)
+      if (all->tokens[d][k] != 0) {
+        f[n].count=all->tokens[d][k];
+        f[n].programs=all->inprograms[d][k];
+        f[n++].key=k;
+      }
+    qsort(f,n,sizeof(frequency),by_frequency);
+    fprintf(out,"     Count  Programs  Keyword\n");
+    for (uint32_t i=0;i<n;i++)
+      fprintf(out,"%10" PRIu64 "  %8u  %s\n",f[i].count,f[i].programs,
+              token_text(d,index_token(d,f[i].key)));
+    snprintf(title,sizeof(title),"%s POKE addresses",dialects[d].name);
+    print_addresses(title,all->poke[d]);
+    snprintf(title,sizeof(title),"%s USR addresses",dialects[d].name);
+    print_addresses(title,all->usr[d]);
+
+    if ((d == MZ700) && (all->consts.used > 0)) {
+      frequency *c=malloc(all->consts.used*sizeof(frequency));
+      n=0;
+      for (uint32_t s=0;s<all->consts.slots;s++)
+        if (all->consts.c[s].count != 0) {
+          c[n].count=all->consts.c[s].count;
+          c[n++].key=all->consts.c[s].bits;
+        }
+      qsort(c,n,sizeof(frequency),by_frequency);
+      snprintf(title,sizeof(title),"%s constants",dialects[d].name);
+      print_underline(title);
+      fprintf(out,"     Count  Value\n");
+      for (uint32_t i=0;i<n;i++) {
+        float value;
+        memcpy(&value,&c[i].key,sizeof(value));
+        fprintf(out,"%10" PRIu64 "  %g\n",c[i].count,value);
+      }
+      free(c);
+    }
+  }
+  free(all->consts.c);
+  free(all);
+  free(hist);
+
+  if (fp != NULL) {
+    for (int n=0;n<count;n++)
+      if (statvectors[n] != NULL) {
+        fputs(statvectors[n],fp);
+        free(statvectors[n]);
+      }
+    free(statvectors);
+    if (fclose(fp) != 0) {
+      fprintf(stderr,"Error: unable to write %s\n",vectors);
+      return(1);
+    }
+  }
+
+  return(0);
+}
+
+/* Manifest driven batch runs, split between workers or machines. Each */
+/* file named in the manifest belongs to the shard that the hash of    */
+/* its name falls in, so workers agree on the split without talking.   */
+/* A shared directory holds each shard's output, shard-k-of-n.out, and */
+/* its index, shard-k-of-n.idx, which gets a line "file offset length" */
+/* appended after each file and "end" when the shard is finished. An   */
+/* interrupted shard carries on after the last file in its index. The  */
+/* worker holds a lock on the index, so with "any" each worker takes   */
+/* whichever shards are left, and a merge puts the output of all the   */
+/* shards back into manifest order.                                    */
+typedef struct {
+  char *text;
+  char **files;
+  int count;
+} manifest;
+
+bool read_manifest(char *path, manifest *mf)
+{
+  FILE *fp=fopen(path,"r");
+  size_t len=0, max=0;
+  char *line;
+
+  if (fp == NULL) {
+    fprintf(stderr,"Error: %s not found\n",path);
+    return(false);
+  }
+  mf->text=NULL;
+  mf->files=NULL;
+  mf->count=0;
+  if (getdelim(&mf->text,&len,'\0',fp) < 0) {
+    fclose(fp);
+    return(true);
+  }
+  fclose(fp);
+
+  for (line=strtok(mf->text,"\r\n");line!=NULL;line=strtok(NULL,"\r\n")) {
+    if ((size_t)mf->count == max)
+      mf->files=realloc(mf->files,(max=max*2+1024)*sizeof(char *));
+    mf->files[mf->count++]=line;
+  }
+
+  return(true);
+}
+
+/* Which of n shards a file belongs to, from the range its hash is in */
+uint32_t shard_of(char *file, uint32_t n)
+{
+  uint64_t h=body_hash((uint8_t *)file,strlen(file));
+  return((uint32_t)(((unsigned __int128)h*n)>>64));
+}
+
+void shard_file(char *name, size_t len, char *dir, uint32_t k, uint32_t n,
+                const char *ext)
+{
+  snprintf(name,len,"%s/shard-%u-of-%u.%s",dir,k,n,ext);
+}
+
+/* Output for one file of a manifest, as the batch modes give it */
+char *render_entry(char *file, uint8_t *tape, size_t size, off_t filesize,
+                   uint8_t mode, char *banner, size_t *len)
+{
+  char *text=NULL, *part;
+  size_t partlen;
+  FILE *fp;
+
+  if ((mode == RENDER_TEXT) &&
+      (archive_kind_of(tape,size,file,filesize) == ARCH_NONE)) {
+    fp=open_memstream(&text,len);
+    fprintf(fp,"%s %s\n",banner,file);
+    part=render_mzf(tape,size,file,mode,&partlen);
+    fwrite(part,1,partlen,fp);
+    free(part);
+    fclose(fp);
+  }
+  else if (archive_kind_of(tape,size,file,filesize) != ARCH_NONE) {
+    fp=open_memstream(&text,len);
+    process_archive(file,mode,fp,(mode == RENDER_TEXT) ? banner : NULL,1);
+    fclose(fp);
+  }
+  else
+    text=render_mzf(tape,size,file,mode,len);
+
+  return(text);
+}
+
+/* Run shard k of n. Returns 0 once it is finished, 1 if it fails and 2 */
+/* if another worker has it.                                           */
+int run_shard(manifest *mf, char *dir, uint32_t k, uint32_t n, uint8_t mode,
+              char *banner)
+{
+  char name[PATH_MAX], *idx=NULL, **files;
+  int *which, count=0, last=-1, idxfd, outfd;
+  off_t outend=0, idxend=0;
+  size_t idxlen=0;
+  struct stat st;
+  prefetch *pf;
+  FILE *fp;
+
+  shard_file(name,sizeof(name),dir,k,n,"idx");
+  idxfd=open(name,O_RDWR|O_CREAT,0666);
+  if (idxfd < 0) {
+    fprintf(stderr,"Error: unable to open %s\n",name);
+    return(1);
+  }
+  if (flock(idxfd,LOCK_EX|LOCK_NB) < 0) {
+    close(idxfd);
+    return(2);
+  }
+  shard_file(name,sizeof(name),dir,k,n,"out");
+  outfd=open(name,O_RDWR|O_CREAT,0666);
+  if ((outfd < 0) || (fstat(outfd,&st) < 0)) {
+    fprintf(stderr,"Error: unable to open %s\n",name);
+    close(idxfd);
+    return(1);
+  }
+
+  /* Pick up where the index says it stopped, trusting only complete  */
+  /* lines for output that made it to the file                        */
+  fp=fdopen(dup(idxfd),"r");
+  if (getdelim(&idx,&idxlen,'\0',fp) < 0)
+    idxlen=0;
+  else
+    idxlen=strlen(idx);
+  fclose(fp);
+  for (char *l=idx,*e;(l!=NULL)&&(l<idx+idxlen);l=e+1) {
+    long long off;
+    size_t len;
+    int file, used;
+    e=memchr(l,'\n',idx+idxlen-l);
+    if (e == NULL)
+      break;
+    if (strncmp(l,"end\n",4) == 0) {
+      free(idx);
+      close(idxfd);
+      close(outfd);
+      return(0);
+    }
+    if ((sscanf(l,"%d %lld %zu%n",&file,&off,&len,&used) != 3) ||
+        (l+used != e) || (off+len > (size_t)st.st_size))
+      break;
+    last=file;
+    outend=off+len;
+    idxend=e+1-idx;
+  }
+  free(idx);
+  if ((ftruncate(idxfd,idxend) < 0) || (ftruncate(outfd,outend) < 0)) {
+    fprintf(stderr,"Error: unable to resume shard %u of %u\n",k,n);
+    close(idxfd);
+    close(outfd);
+    return(1);
+  }
+  lseek(idxfd,idxend,SEEK_SET);
+
+  /* The files left to do */
+  files=malloc((mf->count+1)*sizeof(char *));
+  which=malloc((mf->count+1)*sizeof(int));
+  for (int i=last+1;i<mf->count;i++)
+    if (shard_of(mf->files[i],n) == k) {
+      files[count]=mf->files[i];
+      which[count++]=i;
+    }
+
+  fp=fdopen(idxfd,"w");
+  pf=start_prefetch(files,count);
+  for (int i=0;i<count;i++) {
+    size_t size, len=0;
+    off_t filesize;
+    uint8_t *tape=next_prefetched(pf,&size,&filesize);
+    char *text=NULL;
+    if (tape == NULL)
+      fprintf(stderr,"Error: %s not found\n",files[i]);
+    else
+      text=render_entry(files[i],tape,size,filesize,mode,banner,&len);
+    if ((len > 0) && (pwrite(outfd,text,len,outend) != (ssize_t)len)) {
+      fprintf(stderr,"Error: unable to write shard %u of %u\n",k,n);
+      exit(1);
+    }
+    fprintf(fp,"%d %lld %zu\n",which[i],(long long)outend,len);
+    fflush(fp);
+    outend+=len;
+    free(text);
+    free(tape);
+  }
+  end_prefetch(pf);
+
+  fsync(outfd);
+  fprintf(fp,"end\n");
+  fflush(fp);
+  fsync(idxfd);
+  fclose(fp);
+  close(outfd);
+  free(files);
+  free(which);
+
+  return(0);
+}
+
+/* Put the output of all n shards together in manifest order */
+int merge_shards(manifest *mf, char *dir, uint32_t n, uint8_t mode)
+{
+  long long *off=calloc(mf->count+1,sizeof(long long));
+  size_t *len=calloc(mf->count+1,sizeof(size_t));
+  uint32_t *shard=calloc(mf->count+1,sizeof(uint32_t));
+  int *outfd=calloc(n,sizeof(int));
+  char name[PATH_MAX], line[64], buf[65536];
+  int status=0;
+
+  for (uint32_t k=0;k<n;k++) {
+    bool done=false;
+    FILE *fp;
+    shard_file(name,sizeof(name),dir,k,n,"idx");
+    fp=fopen(name,"r");
+    while ((fp != NULL) && (fgets(line,sizeof(line),fp) != NULL)) {
+      long long o;
+      size_t l;
+      int file;
+      if (strcmp(line,"end\n") == 0)
+        done=true;
+      else if ((sscanf(line,"%d %lld %zu",&file,&o,&l) == 3) &&
+               (file >= 0) && (file < mf->count)) {
+        off[file]=o;
+        len[file]=l;
+        shard[file]=k;
+      }
+    }
+    if (fp != NULL)
+      fclose(fp);
+    shard_file(name,sizeof(name),dir,k,n,"out");
+    outfd[k]=open(name,O_RDONLY);
+    if (!done || (outfd[k] < 0)) {
+      fprintf(stderr,"Error: shard %u of %u is not finished\n",k,n);
+      status=1;
+    }
+  }
+
+  if (status == 0) {
+    csv_heading(stdout,mode);
+    fflush(stdout);
+    for (int i=0;i<mf->count;i++)
+      for (size_t done=0,got;done<len[i];done+=got) {
+        got=(len[i]-done < sizeof(buf)) ? len[i]-done : sizeof(buf);
+        got=pread(outfd[shard[i]],buf,got,off[i]+done);
+        if ((got == 0) || (got == (size_t)-1) ||
+            (fwrite(buf,1,got,stdout) != got)) {
+          fprintf(stderr,"Error: shard %u of %u is short\n",shard[i],n);
+          status=1;
+          break;
+        }
+      }
+  }
+
+  for (uint32_t k=0;k<n;k++)
+    if (outfd[k] >= 0)
+      close(outfd[k]);
+  free(outfd);
+  free(off);
+  free(len);
+  free(shard);
+
+  return(status);
+}
+
+/* Run a shard given as k/n, any/n or merge/n */
+int run_manifest(char *path, char *spec, char *dir, uint8_t mode,
+                 char *banner)
+{
+  manifest mf;
+  uint32_t k, n;
+  char which[8];
+  int status=0, r;
+
+  if ((sscanf(spec,"%7[^/]/%u",which,&n) != 2) || (n == 0)) {
+    fprintf(stderr,"Error: shard %s should be k/n, any/n or merge/n\n",spec);
+    return(1);
+  }
+  if (!read_manifest(path,&mf))
+    return(1);
+  mkdir(dir,0777);
+
+  if (strcmp(which,"merge") == 0)
+    status=merge_shards(&mf,dir,n,mode);
+  else if (strcmp(which,"any") == 0) {
+    /* Every shard that no other worker has */
+    for (k=0;k<n;k++)
+      if ((r=run_shard(&mf,dir,k,n,mode,banner)) == 1)
+        status=1;
+  }
+  else if ((sscanf(which,"%u",&k) == 1) && (k < n)) {
+    r=run_shard(&mf,dir,k,n,mode,banner);
+    if (r == 2)
+      fprintf(stderr,"Error: shard %u of %u is being run elsewhere\n",k,n);
+    status=(r != 0);
+  }
+  else {
+    fprintf(stderr,"Error: no shard %s\n",spec);
+    status=1;
+  }
+
+  free(mf.files);
+  free(mf.text);
+
+  return(status);
+}
+
+int main(int argc, char **argv)
+{
+
+  prefetch *pf=NULL;
+  char *cgromfile=NULL;
+  char *pngdir=NULL;
+  bool analyse=false;
+  char *newmzf=NULL;
+  uint8_t to=0, format=0;
+  char *sockpath=NULL;
+  char *diskcache=NULL;
+  char *watchdir=NULL, *watchout=NULL;
+  bool diff=false, checksums=false, near=false, stats=false;
+  char *sumsfile=NULL;
+  char *manifestfile=NULL, *shardspec=NULL;
+  int status=0;
+  uint16_t first=0, step=0;
+  int nthreads=sysconf(_SC_NPROCESSORS_ONLN);
+  char *glyphtext=NULL;
+  size_t glyphlen=0;
+  int opt;
+
+  /* Set locale */
+  setlocale(LC_CTYPE, "");
+
+  /* Check options, then that we have one and only one file argument */
+  while ((opt = getopt(argc, argv, "ag:sp:j:t:r:o:f:d:m:C:w:O:ukK:M:S:nT")) != -1) {
+    switch (opt) {
+      case 'n': near=true;
+                break;
+      case 'T': stats=true;
+                break;
+      case 'M': manifestfile=optarg;
+                break;
+      case 'S': shardspec=optarg;
+                break;
+      case 'k': checksums=true;
+                break;
+      case 'K': sumsfile=optarg;
+                break;
+      case 'u': diff=true;
+                break;
+      case 'w': watchdir=optarg;
+                break;
+      case 'O': watchout=optarg;
+                break;
+      case 'C': diskcache=optarg;
+                break;
+      case 'd': sockpath=optarg;
+                break;
+      case 'm': cachemax=strtoul(optarg,NULL,10)*1024*1024;
+                break;
+      case 'f': format=(strcmp(optarg,"ndjson") == 0) ? EXPORT_NDJSON :
+                       (strcmp(optarg,"csv") == 0) ? EXPORT_CSV :
+                       (strcmp(optarg,"records") == 0) ? EXPORT_RECORDS : 0;
+                if (format == 0)
+                  argc=0;
+                break;
+      case 't': to=(strcmp(optarg,"5025") == 0) ? MZ80K :
+                   (strcmp(optarg,"5510") == 0) ? MZ80A :
+                   (strcmp(optarg,"sbasic") == 0) ? MZ700 : 0;
+                if (to == 0)
+                  argc=0;
+                break;
+      case 'r': if (sscanf(optarg,"%hu,%hu",&first,&step) < 1)
+                  argc=0;
+                break;
+      case 'o': newmzf=optarg;
+                break;
+      case 'a': analyse=true;
+                break;
+      case 'g': cgromfile=optarg;
+                break;
+      case 'p': pngdir=optarg;
+                break;
+      case 'j': nthreads=atoi(optarg);
+                break;
+      case 's': usesixel=true;
+                break;
+      default:  argc=0;
+                break;
+    }
+  }
+  if ((pngdir != NULL) && (cgromfile != NULL) && (argc-optind >= 1)) {
+    /* Screen images for a batch of files */
+    if (!load_glyph_cache(cgromfile))
+      exit(1);
+    setlocale(LC_CTYPE, "C.UTF-8");
+    make_thumbnails(&argv[optind],argc-optind,pngdir,(nthreads>0)?nthreads:1);
+    return(0);
+  }
+  if (analyse && (argc-optind >= 1)) {
+    /* Line number analysis of each file in turn */
+    out=stdout;
+    for (int n=optind;n<argc;n++) {
+      uint8_t *body;
+      uint16_t fs;
+      body=read_mzf(argv[n],&fs);
+      if (body == NULL)
+        continue;
+      analyse_listing(body,fs,argv[n]);
+      free(body);
+    }
+    return(0);
+  }
+  if (near && (argc-optind >= 1)) {
+    /* Group tapes that are nearly the same */
+    out=stdout;
+    return(cluster_tapes(&argv[optind],argc-optind));
+  }
+  if (stats && (argc-optind >= 1)) {
+    /* Token statistics across every file */
+    out=stdout;
+    return(corpus_stats(&argv[optind],argc-optind,(nthreads>0)?nthreads:1,
+                        watchout));
+  }
+  if (checksums && (argc-optind >= 1))
+    return(print_checksums(&argv[optind],argc-optind));
+  if ((sumsfile != NULL) && (argc == optind))
+    return(check_checksums(sumsfile));
+  if (diff && (argc-optind >= 2) && ((argc-optind)%2 == 0)) {
+    /* Compare each pair of files */
+    int s;
+    out=stdout;
+    for (int n=optind;n<argc;n+=2)
+      if ((s=diff_mzf(argv[n],argv[n+1])) > status)
+        status=s;
+    return(status);
+  }
+  if ((sockpath != NULL) && (argc == optind)) {
+    /* Serve rendered tapes until killed. The locale is the process's, */
+    /* so it is set before any worker starts.                          */
+    setlocale(LC_CTYPE, "C.UTF-8");
+    return(run_server(sockpath,(nthreads>0)?nthreads:1) ? 0 : 1);
+  }
+  if ((manifestfile != NULL) && (shardspec != NULL) && (watchout != NULL) &&
+      (argc == optind)) {
+    /* One shard of a manifest, or all of them merged */
+    if (format != 0)
+      setlocale(LC_CTYPE, "C.UTF-8");
+    return(run_manifest(manifestfile,shardspec,watchout,formatmodes[format],
+                        argv[0]));
+  }
+  if ((watchdir != NULL) && (watchout != NULL) && (argc == optind)) {
+    /* Render tapes as they arrive until killed */
+    setlocale(LC_CTYPE, "C.UTF-8");
+    return(watch_directory(watchdir,watchout,
+                           (format == EXPORT_NDJSON) ? RENDER_JSON :
+                           RENDER_TEXT) ? 0 : 1);
+  }
+  if ((diskcache != NULL) && !open_disk_cache(diskcache))
+    exit(1);
+  if ((format != 0) && (argc-optind >= 1)) {
+    /* Machine readable export of each file in turn */
+    setlocale(LC_CTYPE, "C.UTF-8");
+    out=stdout;
+    if ((format == EXPORT_NDJSON) && (diskcache != NULL)) {
+      for (int n=optind;n<argc;n++) {
+        size_t len;
+        char *text;
+        if (is_archive(argv[n])) {
+          process_archive(argv[n],RENDER_JSON,stdout,NULL,
+                          (nthreads>0)?nthreads:1);
+          continue;
+        }
+        text=cached_render(argv[n],RENDER_JSON,&len);
+        if (text != NULL)
+          fwrite(text,1,len,stdout);
+        free(text);
+      }
+      trim_disk_cache();
+      return(0);
+    }
+    csv_heading(stdout,formatmodes[format]);
+    pf=start_prefetch(&argv[optind],argc-optind);
+    for (int n=optind;n<argc;n++) {
+      size_t size, len;
+      off_t filesize;
+      uint8_t *tape=next_prefetched(pf,&size,&filesize);
+      char *text;
+      if (tape == NULL) {
+        fprintf(stderr,"Error: %s not found\n",argv[n]);
+        continue;
+      }
+      if (archive_kind_of(tape,size,argv[n],filesize) != ARCH_NONE) {
+        free(tape);
+        process_archive(argv[n],formatmodes[format],stdout,NULL,
+                        (nthreads>0)?nthreads:1);
+        continue;
+      }
+      if (size < MZFHEADERSIZE)
+        fprintf(stderr,"Error: %s has no tape header\n",argv[n]);
+      else {
+        if (size < (size_t)MZFHEADERSIZE+((tape[19]<<8)|tape[18]))
+          fprintf(stderr,"Warning: %s is shorter than its header says\n",
+                  argv[n]);
+        text=render_mzf(tape,size,argv[n],formatmodes[format],&len);
+        fwrite(text,1,len,stdout);
+        free(text);
+      }
+      free(tape);
+    }
+    end_prefetch(pf);
+    return(0);
+  }
+  if ((newmzf != NULL) && (argc-optind == 1)) {
+    /* Convert to another BASIC and/or renumber */
+    out=stdout;
+    return(convert_mzf(argv[optind],newmzf,to,first,step) ? 0 : 1);
+  }
+  if ((argc-optind < 1) || (pngdir != NULL)) {
+    fprintf(stderr,"Usage: %s [-g <CGROM file> [-s]] [-C <cache directory>]"
+                   " <mzf file> ...\n",argv[0]);
+    fprintf(stderr,"       %s -g <CGROM file> -p <PNG directory> [-j <threads>]"
+                   " <mzf file> ...\n",argv[0]);
+    fprintf(stderr,"       %s -a <mzf file> ...\n",argv[0]);
+    fprintf(stderr,"       %s -n <mzf file> ...\n",argv[0]);
+    fprintf(stderr,"       %s -T [-j <threads>] [-O <feature file>]"
+                   " <mzf file> ...\n",argv[0]);
+    fprintf(stderr,"       %s -k <mzf file> ... | -K <checksum file>\n",argv[0]);
+    fprintf(stderr,"       %s -u <old mzf file> <new mzf file> ...\n",argv[0]);
+    fprintf(stderr,"       %s -w <directory> -O <output directory or socket>"
+                   " [-f ndjson]\n",argv[0]);
+    fprintf(stderr,"       %s -f ndjson|csv|records [-C <cache directory>]"
+                   " <mzf file> ...\n",argv[0]);
+    fprintf(stderr,"       %s -M <manifest> -S <k>|any|merge/<n> -O <directory>"
+                   " [-f ndjson|csv|records]\n",argv[0]);
+    fprintf(stderr,"       %s -d <socket> [-j <threads>] [-m <cache MB>]\n",
+            argv[0]);
+    fprintf(stderr,"       %s [-t 5025|5510|sbasic] [-r <first>[,<step>]]"
+                   " -o <new mzf file> <mzf file>\n",argv[0]);
+    exit(1);
+  }
+
+  out=stdout;
+
+  /* With a CGROM, collect the output then draw it with the CGROM glyphs. */
+  /* A UTF-8 locale is needed for the text in between, font or no font.   */
+  if (cgromfile != NULL) {
+    if (!load_glyph_cache(cgromfile))
+      exit(1);
+    setlocale(LC_CTYPE, "C.UTF-8");
+    out=open_memstream(&glyphtext,&glyphlen);
+  }
+
+  /* Read files ahead unless the render cache makes that unnecessary */
+  if (diskcache == NULL)
+    pf=start_prefetch(&argv[optind],argc-optind);
+
+  for (int n=optind;n<argc;n++) {
+    size_t size=0, len;
+    off_t filesize=0;
+    uint8_t *tape=NULL;
+    char *text;
+
+    if (pf != NULL)
+      tape=next_prefetched(pf,&size,&filesize);
+
+    /* Every tape in an archive, each with its own banner */
+    if ((pf != NULL) ?
+        ((tape != NULL) &&
+         (archive_kind_of(tape,size,argv[n],filesize) != ARCH_NONE)) :
+        is_archive(argv[n])) {
+      free(tape);
+      if (!process_archive(argv[n],RENDER_TEXT,out,argv[0],
+                           (nthreads>0)?nthreads:1))
+        status=1;
+      continue;
+    }
+
+    fprintf(out,"%s %s\n",argv[0],argv[n]);
+
+    /* From the render cache if there is one, or the file read ahead */
+    if (pf != NULL)
+      text=(tape != NULL) ? render_mzf(tape,size,argv[n],RENDER_TEXT,&len) :
+                            NULL;
+    else
+      text=cached_render(argv[n],RENDER_TEXT,&len);
+    if (text == NULL) {
+      if (pf != NULL)
+        fprintf(stderr,"Error: %s not found\n",argv[n]);
+      status=1;
+    }
+    else
+      fwrite(text,1,len,out);
+    free(text);
+    free(tape);
+  }
+
+  if (pf != NULL)
+    end_prefetch(pf);
+  if (diskcache != NULL)
+    trim_disk_cache();
+
+  if (cgromfile != NULL) {
+    fclose(out);
+    print_glyphs(glyphtext,glyphlen);
+    free(glyphtext);
+  }
 
-  return (0);
+  return (status);
 }
 
 //MIT License
@@ -0,0 +1,1114 @@
+/**************************************************/
+/* mzgrep.c                                       */
+/*                                                */
+/* Utility to search Sharp MZ series tapes and    */
+/* ROM images for text. Each query is translated  */
+/* into the bytes the Sharp machines store it as: */
+/* Sharp 'ASCII', screen display codes and the    */
+/* keyword tokens of each BASIC, and all of them  */
+/* are looked for in one pass over each file.     */
+/*                                                */
+/* Tim Holyoake, 18th October 2026.               */
+/* MIT licence - see end of file for details.     */
+/**************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define MZFHEADERSIZE 128      // Size of a .mzf file header in bytes
+#define MZ80K 1                // Code numbers used for different MZ
+#define MZ80A 2                // series machine types and their BASICs
+#define MZ700 3
+#define DIALECTS  4
+
+#define MAXPATTERN  255        // Longest query, in Sharp bytes
+#define MAXPATTERNS  64        // Byte patterns, from all the queries
+#define ANCHORVALS    2        // Most byte values an anchor may match
+#define CONTEXT      16        // Default bytes shown either side
+
+/* What a pattern is written in */
+#define ENC_ASCII     0        // Sharp 'ASCII'
+#define ENC_DISPLAY   1        // Display codes, as held in VRAM
+#define ENC_BASIC     2        // Tokens of a BASIC, see dialect
+
+/* SP-5025 BASIC tokens */
+const char *tokens5025[256] = {
+  [0x80]="REM",     [0x81]="DATA",    [0x82]="LIST",    [0x83]="RUN",
+  [0x84]="NEW",     [0x85]="PRINT",   [0x86]="LET",     [0x87]="FOR",
+  [0x88]="IF",      [0x89]="GOTO",    [0x8a]="READ",    [0x8b]="GOSUB",
+  [0x8c]="RETURN",  [0x8d]="NEXT",    [0x8e]="STOP",    [0x8f]="END",
+  [0x90]="ON",      [0x91]="LOAD",    [0x92]="SAVE",    [0x93]="VERIFY",
+  [0x94]="POKE",    [0x95]="DIM",     [0x96]="DEF FN",  [0x97]="INPUT",
+  [0x98]="RESTORE", [0x99]="CLR",     [0x9a]="MUSIC",   [0x9b]="TEMPO",
+  [0x9c]="USR(",    [0x9d]="WOPEN",   [0x9e]="ROPEN",   [0x9f]="CLOSE",
+  [0xa0]="BYE",     [0xa1]="LIMIT",   [0xa2]="CONT",    [0xa3]="SET",
+  [0xa4]="RESET",   [0xa5]="GET",     [0xa6]="INP#",    [0xa7]="OUT#",
+  [0xad]="THEN",    [0xae]="TO",      [0xaf]="STEP",    [0xb0]="><",
+  [0xb1]="<>",      [0xb2]="=<",      [0xb3]="<=",      [0xb4]="=>",
+  [0xb5]=">=",      [0xb6]="=",       [0xb7]=">",       [0xb8]="<",
+  [0xb9]="AND",     [0xba]="OR",      [0xbb]="NOT",     [0xbc]="+",
+  [0xbd]="-",       [0xbe]="*",       [0xbf]="/",       [0xc0]="LEFT$(",
+  [0xc1]="RIGHT$(", [0xc2]="MID$(",   [0xc3]="LEN(",    [0xc4]="CHR$(",
+  [0xc5]="STR$(",   [0xc6]="ASC(",    [0xc7]="VAL(",    [0xc8]="PEEK(",
+  [0xc9]="TAB(",    [0xca]="SPC(",    [0xcb]="SIZE",    [0xcf]="\ue05e",
+  [0xd0]="RND(",    [0xd1]="SIN(",    [0xd2]="COS(",    [0xd3]="TAN(",
+  [0xd4]="ATN(",    [0xd5]="EXP(",    [0xd6]="INT(",    [0xd7]="LOG(",
+  [0xd8]="LN(",     [0xd9]="ABS(",    [0xda]="SGN(",    [0xdb]="SQR("
+};
+
+/* SA-5510 BASIC single byte tokens */
+const char *tokens5510[256] = {
+  [0x2a]="*",           [0x2b]="+",           [0x2d]="-",           [0x2f]="/",
+  [0x5e]="\ue05e",      [0x83]="><",          [0x84]="<>",          [0x85]="=<",
+  [0x86]="<=",          [0x87]="=>",          [0x88]=">=",          [0x89]="=",
+  [0x8a]=">",           [0x8b]="<",           [0x9e]="TO",          [0x9f]="STEP",
+  [0xa0]="LEFT$(",      [0xa1]="RIGHT$(",     [0xa2]="MID$(",       [0xa3]="LEN(",
+  [0xa4]="CHR$",        [0xa5]="STR$(",       [0xa6]="ASC(",        [0xa7]="VAL(",
+  [0xa8]="PEEK(",       [0xa9]="TAB(",        [0xaa]="SPACE$(",     [0xab]="SIZE",
+  [0xaf]="STRING$(",    [0xb1]="CHARACTER$(", [0xb2]="CSR",         [0xc0]="RND(",
+  [0xc1]="SIN(",        [0xc2]="COS(",        [0xc3]="TAN(",        [0xc4]="ATN(",
+  [0xc5]="EXP(",        [0xc6]="INT(",        [0xc7]="LOG(",        [0xc8]="LN(",
+  [0xc9]="ABS(",        [0xca]="SGN(",        [0xcb]="SQR("
+};
+
+/* SA-5510 BASIC two byte tokens, 0x80 then the byte below */
+const char *tokens5510x[256] = {
+  [0x80]="REM",     [0x81]="DATA",    [0x84]="READ",    [0x85]="LIST",
+  [0x86]="RUN",     [0x87]="NEW",     [0x88]="PRINT",   [0x89]="LET",
+  [0x8a]="FOR",     [0x8b]="IF",      [0x8c]="THEN",    [0x8d]="GOTO",
+  [0x8e]="GOSUB",   [0x8f]="RETURN",  [0x90]="NEXT",    [0x91]="STOP",
+  [0x92]="END",     [0x94]="ON",      [0x95]="LOAD",    [0x96]="SAVE",
+  [0x97]="VERIFY",  [0x98]="POKE",    [0x99]="DIM",     [0x9a]="DEF FN",
+  [0x9b]="INPUT",   [0x9c]="RESTORE", [0x9d]="CLR",     [0x9e]="MUSIC",
+  [0x9f]="TEMPO",   [0xa0]="USR(",    [0xa1]="WOPEN",   [0xa2]="ROPEN",
+  [0xa3]="CLOSE",   [0xa4]="MON",     [0xa5]="LIMIT",   [0xa6]="CONT",
+  [0xa7]="GET",     [0xa8]="INP@",    [0xa9]="OUT@",    [0xaa]="CURSOR",
+  [0xab]="SET",     [0xac]="RESET",   [0xb3]="AUTO",    [0xb6]="COPY/P",
+  [0xb7]="PAGE/P"
+};
+
+/* S-BASIC single byte tokens */
+const char *tokenssbasic[256] = {
+  [0x80]="GOTO",    [0x81]="GOSUB",   [0x83]="RUN",     [0x84]="RETURN",
+  [0x85]="RESTORE", [0x86]="RESUME",  [0x87]="LIST",    [0x89]="DELETE",
+  [0x8a]="RENUM",   [0x8b]="AUTO",    [0x8d]="FOR",     [0x8e]="NEXT",
+  [0x8f]="PRINT",   [0x91]="INPUT",   [0x93]="IF",      [0x94]="DATA",
+  [0x95]="READ",    [0x96]="DIM",     [0x97]="REM",     [0x98]="END",
+  [0x99]="STOP",    [0x9a]="CONT",    [0x9b]="CLS",     [0x9d]="ON",
+  [0x9e]="LET",     [0x9f]="NEW",     [0xa0]="POKE",    [0xa1]="OFF",
+  [0xa2]="MODE",    [0xa3]="SKIP",    [0xa4]="PLOT",    [0xa5]="LINE",
+  [0xa6]="RLINE",   [0xa7]="MOVE",    [0xa8]="RMOVE",   [0xa9]="TRON",
+  [0xaa]="TROFF",   [0xab]="INP#",    [0xad]="GET",     [0xae]="PCOLOR",
+  [0xaf]="PHOME",   [0xb0]="HSET",    [0xb1]="GPRINT",  [0xb2]="KEY",
+  [0xb3]="AXIS",    [0xb4]="LOAD",    [0xb5]="SAVE",    [0xb6]="MERGE",
+  [0xb8]="CONSOLE", [0xba]="OUT#",    [0xbb]="CIRCLE",  [0xbc]="TEST",
+  [0xbd]="PAGE",    [0xc0]="ERASE",   [0xc1]="ERROR",   [0xc3]="USR",
+  [0xc4]="BYE",     [0xc7]="DEF",     [0xce]="WOPEN",   [0xcf]="CLOSE",
+  [0xd0]="ROPEN",   [0xd2]="\ue0ff",  [0xd9]="KILL",    [0xe0]="TO",
+  [0xe1]="STEP",    [0xe2]="THEN",    [0xe3]="USING",   [0xe6]="TAB",
+  [0xe7]="SPC",     [0xeb]="OR",      [0xec]="AND",     [0xee]="><",
+  [0xef]="<>",      [0xf0]="=<",      [0xf1]="<=",      [0xf2]="=>",
+  [0xf3]=">=",      [0xf4]="=",       [0xf5]=">",       [0xf6]="<",
+  [0xf7]="+",       [0xf8]="-",       [0xfb]="/",       [0xfc]="*",
+  [0xfd]="\ue05e"
+};
+
+/* S-BASIC two byte tokens, 0xfe then the byte below */
+const char *tokenssbasicfe[256] = {
+  [0x81]="SET",    [0x82]="RESET",  [0x83]="COLOR",  [0xa2]="MUSIC",
+  [0xa3]="TEMPO",  [0xa4]="CURSOR", [0xa5]="VERIFY", [0xa6]="CLR",
+  [0xa7]="LIMIT",  [0xae]="BOOT"
+};
+
+/* S-BASIC two byte tokens, 0xff then the byte below */
+const char *tokenssbasicff[256] = {
+  [0x80]="INT",     [0x81]="ABS",     [0x82]="SIN",     [0x83]="COS",
+  [0x84]="TAN",     [0x85]="LN",      [0x86]="EXP",     [0x87]="SQR",
+  [0x88]="RND",     [0x89]="PEEK",    [0x8a]="ATN",     [0x8b]="SGN",
+  [0x8c]="LOG",     [0x8e]="PAI",     [0x8f]="RAD",     [0x95]="EOF",
+  [0x9e]="JOY",     [0xa0]="CHR$",    [0xa2]="HEX$",    [0xab]="ASC",
+  [0xac]="LEN",     [0xad]="VAL",     [0xb3]="ERN",     [0xb4]="ERL",
+  [0xb5]="SIZE",    [0xba]="LEFT$",   [0xbb]="RIGHT$",  [0xbc]="MID$",
+  [0xc3]="STRING$", [0xc4]="TI$",     [0xc7]="FN"
+};
+
+/* The BASICs, recognised from the tape header as mzfview does */
+typedef struct {
+  const char *name;
+  uint8_t type;                // Tape file type
+  uint16_t load;               // Load address, 0 for any
+  uint8_t charset;             // Machine whose character set it uses
+  uint16_t planes[3];          // First bytes of two byte tokens, 0 if none
+  const char **tables[3];      // Text of the tokens in each plane
+} basicdef;
+
+const basicdef dialects[DIALECTS] = {
+  [0]     = {"unknown BASIC",0,0,MZ80K,{0},{NULL}},
+  [MZ80K] = {"SP-5025",0x02,0x4806,MZ80K,{0},{tokens5025}},
+  [MZ80A] = {"SA-5510",0x02,0x505c,MZ80A,{0,0x8000},
+             {tokens5510,tokens5510x}},
+  [MZ700] = {"S-BASIC",0x05,0,MZ700,{0,0xfe00,0xff00},
+             {tokenssbasic,tokenssbasicfe,tokenssbasicff}}
+};
+
+/* Sharp lower case a to z */
+const uint8_t lower[26] = {
+  0xa1,0x9a,0x9f,0x9c,0x92,0xaa,0x97,0x98,0xa6,0xaf,0xa9,0xb8,0xb3,
+  0xb0,0xb7,0x9e,0xa0,0x9d,0xa4,0x96,0xa5,0xab,0xa3,0x9b,0xbd,0xa2
+};
+
+/* Display codes for Sharp 'ASCII' 0x20 to 0x5f, and back again */
+const uint8_t printable[64] = {
+  0x00,0x61,0x62,0x63,0x64,0x65,0x66,0x67,  //   ! " # $ % & '
+  0x68,0x69,0x6b,0x6a,0x2f,0x2a,0x2e,0x2d,  // ( ) * + , - . /
+  0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,  // 0 - 7
+  0x28,0x29,0x4f,0x2c,0x51,0x2b,0x57,0x49,  // 8 9 : ; < = > ?
+  0x55,0x01,0x02,0x03,0x04,0x05,0x06,0x07,  // @ A - G
+  0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f,  // H - O
+  0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,  // P - W
+  0x18,0x19,0x1a,0x52,0x59,0x54,0x50,0x45   // X Y Z [ \ ] up left
+};
+uint8_t display2sharp[256];
+
+/* Display code of a Sharp 'ASCII' byte, unchanged if it has none */
+uint8_t display_code(uint8_t sharpchar)
+{
+  if ((sharpchar >= 0x20) && (sharpchar <= 0x5f))
+    return(printable[sharpchar-0x20]);
+  for (uint8_t i=0;i<26;i++)
+    if (lower[i] == sharpchar)
+      return(0x81+i);
+
+  return(sharpchar);
+}
+
+/* A pattern is a byte set for each position, searched for by first  */
+/* looking for two anchor positions a block of bytes at a time.      */
+typedef struct {
+  uint8_t bits[32];
+} byteset;
+
+typedef struct {
+  byteset at[MAXPATTERN];
+  uint16_t len;
+  uint8_t enc, dialect;
+  int query;
+  uint16_t anchor[2];          // Positions checked a block at a time
+  uint8_t vals[2][ANCHORVALS]; // Values at the anchors, repeated to fill
+} pattern;
+
+pattern patterns[MAXPATTERNS];
+int npatterns=0;
+int context=CONTEXT;
+bool colour=false;
+
+void add_byte(byteset *s, uint8_t b)
+{
+  s->bits[b>>3]|=1<<(b&7);
+}
+
+bool has_byte(const byteset *s, uint8_t b)
+{
+  return((s->bits[b>>3]>>(b&7))&1);
+}
+
+int set_size(const byteset *s)
+{
+  int n=0;
+
+  for (int i=0;i<32;i++)
+    n+=__builtin_popcount(s->bits[i]);
+
+  return(n);
+}
+
+/* Next code point of a UTF-8 query */
+uint32_t next_codepoint(const char *q, size_t *i)
+{
+  const uint8_t *s=(const uint8_t *)q;
+  uint32_t cp=s[*i];
+  int more=0;
+
+  if (cp >= 0xf0) {
+    cp&=0x07;
+    more=3;
+  }
+  else if (cp >= 0xe0) {
+    cp&=0x0f;
+    more=2;
+  }
+  else if (cp >= 0xc0) {
+    cp&=0x1f;
+    more=1;
+  }
+  (*i)++;
+  while ((more-- > 0) && ((s[*i]&0xc0) == 0x80))
+    cp=(cp<<6)|(s[(*i)++]&0x3f);
+
+  return(cp);
+}
+
+/* The Sharp 'ASCII' bytes a code point can be stored as. Lower case */
+/* letters are the MZ-80A and MZ-700 ones, and the private use code  */
+/* points mzfview prints other characters as stand for themselves.   */
+bool sharp_bytes(uint32_t cp, bool icase, byteset *s)
+{
+  if ((cp >= 'a') && (cp <= 'z')) {
+    add_byte(s,lower[cp-'a']);
+    if (icase)
+      add_byte(s,cp-'a'+'A');
+  }
+  else if ((cp >= 'A') && (cp <= 'Z')) {
+    add_byte(s,cp);
+    if (icase)
+      add_byte(s,lower[cp-'A']);
+  }
+  else if ((cp >= 0x20) && (cp <= 0x5d))
+    add_byte(s,cp);
+  else if (((cp&0xff00) == 0xe000) || ((cp&0xff00) == 0xf000))
+    add_byte(s,cp&0xff);
+  else
+    return(false);
+
+  return(true);
+}
+
+/* Start a new pattern for a query, or fail if there are too many */
+pattern *new_pattern(int query, uint8_t enc, uint8_t dialect)
+{
+  pattern *p;
+
+  if (npatterns == MAXPATTERNS) {
+    fprintf(stderr,"Error: too many queries\n");
+    exit(2);
+  }
+  p=&patterns[npatterns];
+  memset(p,0,sizeof(pattern));
+  p->query=query;
+  p->enc=enc;
+  p->dialect=dialect;
+
+  return(p);
+}
+
+byteset *next_position(pattern *p, const char *q)
+{
+  if (p->len == MAXPATTERN) {
+    fprintf(stderr,"Error: %s is too long to search for\n",q);
+    exit(2);
+  }
+
+  return(&p->at[p->len++]);
+}
+
+/* Keep a pattern unless the same query has already made one like it */
+void keep_pattern(pattern *p)
+{
+  for (int i=0;i<npatterns;i++)
+    if ((patterns[i].query == p->query) && (patterns[i].len == p->len) &&
+        (memcmp(patterns[i].at,p->at,p->len*sizeof(byteset)) == 0))
+      return;
+  npatterns++;
+}
+
+/* Longest keyword of a BASIC at the start of q. A keyword that opens */
+/* a bracket also matches without it at the end of the query.         */
+size_t keyword_at(uint8_t dialect, const char *q, bool icase, uint16_t *tok)
+{
+  const basicdef *d=&dialects[dialect];
+  size_t best=0, qlen=strlen(q);
+
+  for (int p=0;p<3;p++) {
+    if (d->tables[p] == NULL)
+      continue;
+    for (int t=0;t<256;t++) {
+      const char *text=d->tables[p][t];
+      size_t len;
+      if (text == NULL)
+        continue;
+      len=strlen(text);
+      if ((text[len-1] == '(') && (qlen == len-1))
+        len--;
+      if ((len > best) && (len <= qlen) &&
+          ((icase ? strncasecmp(text,q,len) : strncmp(text,q,len)) == 0)) {
+        best=len;
+        *tok=d->planes[p]|t;
+      }
+    }
+  }
+
+  return(best);
+}
+
+/* S-BASIC keeps numbers in binary: line numbers after 0x0b, other  */
+/* constants after 0x15 as an exponent and a signed 32 bit mantissa. */
+/* A constant that is not exact in binary may be rounded differently */
+/* by S-BASIC, so its last mantissa byte matches anything.           */
+void sbasic_number(pattern *p, const char *q, double value, bool line)
+{
+  if (line && (value == floor(value)) && (value < 65536)) {
+    add_byte(next_position(p,q),0x0b);
+    add_byte(next_position(p,q),(uint16_t)value&0xff);
+    add_byte(next_position(p,q),(uint16_t)value>>8);
+    return;
+  }
+  add_byte(next_position(p,q),0x15);
+  if (value == 0)
+    for (int j=0;j<5;j++)
+      add_byte(next_position(p,q),0x00);
+  else {
+    int exponent;
+    double m=frexp(value,&exponent), bits=ldexp(m-0.5,32);
+    uint32_t mantissa=(uint32_t)bits&0x7fffffff;
+    add_byte(next_position(p,q),0x80+exponent);
+    for (int j=24;j>=0;j-=8) {
+      byteset *s=next_position(p,q);
+      if ((j == 0) && (bits != floor(bits)))
+        memset(s,0xff,sizeof(byteset));
+      else
+        add_byte(s,mantissa>>j);
+    }
+  }
+}
+
+/* Tokenise a query as a BASIC would: keywords become their tokens     */
+/* outside quotes and up to REM or DATA. S-BASIC variable names and    */
+/* numbers are kept in its own forms, with a variable's value left to */
+/* match anything. Programs are kept with or without spaces as they   */
+/* were typed, so squeeze drops those outside quotes. Returns false   */
+/* if nothing was tokenised.                                           */
+bool tokenise(pattern *p, const char *q, bool icase, bool squeeze)
+{
+  bool quoted=false, literal=false, tokens=false, line=false;
+  bool sbasic=(p->dialect == MZ700);
+  size_t i=0;
+
+  while (q[i] != '\0') {
+    uint16_t tok;
+    size_t len;
+    uint32_t cp;
+
+    if (!quoted && !literal && ((len=keyword_at(p->dialect,q+i,icase,&tok)) > 0)) {
+      const char *text=(tok > 0xff) ?
+                       dialects[p->dialect].tables[(tok>>8) == 0xff ? 2 : 1][tok&0xff] :
+                       dialects[p->dialect].tables[0][tok];
+      if (tok > 0xff)
+        add_byte(next_position(p,q),tok>>8);
+      add_byte(next_position(p,q),tok&0xff);
+      if ((strcmp(text,"REM") == 0) || (strcmp(text,"DATA") == 0))
+        literal=true;
+      line=sbasic && ((tok == 0x80) || (tok == 0x81) || (tok == 0x83) ||
+                      (tok == 0x85) || (tok == 0xe2));
+      tokens=true;
+      i+=len;
+      continue;
+    }
+    if (sbasic && !quoted && !literal && isalpha((uint8_t)q[i])) {
+      char name[MAXPATTERN];
+      size_t n=0;
+      while ((isalnum((uint8_t)q[i]) && (n < MAXPATTERN)) &&
+             ((n == 0) || (keyword_at(p->dialect,q+i,icase,&tok) == 0)))
+        name[n++]=toupper((uint8_t)q[i++]);
+      add_byte(next_position(p,q),(q[i] == '$') ? 0x03 : 0x05);
+      add_byte(next_position(p,q),n);
+      for (size_t j=0;j<n;j++)
+        add_byte(next_position(p,q),name[j]);
+      if (q[i] == '$')
+        i++;
+      else
+        for (int j=0;j<5;j++)
+          memset(next_position(p,q),0xff,sizeof(byteset));
+      tokens=true;
+      line=false;
+      continue;
+    }
+    if (sbasic && !quoted && !literal &&
+        (isdigit((uint8_t)q[i]) || ((q[i] == '.') && isdigit((uint8_t)q[i+1])))) {
+      char *end;
+      sbasic_number(p,q,strtod(q+i,&end),line);
+      i=end-q;
+      tokens=true;
+      continue;
+    }
+    if (sbasic && !quoted && !literal && (q[i] == '$') && isxdigit((uint8_t)q[i+1])) {
+      char *end;
+      unsigned long value=strtoul(q+i+1,&end,16);
+      add_byte(next_position(p,q),0x11);
+      add_byte(next_position(p,q),value&0xff);
+      add_byte(next_position(p,q),(value>>8)&0xff);
+      i=end-q;
+      tokens=true;
+      continue;
+    }
+
+    cp=next_codepoint(q,&i);
+    if (cp == '"')
+      quoted=!quoted;
+    else if ((cp != ' ') && (cp != ','))
+      line=false;
+    if (squeeze && (cp == ' ') && !quoted && !literal)
+      continue;
+    if (!sharp_bytes(cp,icase,next_position(p,q)))
+      return(false);
+  }
+
+  return(tokens);
+}
+
+/* How often a byte turns up in tapes and ROMs, roughly, so that the */
+/* rarest positions of a pattern are used as its anchors.            */
+int commonness(uint8_t b)
+{
+  switch (b) {
+    case 0x00: case 0xff: case 0x20:
+      return(16);
+    case 0x0d: case 0x01: case 0x02:
+      return(4);
+    default:
+      return(1);
+  }
+}
+
+bool choose_anchors(pattern *p)
+{
+  int score[2]={INT32_MAX,INT32_MAX};
+
+  for (uint16_t k=0;k<p->len;k++) {
+    int n=set_size(&p->at[k]), s=0;
+    if (n > ANCHORVALS)
+      continue;
+    for (int b=0;b<256;b++)
+      if (has_byte(&p->at[k],b))
+        s+=commonness(b);
+    if (s < score[0]) {
+      score[1]=score[0];
+      p->anchor[1]=p->anchor[0];
+      score[0]=s;
+      p->anchor[0]=k;
+    }
+    else if (s < score[1]) {
+      score[1]=s;
+      p->anchor[1]=k;
+    }
+  }
+  if (score[0] == INT32_MAX)
+    return(false);
+  if (score[1] == INT32_MAX)
+    p->anchor[1]=p->anchor[0];
+
+  for (int a=0;a<2;a++) {
+    int n=0;
+    for (int b=0;b<256;b++)
+      if (has_byte(&p->at[p->anchor[a]],b))
+        p->vals[a][n++]=b;
+    for (;n<ANCHORVALS;n++)
+      p->vals[a][n]=p->vals[a][0];
+  }
+
+  return(true);
+}
+
+/* Make the patterns for a query: Sharp 'ASCII', display codes and a */
+/* tokenised form for each BASIC that stores it differently.         */
+bool add_query(const char *q, int query, bool icase)
+{
+  pattern *p=new_pattern(query,ENC_ASCII,0);
+  size_t i=0;
+  int first=npatterns;
+
+  if (q[0] == '\0') {
+    fprintf(stderr,"Error: empty query\n");
+    return(false);
+  }
+  while (q[i] != '\0')
+    if (!sharp_bytes(next_codepoint(q,&i),icase,next_position(p,q))) {
+      fprintf(stderr,"Error: %s has characters the Sharp MZ can't store\n",q);
+      return(false);
+    }
+  keep_pattern(p);
+
+  p=new_pattern(query,ENC_DISPLAY,0);
+  p->len=patterns[first].len;
+  for (uint16_t k=0;k<p->len;k++)
+    for (int b=0;b<256;b++)
+      if (has_byte(&patterns[first].at[k],b))
+        add_byte(&p->at[k],display_code(b));
+  keep_pattern(p);
+
+  for (uint8_t d=1;d<DIALECTS;d++)
+    for (int squeeze=0;squeeze<2;squeeze++) {
+      p=new_pattern(query,ENC_BASIC,d);
+      if (tokenise(p,q,icase,squeeze) && (p->len > 0))
+        keep_pattern(p);
+    }
+
+  for (int k=first;k<npatterns;k++)
+    if (!choose_anchors(&patterns[k])) {
+      fprintf(stderr,"Error: %s is too vague to search for\n",q);
+      return(false);
+    }
+
+  return(true);
+}
+
+/* Print a Sharp 'ASCII' byte as mzfview does, for the mz-ascii font, */
+/* but with control codes as dots to keep each match on one line.    */
+void sharp_utf8(FILE *fp, uint8_t sharpchar, uint8_t charset)
+{
+  static const uint8_t variants80a[] = {0x80,0x8b,0x90,0x93,0x94,0xbe,0};
+  static const uint8_t variants700[] = {0x6c,0x7f,0x80,0x8b,0x90,0x93,
+                                        0x94,0xbe,0};
+  const uint8_t *variants=NULL;
+  uint32_t cp=0xe000+sharpchar;
+
+  if ((sharpchar >= 0x20) && (sharpchar <= 0x5d)) {
+    fputc(sharpchar,fp);
+    return;
+  }
+  for (uint8_t i=0;i<26;i++)
+    if (lower[i] == sharpchar) {
+      fputc('a'+i,fp);
+      return;
+    }
+  if (sharpchar < 0x20) {
+    fputc('.',fp);
+    return;
+  }
+
+  if (charset == MZ80A)
+    variants=variants80a;
+  else if (charset == MZ700)
+    variants=variants700;
+  for (;(variants != NULL) && (*variants != 0);variants++)
+    if (*variants == sharpchar)
+      cp=0xf000+sharpchar;
+  fprintf(fp,"%c%c%c",0xe0|(cp>>12),0x80|((cp>>6)&0x3f),0x80|(cp&0x3f));
+}
+
+/* Print the item of a BASIC line at i, with its tokens spelt out, */
+/* and return its length. Strings and what follows REM or DATA are  */
+/* left as characters. Nothing is printed if fp is NULL.            */
+size_t basic_item(FILE *fp, const uint8_t *buf, size_t i, size_t end,
+                  uint8_t dialect, bool *quoted, bool *literal)
+{
+  const basicdef *d=&dialects[dialect];
+  const char *text=NULL;
+  uint8_t b=buf[i];
+  size_t len=1;
+
+  if (*quoted || *literal) {
+    if (b == '"')
+      *quoted=false;
+  }
+  else if (b == '"')
+    *quoted=true;
+  else if ((dialect == MZ700) && (i+2 < end) && ((b == 0x0b) || (b == 0x11))) {
+    if (fp != NULL)
+      fprintf(fp,(b == 0x0b) ? "%u" : "$%X",buf[i+1]|(buf[i+2]<<8));
+    return(3);
+  }
+  else if ((dialect == MZ700) && (i+1 < end) && ((b == 0x03) || (b == 0x05)) &&
+           (i+2+buf[i+1] <= end)) {
+    if (fp != NULL)
+      fprintf(fp,"%.*s%s",buf[i+1],(const char *)buf+i+2,
+              (b == 0x03) ? "$" : "");
+    return(2+buf[i+1]+((b == 0x05) ? 5 : 0));
+  }
+  else if ((dialect == MZ700) && (b == 0x15) && (i+5 < end)) {
+    uint32_t m=((uint32_t)buf[i+2]<<24)|(buf[i+3]<<16)|(buf[i+4]<<8)|buf[i+5];
+    double value=(buf[i+1] == 0) ? 0 :
+                 ldexp(0.5+ldexp(m&0x7fffffff,-32),buf[i+1]-0x80);
+    if (fp != NULL)
+      fprintf(fp,"%g",(m & 0x80000000) ? -value : value);
+    return(6);
+  }
+  else {
+    for (int p=1;p<3;p++)
+      if ((d->tables[p] != NULL) && (b == (d->planes[p]>>8)) && (i+1 < end) &&
+          (d->tables[p][buf[i+1]] != NULL)) {
+        text=d->tables[p][buf[i+1]];
+        len=2;
+      }
+    if (text == NULL)
+      text=d->tables[0][b];
+  }
+
+  if (text != NULL) {
+    if ((strcmp(text,"REM") == 0) || (strcmp(text,"DATA") == 0))
+      *literal=true;
+    if (fp != NULL)
+      fputs(text,fp);
+  }
+  else if (fp != NULL)
+    sharp_utf8(fp,b,d->charset);
+
+  return(len);
+}
+
+/* Find the line of a BASIC program that offset is in. S-BASIC lines */
+/* start with their length, the others end with a carriage return.  */
+bool basic_line(const uint8_t *buf, size_t len, uint8_t dialect,
+                size_t offset, size_t *start, size_t *end)
+{
+  size_t pos=0, next;
+
+  while (pos+4 < len) {
+    if (dialect == MZ700) {
+      uint16_t link=buf[pos]|(buf[pos+1]<<8);
+      if (link < 5)
+        return(false);
+      next=pos+link;
+    }
+    else {
+      if ((buf[pos] == 0) && (buf[pos+1] == 0))
+        return(false);
+      for (next=pos+4;(next < len) && (buf[next] != 0x0d);next++);
+      next++;
+    }
+    if (next > len)
+      return(false);
+    if (offset < next) {
+      *start=pos;
+      *end=next-1;
+      return(true);
+    }
+    pos=next;
+  }
+
+  return(false);
+}
+
+/* Print a line of BASIC with the bytes from match to matchend picked */
+/* out. Returns false, printing nothing, unless the match starts on  */
+/* an item of the line, so that tokens found inside numbers, names   */
+/* or other tokens are not taken for keywords. With fp NULL it only  */
+/* checks.                                                            */
+bool print_basic_line(FILE *fp, const uint8_t *buf, size_t start, size_t end,
+                      uint8_t dialect, size_t match, size_t matchend)
+{
+  bool quoted=false, literal=false, aligned=false, lit=false;
+  FILE *to=NULL;
+
+  for (int pass=0;pass<2;pass++) {
+    size_t i=start+4;
+    if (pass == 1) {
+      if (!aligned || (fp == NULL))
+        return(aligned);
+      to=fp;
+      fprintf(fp,"%u ",buf[start+2]|(buf[start+3]<<8));
+      quoted=literal=false;
+    }
+    while (i < end) {
+      if (i == match) {
+        aligned=true;
+        lit=(to != NULL) && colour;
+        if (lit)
+          fprintf(to,"\033[1;31m");
+      }
+      i+=basic_item(to,buf,i,end,dialect,&quoted,&literal);
+      if (lit && (i >= matchend)) {
+        fprintf(to,"\033[0m");
+        lit=false;
+      }
+    }
+  }
+
+  return(true);
+}
+
+/* Print part of a region as text in the encoding a pattern matched */
+void print_span(FILE *fp, const uint8_t *buf, size_t from, size_t to,
+                const pattern *p, uint8_t charset)
+{
+  for (size_t i=from;i<to;i++) {
+    uint8_t b=(p->enc == ENC_DISPLAY) ? display2sharp[buf[i]] : buf[i];
+    sharp_utf8(fp,b,charset);
+  }
+}
+
+/* Matches in a file, and the part of the file each was found in */
+typedef struct {
+  size_t start, len;           // Bytes of the file searched
+  uint8_t dialect;             // BASIC its body is in, 0 for none
+  uint8_t charset;
+  bool header;                 // A tape header
+  int32_t load;                // Load address of a body, -1 for none
+} region;
+
+typedef struct {
+  size_t offset;
+  int pattern;
+  int region;
+} hit;
+
+typedef struct {
+  hit *hits;
+  size_t count, size;
+} hits;
+
+void add_hit(hits *h, size_t offset, int pattern, int region)
+{
+  if (h->count == h->size) {
+    h->size=(h->size == 0) ? 64 : h->size*2;
+    h->hits=realloc(h->hits,h->size*sizeof(hit));
+  }
+  h->hits[h->count++]=(hit){offset,pattern,region};
+}
+
+static inline bool matches(const uint8_t *buf, size_t len, size_t pos,
+                           const pattern *p)
+{
+  if (pos+p->len > len)
+    return(false);
+  for (uint16_t k=0;k<p->len;k++)
+    if (!has_byte(&p->at[k],buf[pos+k]))
+      return(false);
+
+  return(true);
+}
+
+/* The patterns are looked for 32 positions at a time. For each, the */
+/* bytes at its two anchor positions are compared with the values    */
+/* they may take across the whole block, and only where both agree   */
+/* is the rest of the pattern checked. GCC's vector extensions make   */
+/* this AVX2 where the processor has it, and SSE2 otherwise.          */
+#define BLOCK 32
+
+typedef uint8_t block __attribute__((vector_size(BLOCK)));
+typedef int8_t blockmask __attribute__((vector_size(BLOCK)));
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SCAN_CLONES __attribute__((target_clones("avx2","default")))
+#else
+#define SCAN_CLONES
+#endif
+
+SCAN_CLONES
+void scan(const uint8_t *buf, size_t len, int *active, int nactive,
+          hits *h, int r)
+{
+  struct {
+    uint16_t at[2];
+    block vals[2][ANCHORVALS];
+  } an[MAXPATTERNS];
+  size_t pos=0, reach=0;
+
+  for (int a=0;a<nactive;a++) {
+    pattern *p=&patterns[active[a]];
+    for (int i=0;i<2;i++) {
+      an[a].at[i]=p->anchor[i];
+      for (int v=0;v<ANCHORVALS;v++)
+        an[a].vals[i][v]=(block){0}+p->vals[i][v];
+      if (p->anchor[i] > reach)
+        reach=p->anchor[i];
+    }
+  }
+
+  for (;pos+reach+BLOCK <= len;pos+=BLOCK) {
+    blockmask m[MAXPATTERNS], any={0};
+    uint64_t words[BLOCK/8];
+    for (int a=0;a<nactive;a++) {
+      block x, y;
+      memcpy(&x,buf+pos+an[a].at[0],BLOCK);
+      memcpy(&y,buf+pos+an[a].at[1],BLOCK);
+      m[a]=((blockmask)(x == an[a].vals[0][0])|(blockmask)(x == an[a].vals[0][1]))&
+           ((blockmask)(y == an[a].vals[1][0])|(blockmask)(y == an[a].vals[1][1]));
+      any|=m[a];
+    }
+    memcpy(words,&any,BLOCK);
+    if ((words[0]|words[1]|words[2]|words[3]) == 0)
+      continue;
+    for (int a=0;a<nactive;a++)
+      for (int i=0;i<BLOCK;i++)
+        if (m[a][i] && matches(buf,len,pos+i,&patterns[active[a]]))
+          add_hit(h,pos+i,active[a],r);
+  }
+
+  for (;pos < len;pos++)
+    for (int a=0;a<nactive;a++)
+      if (matches(buf,len,pos,&patterns[active[a]]))
+        add_hit(h,pos,active[a],r);
+}
+
+bool is_tape_name(const char *name)
+{
+  const char *ext=strrchr(name,'.');
+
+  return((ext != NULL) && ((strcasecmp(ext,".mzf") == 0) ||
+                           (strcasecmp(ext,".mzt") == 0) ||
+                           (strcasecmp(ext,".m12") == 0)));
+}
+
+/* Split a file into the regions to search. A tape file is a header */
+/* and body after another, for as many as fit, and a ROM image or   */
+/* anything left over is searched as it is.                         */
+int find_regions(const uint8_t *data, size_t size, bool tape, region *rg,
+                 int max)
+{
+  size_t pos=0;
+  int n=0;
+
+  while (tape && (pos+MZFHEADERSIZE <= size) && (n+2 <= max-1)) {
+    const uint8_t *hd=data+pos;
+    uint16_t fs=hd[18]|(hd[19]<<8), load=hd[20]|(hd[21]<<8);
+    uint8_t dialect=0;
+    if (pos+MZFHEADERSIZE+fs > size)
+      break;
+    for (uint8_t d=1;d<DIALECTS;d++)
+      if ((hd[0] == dialects[d].type) &&
+          ((dialects[d].load == 0) || (dialects[d].load == load)))
+        dialect=d;
+    rg[n++]=(region){pos,MZFHEADERSIZE,0,dialects[dialect].charset,true,-1};
+    rg[n++]=(region){pos+MZFHEADERSIZE,fs,dialect,dialects[dialect].charset,
+                     false,load};
+    pos+=MZFHEADERSIZE+fs;
+  }
+  if (pos < size)
+    rg[n++]=(region){pos,size-pos,0,MZ80K,false,-1};
+
+  return(n);
+}
+
+int by_offset(const void *a, const void *b)
+{
+  const hit *x=a, *y=b;
+
+  if (x->offset != y->offset)
+    return((x->offset < y->offset) ? -1 : 1);
+
+  return(x->pattern-y->pattern);
+}
+
+/* Search one file, returning what to print for it. matched is set if */
+/* anything was found, and the result is NULL if it can't be read.    */
+#define MAXREGIONS 1024
+
+char *grep_file(char *name, bool *matched)
+{
+  region rg[MAXREGIONS];
+  hits h={0};
+  struct stat st;
+  uint8_t *data=NULL;
+  char *text=NULL;
+  size_t textlen=0;
+  FILE *fp;
+  int fd, nregions;
+  bool found=false;
+
+  fd=open(name,O_RDONLY);
+  if ((fd < 0) || (fstat(fd,&st) < 0)) {
+    fprintf(stderr,"Error: %s not found\n",name);
+    if (fd >= 0)
+      close(fd);
+    return(NULL);
+  }
+  if (st.st_size > 0) {
+    data=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr,"Error: unable to read %s\n",name);
+      close(fd);
+      return(NULL);
+    }
+    madvise(data,st.st_size,MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  nregions=find_regions(data,st.st_size,is_tape_name(name),rg,MAXREGIONS);
+  for (int r=0;r<nregions;r++) {
+    int active[MAXPATTERNS], nactive=0;
+    for (int k=0;k<npatterns;k++)
+      if ((patterns[k].enc != ENC_BASIC) || (patterns[k].dialect == rg[r].dialect))
+        active[nactive++]=k;
+    scan(data+rg[r].start,rg[r].len,active,nactive,&h,r);
+  }
+  if (h.count > 1)
+    qsort(h.hits,h.count,sizeof(hit),by_offset);
+
+  fp=open_memstream(&text,&textlen);
+  for (size_t i=0;i<h.count;i++) {
+    hit *ht=&h.hits[i];
+    region *r=&rg[ht->region];
+    const pattern *p=&patterns[ht->pattern];
+    const uint8_t *buf=data+r->start;
+    size_t from=(ht->offset > (size_t)context) ? ht->offset-context : 0;
+    size_t to=ht->offset+p->len+context, start, end;
+    bool whole=false;
+
+    if (p->enc == ENC_BASIC) {
+      whole=basic_line(buf,r->len,p->dialect,ht->offset,&start,&end);
+      if (whole && !print_basic_line(NULL,buf,start,end,p->dialect,
+                                      ht->offset,ht->offset+p->len))
+        continue;
+    }
+    if (to > r->len)
+      to=r->len;
+    fprintf(fp,"%s:0x%06zx",name,r->start+ht->offset);
+    if (r->header)
+      fprintf(fp," (header)");
+    else if (r->load >= 0)
+      fprintf(fp," (0x%04zx)",(r->load+ht->offset)&0xffff);
+    fprintf(fp," %s: ",(p->enc == ENC_BASIC) ? dialects[p->dialect].name :
+                       (p->enc == ENC_DISPLAY) ? "display" : "ascii");
+    if (whole)
+      print_basic_line(fp,buf,start,end,p->dialect,ht->offset,
+                       ht->offset+p->len);
+    else {
+      print_span(fp,buf,from,ht->offset,p,r->charset);
+      fprintf(fp,"%s",colour ? "\033[1;31m" : "");
+      print_span(fp,buf,ht->offset,ht->offset+p->len,p,r->charset);
+      fprintf(fp,"%s",colour ? "\033[0m" : "");
+      print_span(fp,buf,ht->offset+p->len,to,p,r->charset);
+    }
+    fprintf(fp,"\n");
+    found=true;
+  }
+  fclose(fp);
+
+  *matched=found;
+  free(h.hits);
+  if (data != NULL)
+    munmap(data,st.st_size);
+
+  return(text);
+}
+
+/* Files are searched by a pool of threads, and printed in order */
+typedef struct {
+  char **files;
+  int count;
+  atomic_int next;
+  char **results;
+  bool *done, *matched;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+} batch;
+
+void *searcher(void *arg)
+{
+  batch *bt=arg;
+  int n;
+
+  while ((n=atomic_fetch_add(&bt->next,1)) < bt->count) {
+    bool matched=false;
+    char *text=grep_file(bt->files[n],&matched);
+    pthread_mutex_lock(&bt->lock);
+    bt->results[n]=text;
+    bt->matched[n]=matched;
+    bt->done[n]=true;
+    pthread_cond_broadcast(&bt->ready);
+    pthread_mutex_unlock(&bt->lock);
+  }
+
+  return(NULL);
+}
+
+int main(int argc, char **argv)
+{
+  int nthreads=sysconf(_SC_NPROCESSORS_ONLN), status=1, opt, nqueries=0;
+  char *queries[MAXPATTERNS];
+  bool icase=false, failed=false;
+  batch bt={0};
+  pthread_t *threads;
+
+  while ((opt=getopt(argc,argv,"e:iC:j:")) != -1) {
+    switch (opt) {
+      case 'e': if (nqueries < MAXPATTERNS)
+                  queries[nqueries++]=optarg;
+                break;
+      case 'i': icase=true;
+                break;
+      case 'C': context=atoi(optarg);
+                break;
+      case 'j': nthreads=atoi(optarg);
+                break;
+      default:  argc=0;
+    }
+  }
+  if ((nqueries == 0) && (optind < argc))
+    queries[nqueries++]=argv[optind++];
+  if ((argc-optind < 1) || (nqueries == 0) || (context < 0)) {
+    fprintf(stderr,"Usage: %s [-i] [-C <context bytes>] [-j <threads>]"
+                   " <text> | -e <text> ... <file> ...\n",argv[0]);
+    exit(2);
+  }
+
+  for (int i=0;i<64;i++)
+    display2sharp[printable[i]]=0x20+i;
+  for (int i=0;i<26;i++)
+    display2sharp[0x81+i]=lower[i];
+  for (int q=0;q<nqueries;q++)
+    if (!add_query(queries[q],q,icase))
+      exit(2);
+  colour=isatty(STDOUT_FILENO);
+
+  bt.files=&argv[optind];
+  bt.count=argc-optind;
+  bt.results=calloc(bt.count,sizeof(char *));
+  bt.done=calloc(bt.count,sizeof(bool));
+  bt.matched=calloc(bt.count,sizeof(bool));
+  pthread_mutex_init(&bt.lock,NULL);
+  pthread_cond_init(&bt.ready,NULL);
+  if (nthreads < 1)
+    nthreads=1;
+  if (nthreads > bt.count)
+    nthreads=bt.count;
+  threads=malloc(nthreads*sizeof(pthread_t));
+  for (int t=0;t<nthreads;t++)
+    pthread_create(&threads[t],NULL,searcher,&bt);
+
+  for (int n=0;n<bt.count;n++) {
+    pthread_mutex_lock(&bt.lock);
+    while (!bt.done[n])
+      pthread_cond_wait(&bt.ready,&bt.lock);
+    pthread_mutex_unlock(&bt.lock);
+    if (bt.results[n] == NULL)
+      failed=true;
+    else
+      fputs(bt.results[n],stdout);
+    if (bt.matched[n])
+      status=0;
+    free(bt.results[n]);
+  }
+  for (int t=0;t<nthreads;t++)
+    pthread_join(threads[t],NULL);
+  free(threads);
+  free(bt.results);
+  free(bt.done);
+  free(bt.matched);
+
+  return(failed ? 2 : status);
+}
+
+//MIT License
+
+//Copyright (c) 2026 Tim Holyoake
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
@@ -0,0 +1,421 @@
+/**************************************************/
+/* mzimage.c                                      */
+/*                                                */
+/* Utility to place Sharp MZ series tape records  */
+/* at their load addresses in a 64K memory image, */
+/* checking that none of them overlap, and write  */
+/* it as a snapshot an emulator can map and start */
+/* from instead of loading each tape.             */
+/*                                                */
+/* Tim Holyoake, 18th October 2026.               */
+/* MIT licence - see end of file for details.     */
+/**************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define MZFHEADERSIZE 128      // Size of a .mzf file header in bytes
+#define IBUFE      0x10f0      // Where the monitor keeps the tape header
+
+/* A snapshot is a page of metadata followed by the 64K image, so that */
+/* the image can be mapped on its own. All numbers are little endian.  */
+/*                                                                     */
+/*   0  "MZSNAP01"                                                     */
+/*   8  version (16 bits), 1                                           */
+/*  10  exec address (16 bits)                                         */
+/*  12  number of records (16 bits)                                    */
+/*  14  flags (16 bits), SNAP_HEADER if a tape header is at 0x10f0     */
+/*  16  offset of the image in the file (32 bits), 4096                */
+/*  20  size of the image (32 bits), 65536                             */
+/*  24  FNV-1a hash of the image (64 bits)                             */
+/*  32  a bit for each 256 byte page holding loaded bytes, 32 bytes    */
+/*  64  the records, SNAPRECORD bytes each:                            */
+/*        0  tape file type                                            */
+/*        1  name, 17 Sharp 'ASCII' bytes ended by 0x0d                */
+/*       18  load address, size and exec address (16 bits each)        */
+/*       24  FNV-1a hash of the body (64 bits)                         */
+#define SNAPMAGIC  "MZSNAP01"
+#define SNAPVERSION     1
+#define SNAPPAGE     4096      // Image offset, a page so it can be mapped
+#define SNAPIMAGE   65536
+#define SNAPRECORDS    64      // Offset of the first record
+#define SNAPRECORD     32      // Bytes per record
+#define MAXRECORDS ((SNAPPAGE-SNAPRECORDS)/SNAPRECORD)
+#define SNAP_HEADER  0x01      // Flag bit, tape header at IBUFE
+
+/* A record placed in the image */
+typedef struct {
+  uint8_t header[MZFHEADERSIZE];
+  uint16_t load, size;
+  uint64_t hash;               // Of the body, as it was loaded
+  char *file;
+} record;
+
+record records[MAXRECORDS];
+int nrecords=0;
+uint8_t image[SNAPIMAGE];
+uint8_t owner[SNAPIMAGE];      // Record number+1 of each byte, 0 for none
+
+uint64_t hash_bytes(uint64_t h, const uint8_t *data, size_t len)
+{
+  for (size_t i=0;i<len;i++)
+    h=(h^data[i])*0x100000001b3;
+
+  return(h);
+}
+
+void put16(uint8_t *p, uint16_t v)
+{
+  p[0]=v;
+  p[1]=v>>8;
+}
+
+void put32(uint8_t *p, uint32_t v)
+{
+  put16(p,v);
+  put16(p+2,v>>16);
+}
+
+void put64(uint8_t *p, uint64_t v)
+{
+  put32(p,v);
+  put32(p+4,v>>32);
+}
+
+uint16_t get16(const uint8_t *p)
+{
+  return(p[0]|(p[1]<<8));
+}
+
+uint32_t get32(const uint8_t *p)
+{
+  return(get16(p)|((uint32_t)get16(p+2)<<16));
+}
+
+uint64_t get64(const uint8_t *p)
+{
+  return(get32(p)|((uint64_t)get32(p+4)<<32));
+}
+
+/* A tape name as plain ASCII, with Sharp lower case letters */
+void print_name(const uint8_t *name)
+{
+  static const uint8_t lower[26] = {
+    0xa1,0x9a,0x9f,0x9c,0x92,0xaa,0x97,0x98,0xa6,0xaf,0xa9,0xb8,0xb3,
+    0xb0,0xb7,0x9e,0xa0,0x9d,0xa4,0x96,0xa5,0xab,0xa3,0x9b,0xbd,0xa2
+  };
+
+  for (int i=0;(i < 17) && (name[i] != 0x0d);i++) {
+    char ch='.';
+    if ((name[i] >= 0x20) && (name[i] <= 0x5d))
+      ch=name[i];
+    for (int j=0;j<26;j++)
+      if (lower[j] == name[i])
+        ch='a'+j;
+    putchar(ch);
+  }
+}
+
+/* Put the bytes of a record into the image, failing if they run past */
+/* the top of memory or, unless force is set, land on another record. */
+bool place(int r, const uint8_t *body, bool force)
+{
+  record *rc=&records[r];
+  uint32_t end=(uint32_t)rc->load+rc->size;
+
+  if (end > SNAPIMAGE) {
+    fprintf(stderr,"Error: %s 0x%04x-0x%05x runs past the top of memory\n",
+            rc->file,rc->load,end-1);
+    return(false);
+  }
+  for (uint32_t a=rc->load;a<end;a++)
+    if (owner[a] != 0) {
+      record *other=&records[owner[a]-1];
+      uint32_t last=a;
+      while ((last+1 < end) && (owner[last+1] == owner[a]))
+        last++;
+      fprintf(stderr,"%s: %s 0x%04x-0x%04x overlaps %s at 0x%04x-0x%04x\n",
+              force ? "Warning" : "Error",rc->file,rc->load,end-1,
+              other->file,a,last);
+      if (!force)
+        return(false);
+      a=last;
+    }
+  memcpy(image+rc->load,body,rc->size);
+  memset(owner+rc->load,r+1,rc->size);
+  rc->hash=hash_bytes(0xcbf29ce484222325,body,rc->size);
+
+  return(true);
+}
+
+/* Read each header and body of a tape file into the image. A file */
+/* name may end @<address> to load its first record somewhere else, */
+/* such as an S-BASIC program at 0x6bcf.                            */
+bool add_tape(char *arg, bool force)
+{
+  char file[PATH_MAX], *at=strrchr(arg,'@');
+  long move=-1;
+  uint8_t *tape;
+  size_t size, pos=0;
+  struct stat st;
+  FILE *fp;
+
+  snprintf(file,sizeof(file),"%s",arg);
+  if (at != NULL) {
+    char *end;
+    move=strtol(at+1,&end,0);
+    if ((*end == '\0') && (end != at+1) && (move >= 0) && (move < SNAPIMAGE))
+      file[at-arg]='\0';
+    else
+      move=-1;
+  }
+
+  fp=fopen(file,"r");
+  if ((fp == NULL) || (fstat(fileno(fp),&st) < 0)) {
+    fprintf(stderr,"Error: %s not found\n",file);
+    if (fp != NULL)
+      fclose(fp);
+    return(false);
+  }
+  /* Every record of the file is read, up to as many as a snapshot holds */
+  if ((uint64_t)st.st_size > (uint64_t)MAXRECORDS*(MZFHEADERSIZE+65536)) {
+    fprintf(stderr,"Error: %s is longer than the %d records a snapshot holds\n",
+            file,MAXRECORDS);
+    fclose(fp);
+    return(false);
+  }
+  tape=malloc((st.st_size > 0) ? st.st_size : 1);
+  size=fread(tape,1,st.st_size,fp);
+  fclose(fp);
+
+  while (pos+MZFHEADERSIZE <= size) {
+    record *rc=&records[nrecords];
+    uint8_t *hd=tape+pos;
+    if (nrecords == MAXRECORDS) {
+      fprintf(stderr,"Error: more than %d records\n",MAXRECORDS);
+      free(tape);
+      return(false);
+    }
+    memcpy(rc->header,hd,MZFHEADERSIZE);
+    rc->size=get16(hd+18);
+    rc->load=(move >= 0) ? move : get16(hd+20);
+    rc->file=arg;
+    move=-1;
+    if (pos+MZFHEADERSIZE+rc->size > size) {
+      fprintf(stderr,"Error: %s body truncated at %zu of %d bytes\n",file,
+              size-pos-MZFHEADERSIZE,rc->size);
+      free(tape);
+      return(false);
+    }
+    if (!place(nrecords,hd+MZFHEADERSIZE,force)) {
+      free(tape);
+      return(false);
+    }
+    nrecords++;
+    pos+=MZFHEADERSIZE+rc->size;
+  }
+  if (pos == 0)
+    fprintf(stderr,"Error: %s has no tape header\n",file);
+  else if (pos < size)
+    fprintf(stderr,"Warning: %zu bytes after the last record of %s ignored\n",
+            size-pos,file);
+  free(tape);
+
+  return(pos > 0);
+}
+
+/* Write the snapshot through a temporary file, so an emulator never */
+/* maps half of one                                                  */
+bool write_snapshot(char *name, uint16_t exec, uint16_t flags)
+{
+  uint8_t meta[SNAPPAGE]={0};
+  char tmp[PATH_MAX+16];
+  FILE *fp;
+
+  memcpy(meta,SNAPMAGIC,8);
+  put16(meta+8,SNAPVERSION);
+  put16(meta+10,exec);
+  put16(meta+12,nrecords);
+  put16(meta+14,flags);
+  put32(meta+16,SNAPPAGE);
+  put32(meta+20,SNAPIMAGE);
+  put64(meta+24,hash_bytes(0xcbf29ce484222325,image,SNAPIMAGE));
+  for (uint32_t a=0;a<SNAPIMAGE;a++)
+    if (owner[a] != 0)
+      meta[32+(a>>11)]|=1<<((a>>8)&7);
+  for (int r=0;r<nrecords;r++) {
+    uint8_t *m=meta+SNAPRECORDS+r*SNAPRECORD;
+    record *rc=&records[r];
+    m[0]=rc->header[0];
+    memcpy(m+1,rc->header+1,17);
+    put16(m+18,rc->load);
+    put16(m+20,rc->size);
+    put16(m+22,get16(rc->header+22));
+    put64(m+24,rc->hash);
+  }
+
+  snprintf(tmp,sizeof(tmp),"%s.%d",name,getpid());
+  fp=fopen(tmp,"w");
+  if (fp == NULL) {
+    fprintf(stderr,"Error: unable to write %s\n",name);
+    return(false);
+  }
+  if ((fwrite(meta,1,SNAPPAGE,fp) != SNAPPAGE) ||
+      (fwrite(image,1,SNAPIMAGE,fp) != SNAPIMAGE) || (fclose(fp) != 0) ||
+      (rename(tmp,name) != 0)) {
+    fprintf(stderr,"Error: unable to write %s\n",name);
+    unlink(tmp);
+    return(false);
+  }
+
+  return(true);
+}
+
+/* Map a snapshot and list what is in it, checking the image hash */
+int list_snapshot(char *name)
+{
+  struct stat st;
+  uint8_t *snap;
+  int fd=open(name,O_RDONLY), status=0;
+  uint32_t offset, size;
+
+  if ((fd < 0) || (fstat(fd,&st) < 0)) {
+    fprintf(stderr,"Error: %s not found\n",name);
+    return(1);
+  }
+  snap=(st.st_size >= SNAPPAGE) ?
+       mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0) : MAP_FAILED;
+  close(fd);
+  if ((snap == MAP_FAILED) || (memcmp(snap,SNAPMAGIC,8) != 0)) {
+    fprintf(stderr,"Error: %s is not a memory snapshot\n",name);
+    if (snap != MAP_FAILED)
+      munmap(snap,st.st_size);
+    return(1);
+  }
+  offset=get32(snap+16);
+  size=get32(snap+20);
+  if (((uint64_t)offset+size > (uint64_t)st.st_size) ||
+      (get16(snap+12) > MAXRECORDS)) {
+    fprintf(stderr,"Error: %s is truncated\n",name);
+    munmap(snap,st.st_size);
+    return(1);
+  }
+
+  printf("%s: exec 0x%04x, %d records",name,get16(snap+10),get16(snap+12));
+  if (get16(snap+14) & SNAP_HEADER)
+    printf(", tape header at 0x%04x",IBUFE);
+  printf("\n");
+  for (int r=0;r<get16(snap+12);r++) {
+    uint8_t *m=snap+SNAPRECORDS+r*SNAPRECORD;
+    printf("  0x%04x-0x%04x type 0x%02x exec 0x%04x ",get16(m+18),
+           (get16(m+18)+get16(m+20)-1)&0xffff,m[0],get16(m+22));
+    print_name(m+1);
+    printf("\n");
+  }
+  if (hash_bytes(0xcbf29ce484222325,snap+offset,size) != get64(snap+24)) {
+    printf("  Image does not match its hash\n");
+    status=1;
+  }
+  munmap(snap,st.st_size);
+
+  return(status);
+}
+
+int main(int argc, char **argv)
+{
+  char *outname=NULL, *listname=NULL;
+  long exec=-1;
+  bool force=false, clear=true;
+  uint16_t flags=0;
+  int opt, first;
+  uint32_t used=0;
+
+  while ((opt=getopt(argc,argv,"o:x:fl:")) != -1) {
+    switch (opt) {
+      case 'o': outname=optarg;
+                break;
+      case 'x': exec=strtol(optarg,NULL,0)&0xffff;
+                break;
+      case 'f': force=true;
+                break;
+      case 'l': listname=optarg;
+                break;
+      default:  argc=0;
+    }
+  }
+  if (listname != NULL)
+    return(list_snapshot(listname));
+  if ((outname == NULL) || (argc-optind < 1)) {
+    fprintf(stderr,"Usage: %s [-x <exec address>] [-f] -o <snapshot>"
+                   " <mzf file>[@<load address>] ...\n"
+                   "       %s -l <snapshot>\n",argv[0],argv[0]);
+    exit(1);
+  }
+
+  for (int i=optind;i<argc;i++)
+    if (!add_tape(argv[i],force))
+      exit(1);
+
+  /* Start at the first machine code record, unless told otherwise */
+  first=0;
+  for (int r=nrecords-1;r>=0;r--)
+    if (records[r].header[0] == 0x01)
+      first=r;
+  if (exec < 0)
+    exec=get16(records[first].header+22);
+
+  /* The monitor leaves the header of the tape it loaded at IBUFE, */
+  /* and some loaders look there, so keep it if nothing else is.   */
+  for (int a=IBUFE;a<IBUFE+MZFHEADERSIZE;a++)
+    if (owner[a] != 0)
+      clear=false;
+  if (clear) {
+    memcpy(image+IBUFE,records[first].header,MZFHEADERSIZE);
+    flags|=SNAP_HEADER;
+  }
+
+  for (int r=0;r<nrecords;r++) {
+    printf("0x%04x-0x%04x type 0x%02x ",records[r].load,
+           records[r].load+records[r].size-1,records[r].header[0]);
+    print_name(records[r].header+1);
+    printf(" (%s)\n",records[r].file);
+  }
+  for (uint32_t a=0;a<SNAPIMAGE;a++)
+    if (owner[a] != 0)
+      used++;
+  if (!write_snapshot(outname,exec,flags))
+    exit(1);
+  printf("%u bytes loaded, exec 0x%04lx, written to %s\n",used,exec,outname);
+
+  return(0);
+}
+
+//MIT License
+
+//Copyright (c) 2026 Tim Holyoake
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
@@ -0,0 +1,224 @@
+/**************************************************/
+/* mzrompack.h                                    */
+/*                                                */
+/* Reader for ROM packs made by dumprom -p: the   */
+/* monitor ROMs, CGROMs and BASIC images an       */
+/* emulator needs, in one file that is mapped     */
+/* once. Include it and call mzpack_open, then    */
+/* mzpack_find or mzpack_find_hash for each ROM.  */
+/*                                                */
+/* Tim Holyoake, 18th October 2026.               */
+/* MIT licence - see end of file for details.     */
+/**************************************************/
+#ifndef MZROMPACK_H
+#define MZROMPACK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/* A pack is a header, two hash indexes, the entries and then each   */
+/* ROM, page aligned. All numbers are little endian.                 */
+/*                                                                   */
+/*   0  "MZROMPK1"                                                   */
+/*   8  number of entries (32 bits)                                  */
+/*  12  slots in each index, a power of 2 (32 bits)                  */
+/*  16  FNV-1a hash of everything from MZPACK_HEADER to the first    */
+/*      ROM (64 bits), so a damaged index is never followed          */
+/*  24  offset of the first ROM (32 bits)                            */
+/*  64  index by name hash, then index by ROM hash: each a slot of   */
+/*      entry number+1 (32 bits), 0 if empty, probed linearly        */
+/*      then the entries, MZPACK_ENTRY bytes each:                   */
+/*        0  name, NUL padded                                        */
+/*       40  offset and size of the ROM (32 bits each)               */
+/*       48  FNV-1a hash of the ROM (64 bits)                        */
+/*       56  kind (8 bits), MZPACK_ROM or MZPACK_CGROM               */
+/*       57  2K banks of a CGROM (8 bits)                            */
+#define MZPACK_MAGIC   "MZROMPK1"
+#define MZPACK_HEADER  64
+#define MZPACK_ENTRY   64
+#define MZPACK_NAME    40      // Longest name, with its NUL
+#define MZPACK_ALIGN 4096      // Each ROM starts on a page
+#define MZPACK_ROM      0      // Kinds of ROM
+#define MZPACK_CGROM    1
+
+typedef struct {
+  const uint8_t *base;         // The whole pack, mapped
+  size_t size;
+  uint32_t count, slots;
+  const uint8_t *names, *hashes, *entries;
+} mzpack;
+
+typedef struct {
+  const char *name;
+  const uint8_t *data;         // Points into the mapping
+  uint32_t size;
+  uint64_t hash;
+  uint8_t kind, banks;
+} mzrom;
+
+static inline uint32_t mzpack_get32(const uint8_t *p)
+{
+  return(p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24));
+}
+
+static inline uint64_t mzpack_get64(const uint8_t *p)
+{
+  return(mzpack_get32(p)|((uint64_t)mzpack_get32(p+4)<<32));
+}
+
+static inline uint64_t mzpack_hash(const void *data, size_t len)
+{
+  const uint8_t *p=data;
+  uint64_t h=0xcbf29ce484222325;
+
+  for (size_t i=0;i<len;i++)
+    h=(h^p[i])*0x100000001b3;
+
+  return(h);
+}
+
+/* Fill in a ROM from entry n */
+static inline void mzpack_entry(const mzpack *pk, uint32_t n, mzrom *rom)
+{
+  const uint8_t *e=pk->entries+n*MZPACK_ENTRY;
+
+  rom->name=(const char *)e;
+  rom->data=pk->base+mzpack_get32(e+MZPACK_NAME);
+  rom->size=mzpack_get32(e+MZPACK_NAME+4);
+  rom->hash=mzpack_get64(e+48);
+  rom->kind=e[56];
+  rom->banks=e[57];
+}
+
+/* Map a pack and check its header and index. Returns false if it */
+/* can't be read or is not a whole, undamaged pack.               */
+static inline bool mzpack_open(const char *path, mzpack *pk)
+{
+  struct stat st;
+  const uint8_t *b;
+  uint32_t first;
+  int fd=open(path,O_RDONLY);
+
+  memset(pk,0,sizeof(mzpack));
+  if (fd < 0)
+    return(false);
+  if ((fstat(fd,&st) < 0) || (st.st_size < MZPACK_HEADER)) {
+    close(fd);
+    return(false);
+  }
+  b=mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if (b == MAP_FAILED)
+    return(false);
+  pk->base=b;
+  pk->size=st.st_size;
+  pk->count=mzpack_get32(b+8);
+  pk->slots=mzpack_get32(b+12);
+  first=mzpack_get32(b+24);
+  pk->names=b+MZPACK_HEADER;
+  pk->hashes=pk->names+4*(size_t)pk->slots;
+  pk->entries=pk->hashes+4*(size_t)pk->slots;
+
+  if ((memcmp(b,MZPACK_MAGIC,8) != 0) || (pk->slots == 0) ||
+      ((pk->slots & (pk->slots-1)) != 0) || (pk->count >= pk->slots) ||
+      ((size_t)(pk->entries-b)+(size_t)pk->count*MZPACK_ENTRY > first) ||
+      (first > pk->size) ||
+      (mzpack_hash(b+MZPACK_HEADER,first-MZPACK_HEADER) !=
+       mzpack_get64(b+16))) {
+    munmap((void *)b,st.st_size);
+    memset(pk,0,sizeof(mzpack));
+    return(false);
+  }
+  for (uint32_t n=0;n<pk->count;n++) {
+    mzrom rom;
+    mzpack_entry(pk,n,&rom);
+    if (((size_t)(rom.data-b)+rom.size > pk->size) ||
+        (memchr(rom.name,0,MZPACK_NAME) == NULL)) {
+      munmap((void *)b,st.st_size);
+      memset(pk,0,sizeof(mzpack));
+      return(false);
+    }
+  }
+
+  return(true);
+}
+
+static inline void mzpack_close(mzpack *pk)
+{
+  if (pk->base != NULL)
+    munmap((void *)pk->base,pk->size);
+  memset(pk,0,sizeof(mzpack));
+}
+
+/* Look a ROM up by name, a probe of the name index */
+static inline bool mzpack_find(const mzpack *pk, const char *name, mzrom *rom)
+{
+  uint32_t mask=pk->slots-1, s, n;
+
+  if (pk->base == NULL)
+    return(false);
+  s=mzpack_hash(name,strlen(name))&mask;
+  while (((n=mzpack_get32(pk->names+4*s)) != 0) && (n <= pk->count)) {
+    mzpack_entry(pk,n-1,rom);
+    if (strncmp(rom->name,name,MZPACK_NAME) == 0)
+      return(true);
+    s=(s+1)&mask;
+  }
+
+  return(false);
+}
+
+/* Look a ROM up by the FNV-1a hash of its contents */
+static inline bool mzpack_find_hash(const mzpack *pk, uint64_t hash,
+                                    mzrom *rom)
+{
+  uint32_t mask=pk->slots-1, s, n;
+
+  if (pk->base == NULL)
+    return(false);
+  s=hash&mask;
+  while (((n=mzpack_get32(pk->hashes+4*s)) != 0) && (n <= pk->count)) {
+    mzpack_entry(pk,n-1,rom);
+    if (rom->hash == hash)
+      return(true);
+    s=(s+1)&mask;
+  }
+
+  return(false);
+}
+
+/* Check a ROM against its hash, for a reader that wants to before */
+/* trusting it                                                    */
+static inline bool mzpack_verify(const mzrom *rom)
+{
+  return(mzpack_hash(rom->data,rom->size) == rom->hash);
+}
+
+#endif
+
+//MIT License
+
+//Copyright (c) 2026 Tim Holyoake
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.
@@ -0,0 +1,1309 @@
+/**************************************************/
+/* mzrun.c                                        */
+/*                                                */
+/* Utility to run Sharp MZ series machine code    */
+/* tapes in a headless Z80 for a fixed number of  */
+/* cycles, with the monitor ROM calls stubbed,    */
+/* and report what each printed, which memory it  */
+/* changed, what code it unpacked and ran and any */
+/* BASIC program it left behind.                  */
+/*                                                */
+/* Tim Holyoake, 18th October 2026.               */
+/* MIT licence - see end of file for details.     */
+/**************************************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#define MZFHEADERSIZE 128      // Size of a .mzf file header in bytes
+#define ROMTOP     0x1000      // Monitor ROM is 0x0000 to 0x0fff
+#define IBUFE      0x10f0      // Where the monitor keeps the tape header
+#define VRAM       0xd000      // Character VRAM, 40x25
+#define IOBASE     0xe000      // Memory mapped 8255 keyboard and 8253
+#define SCRCOLS        40      // Sharp MZ screen size in characters
+#define SCRROWS        25
+#define BUDGET   50000000      // Default cycles to run for
+#define FRAME       33333      // Cycles per 60Hz frame at 2MHz
+#define MAXPRINTED  16384      // Text kept of what a program prints
+#define MAXRANGES      16      // Address ranges listed in a report
+
+#define TRAP         0xed      // ED ED fills the ROM, see monitor_call
+
+/* Why a run stopped */
+#define STOP_BUDGET   0        // Ran all the cycles it was given
+#define STOP_MONITOR  1        // Went back to the monitor
+#define STOP_TAPE     2        // Asked for another block from tape
+#define STOP_HALT     3        // HALT with no interrupts to wake it
+
+/* Flag bits */
+#define CF 0x01
+#define NF 0x02
+#define PF 0x04
+#define XF 0x08
+#define HF 0x10
+#define YF 0x20
+#define ZF 0x40
+#define SF 0x80
+
+/* Sign, zero, undocumented bits 5 and 3 and parity of each byte value */
+uint8_t sz53[256], sz53p[256];
+
+/* Cycles taken by each unprefixed instruction, conditional ones not */
+/* taken. The prefixes count 4 and add the rest themselves.          */
+const uint8_t tstates[256] = {
+   4,10, 7, 6, 4, 4, 7, 4, 4,11, 7, 6, 4, 4, 7, 4,
+   8,10, 7, 6, 4, 4, 7, 4,12,11, 7, 6, 4, 4, 7, 4,
+   7,10,16, 6, 4, 4, 7, 4, 7,11,16, 6, 4, 4, 7, 4,
+   7,10,13, 6,11,11,10, 4, 7,11,13, 6, 4, 4, 7, 4,
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+   7, 7, 7, 7, 7, 7, 4, 7, 4, 4, 4, 4, 4, 4, 7, 4,
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+   4, 4, 4, 4, 4, 4, 7, 4, 4, 4, 4, 4, 4, 4, 7, 4,
+   5,10,10,10,10,11, 7,11, 5,10,10, 4,10,17, 7,11,
+   5,10,10,11,10,11, 7,11, 5, 4,10,11,10, 4, 7,11,
+   5,10,10,19,10,11, 7,11, 5, 4,10, 4,10, 4, 7,11,
+   5,10,10, 4,10,11, 7,11, 5, 6,10, 4,10, 4, 7,11
+};
+
+/* A machine and what it has done. Memory is what the Z80 sees now; */
+/* the monitor ROM reads as TRAP bytes and the MZ-700 bank switches */
+/* copy RAM in and out of it.                                       */
+typedef struct {
+  uint8_t mem[65536];
+  uint8_t loaded[65536];       // Memory as it was before the run
+  uint8_t ran[65536/8];        // Bit for each address an opcode ran at
+  uint8_t lowram[ROMTOP];      // RAM under the ROM when it is paged in
+  uint8_t highram[65536-VRAM]; // RAM under VRAM and I/O, likewise
+  bool romin, ioin;            // Monitor ROM and VRAM/I/O paged in
+  uint8_t a, f, b, c, d, e, h, l;
+  uint8_t a_, f_, b_, c_, d_, e_, h_, l_;
+  uint16_t ix, iy, sp, pc;
+  uint8_t i, r;
+  bool iff;
+  uint64_t cycles;
+  uint8_t why;                 // STOP_ reason
+  uint16_t where;              // Monitor address it went to
+  uint32_t tapewrites;         // Headers and bodies written to tape
+  char printed[MAXPRINTED];
+  uint32_t nprinted;
+} machine;
+
+/* Sharp 'ASCII' as plain ASCII, lower case letters included */
+char sharp_char(uint8_t sharpchar)
+{
+  static const uint8_t lower[26] = {
+    0xa1,0x9a,0x9f,0x9c,0x92,0xaa,0x97,0x98,0xa6,0xaf,0xa9,0xb8,0xb3,
+    0xb0,0xb7,0x9e,0xa0,0x9d,0xa4,0x96,0xa5,0xab,0xa3,0x9b,0xbd,0xa2
+  };
+
+  if ((sharpchar >= 0x20) && (sharpchar <= 0x5d))
+    return(sharpchar);
+  for (uint8_t i=0;i<26;i++)
+    if (lower[i] == sharpchar)
+      return('a'+i);
+
+  return('.');
+}
+
+/* Plain ASCII for each display code in VRAM, from the display codes */
+/* of Sharp 'ASCII' 0x20 to 0x5f and the lower case letters           */
+char displaytext[256];
+
+void init_display(void)
+{
+  static const uint8_t printable[64] = {
+    0x00,0x61,0x62,0x63,0x64,0x65,0x66,0x67,  //   ! " # $ % & '
+    0x68,0x69,0x6b,0x6a,0x2f,0x2a,0x2e,0x2d,  // ( ) * + , - . /
+    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,  // 0 - 7
+    0x28,0x29,0x4f,0x2c,0x51,0x2b,0x57,0x49,  // 8 9 : ; < = > ?
+    0x55,0x01,0x02,0x03,0x04,0x05,0x06,0x07,  // @ A - G
+    0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f,  // H - O
+    0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,  // P - W
+    0x18,0x19,0x1a,0x52,0x59,0x54,0x50,0x45   // X Y Z [ \ ] up left
+  };
+
+  memset(displaytext,'.',sizeof(displaytext));
+  for (int i=0;i<0x3e;i++)
+    displaytext[printable[i]]=0x20+i;
+  for (int i=0;i<26;i++)
+    displaytext[0x81+i]='a'+i;
+}
+
+void print_char(machine *m, char ch)
+{
+  if (m->nprinted < MAXPRINTED-1)
+    m->printed[m->nprinted++]=ch;
+}
+
+void init_flags(void)
+{
+  for (int v=0;v<256;v++) {
+    uint8_t p=v^(v>>4);
+    p^=p>>2;
+    p^=p>>1;
+    sz53[v]=(v & (SF|YF|XF))|((v == 0) ? ZF : 0);
+    sz53p[v]=sz53[v]|((p & 1) ? 0 : PF);
+  }
+}
+
+/* The MZ-700 pages RAM over the monitor ROM with OUT (0xe0), over */
+/* VRAM and I/O with OUT (0xe1), and back with 0xe2, 0xe3 and 0xe4 */
+void bank_switch(machine *m, uint8_t port)
+{
+  bool romin=m->romin, ioin=m->ioin;
+
+  switch (port) {
+    case 0xe0: romin=false;
+               break;
+    case 0xe1: ioin=false;
+               break;
+    case 0xe2: romin=true;
+               break;
+    case 0xe3: ioin=true;
+               break;
+    case 0xe4: romin=ioin=true;
+               break;
+    default:   return;
+  }
+  if (romin != m->romin) {
+    if (romin) {
+      memcpy(m->lowram,m->mem,ROMTOP);
+      memset(m->mem,TRAP,ROMTOP);
+    }
+    else
+      memcpy(m->mem,m->lowram,ROMTOP);
+    m->romin=romin;
+  }
+  if (ioin != m->ioin) {
+    uint8_t swap[65536-VRAM];
+    memcpy(swap,m->mem+VRAM,sizeof(swap));
+    memcpy(m->mem+VRAM,m->highram,sizeof(swap));
+    memcpy(m->highram,swap,sizeof(swap));
+    m->ioin=ioin;
+  }
+}
+
+/* Registers in pairs */
+#define BC ((b<<8)|c)
+#define DE ((d<<8)|e)
+#define HL ((h<<8)|l)
+#define SETPAIR(hi,lo,v) do { uint16_t v_=(v); hi=v_>>8; lo=v_; } while (0)
+
+/* Memory. Writes to the ROM and I/O areas are dropped, unless RAM is */
+/* paged in over them.                                                */
+#define RD(addr) mem[(uint16_t)(addr)]
+#define WR(addr,v) do { uint16_t w_=(addr);                            \
+                        if ((uint16_t)(w_-lo) < span) mem[w_]=(v); } while (0)
+#define IMM8 mem[pc++]
+#define IMM16 (pc+=2,(uint16_t)(mem[(uint16_t)(pc-2)]|(mem[(uint16_t)(pc-1)]<<8)))
+#define PUSH(v) do { uint16_t p_=(v); sp--; WR(sp,p_>>8); sp--; WR(sp,p_); } while (0)
+#define POP(v) do { v=RD(sp); sp++; v|=RD(sp)<<8; sp++; } while (0)
+
+/* Arithmetic, setting the flags as the Z80 does */
+#define ADD(v) do { uint8_t v_=(v); uint16_t r_=a+v_;                   \
+                    f=sz53[r_&0xff]|(r_>>8)|((a^v_^r_)&HF)|              \
+                      (((a^~v_)&(a^r_)&0x80)>>5); a=r_; } while (0)
+#define ADC(v) do { uint8_t v_=(v); uint16_t r_=a+v_+(f&CF);            \
+                    f=sz53[r_&0xff]|(r_>>8)|((a^v_^r_)&HF)|              \
+                      (((a^~v_)&(a^r_)&0x80)>>5); a=r_; } while (0)
+#define SUB(v) do { uint8_t v_=(v); uint16_t r_=a-v_;                   \
+                    f=sz53[r_&0xff]|NF|((r_>>8)&CF)|((a^v_^r_)&HF)|      \
+                      (((a^v_)&(a^r_)&0x80)>>5); a=r_; } while (0)
+#define SBC(v) do { uint8_t v_=(v); uint16_t r_=a-v_-(f&CF);            \
+                    f=sz53[r_&0xff]|NF|((r_>>8)&CF)|((a^v_^r_)&HF)|      \
+                      (((a^v_)&(a^r_)&0x80)>>5); a=r_; } while (0)
+#define CP(v)  do { uint8_t v_=(v); uint16_t r_=a-v_;                   \
+                    f=(sz53[r_&0xff]&~(YF|XF))|(v_&(YF|XF))|NF|         \
+                      ((r_>>8)&CF)|((a^v_^r_)&HF)|                       \
+                      (((a^v_)&(a^r_)&0x80)>>5); } while (0)
+#define AND(v) do { a&=(v); f=sz53p[a]|HF; } while (0)
+#define XOR(v) do { a^=(v); f=sz53p[a]; } while (0)
+#define OR(v)  do { a|=(v); f=sz53p[a]; } while (0)
+#define INC(r) do { r++; f=(f&CF)|sz53[r]|((r&0x0f)?0:HF)|             \
+                      ((r == 0x80)?PF:0); } while (0)
+#define DEC(r) do { f=(f&CF)|NF|((r&0x0f)?0:HF); r--;                  \
+                    f|=sz53[r]|((r == 0x7f)?PF:0); } while (0)
+#define ADD16(hi,lo,v) do { uint32_t x_=(hi<<8)|lo, v_=(v), r_=x_+v_;  \
+                    f=(f&(SF|ZF|PF))|(r_>>16)|(((x_^v_^r_)>>8)&HF)|      \
+                      ((r_>>8)&(YF|XF)); SETPAIR(hi,lo,r_); } while (0)
+
+/* The eight ALU operations by number */
+#define ALU(n,v) do { switch (n) {                                     \
+                   case 0: ADD(v); break; case 1: ADC(v); break;        \
+                   case 2: SUB(v); break; case 3: SBC(v); break;        \
+                   case 4: AND(v); break; case 5: XOR(v); break;        \
+                   case 6: OR(v);  break; default: CP(v); } } while (0)
+
+/* Registers by their number in an opcode, 6 being (HL) */
+#define REG(n) ((n)==0?b:(n)==1?c:(n)==2?d:(n)==3?e:(n)==4?h:(n)==5?l:a)
+#define SETREG(n,v) do { switch (n) {                                  \
+                   case 0: b=(v); break; case 1: c=(v); break;          \
+                   case 2: d=(v); break; case 3: e=(v); break;          \
+                   case 4: h=(v); break; case 5: l=(v); break;          \
+                   default: a=(v); } } while (0)
+
+/* Conditions NZ, Z, NC, C, PO, PE, P and M by number */
+#define COND(n) (((f&condflag[(n)>>1]) != 0) == ((n)&1))
+
+#define NEXT goto next
+#define HALT goto halt
+#define JR(cond) do { int8_t o_=IMM8; if (cond) { pc+=o_; cycles+=5; } NEXT; } while (0)
+#define JP(cond) do { uint16_t t_=IMM16; if (cond) pc=t_; NEXT; } while (0)
+#define CALL(cond) do { uint16_t t_=IMM16;                             \
+                        if (cond) { PUSH(pc); pc=t_; cycles+=7; } NEXT; } while (0)
+#define RET(cond) do { if (cond) { POP(pc); cycles+=6; } NEXT; } while (0)
+#define RST(n) do { PUSH(pc); pc=(n); NEXT; } while (0)
+
+const uint8_t condflag[4] = {ZF,CF,PF,SF};
+
+/* Shifts, rotates and bit operations of the CB prefix on v */
+static inline uint8_t cb_op(uint8_t op, uint8_t v, uint8_t *f)
+{
+  uint8_t c;
+
+  switch (op>>6) {
+    case 0:  switch ((op>>3)&7) {
+               case 0: c=v>>7; v=(v<<1)|c; break;            // RLC
+               case 1: c=v&1; v=(v>>1)|(c<<7); break;        // RRC
+               case 2: c=v>>7; v=(v<<1)|(*f&CF); break;      // RL
+               case 3: c=v&1; v=(v>>1)|(*f<<7); break;       // RR
+               case 4: c=v>>7; v<<=1; break;                 // SLA
+               case 5: c=v&1; v=(v>>1)|(v&0x80); break;      // SRA
+               case 6: c=v>>7; v=(v<<1)|1; break;            // SLL
+               default: c=v&1; v>>=1;                        // SRL
+             }
+             *f=sz53p[v]|c;
+             return(v);
+    case 1:  c=v&(1<<((op>>3)&7));
+             *f=(*f&CF)|HF|(v&(YF|XF))|(c ? (c&SF) : (ZF|PF));
+             return(v);
+    case 2:  return(v&~(1<<((op>>3)&7)));
+    default: return(v|(1<<((op>>3)&7)));
+  }
+}
+
+/* Run m from its registers until it stops or has used budget cycles. */
+/* Each instruction is dispatched through a table of label addresses. */
+/* The few places that need a look after an instruction (the end of   */
+/* the budget, the next frame, putting HL back after IX or IY stood   */
+/* in for it) are found by one compare of the cycle count with limit. */
+void run(machine *m, uint64_t budget)
+{
+  static const void *ops[256] = {
+    &&o00,&&o01,&&o02,&&o03,&&o04,&&o05,&&o06,&&o07,
+    &&o08,&&o09,&&o0a,&&o0b,&&o0c,&&o0d,&&o0e,&&o0f,
+    &&o10,&&o11,&&o12,&&o13,&&o14,&&o15,&&o16,&&o17,
+    &&o18,&&o19,&&o1a,&&o1b,&&o1c,&&o1d,&&o1e,&&o1f,
+    &&o20,&&o21,&&o22,&&o23,&&o24,&&o25,&&o26,&&o27,
+    &&o28,&&o29,&&o2a,&&o2b,&&o2c,&&o2d,&&o2e,&&o2f,
+    &&o30,&&o31,&&o32,&&o33,&&o34,&&o35,&&o36,&&o37,
+    &&o38,&&o39,&&o3a,&&o3b,&&o3c,&&o3d,&&o3e,&&o3f,
+    &&o40,&&o41,&&o42,&&o43,&&o44,&&o45,&&o46,&&o47,
+    &&o48,&&o49,&&o4a,&&o4b,&&o4c,&&o4d,&&o4e,&&o4f,
+    &&o50,&&o51,&&o52,&&o53,&&o54,&&o55,&&o56,&&o57,
+    &&o58,&&o59,&&o5a,&&o5b,&&o5c,&&o5d,&&o5e,&&o5f,
+    &&o60,&&o61,&&o62,&&o63,&&o64,&&o65,&&o66,&&o67,
+    &&o68,&&o69,&&o6a,&&o6b,&&o6c,&&o6d,&&o6e,&&o6f,
+    &&o70,&&o71,&&o72,&&o73,&&o74,&&o75,&&o76,&&o77,
+    &&o78,&&o79,&&o7a,&&o7b,&&o7c,&&o7d,&&o7e,&&o7f,
+    &&o80,&&o81,&&o82,&&o83,&&o84,&&o85,&&o86,&&o87,
+    &&o88,&&o89,&&o8a,&&o8b,&&o8c,&&o8d,&&o8e,&&o8f,
+    &&o90,&&o91,&&o92,&&o93,&&o94,&&o95,&&o96,&&o97,
+    &&o98,&&o99,&&o9a,&&o9b,&&o9c,&&o9d,&&o9e,&&o9f,
+    &&oa0,&&oa1,&&oa2,&&oa3,&&oa4,&&oa5,&&oa6,&&oa7,
+    &&oa8,&&oa9,&&oaa,&&oab,&&oac,&&oad,&&oae,&&oaf,
+    &&ob0,&&ob1,&&ob2,&&ob3,&&ob4,&&ob5,&&ob6,&&ob7,
+    &&ob8,&&ob9,&&oba,&&obb,&&obc,&&obd,&&obe,&&obf,
+    &&oc0,&&oc1,&&oc2,&&oc3,&&oc4,&&oc5,&&oc6,&&oc7,
+    &&oc8,&&oc9,&&oca,&&ocb,&&occ,&&ocd,&&oce,&&ocf,
+    &&od0,&&od1,&&od2,&&od3,&&od4,&&od5,&&od6,&&od7,
+    &&od8,&&od9,&&oda,&&odb,&&odc,&&odd,&&ode,&&odf,
+    &&oe0,&&oe1,&&oe2,&&oe3,&&oe4,&&oe5,&&oe6,&&oe7,
+    &&oe8,&&oe9,&&oea,&&oeb,&&oec,&&oed,&&oee,&&oef,
+    &&of0,&&of1,&&of2,&&of3,&&of4,&&of5,&&of6,&&of7,
+    &&of8,&&of9,&&ofa,&&ofb,&&ofc,&&ofd,&&ofe,&&off
+  };
+  uint8_t *mem=m->mem;
+  uint8_t a=m->a, f=m->f, b=m->b, c=m->c, d=m->d, e=m->e, h=m->h, l=m->l;
+  uint8_t r=m->r, op, v, sh=0, sl=0;
+  uint16_t pc=m->pc, sp=m->sp, ix=m->ix, iy=m->iy, t, *index=NULL;
+  uint16_t lo=m->romin ? ROMTOP : 0;
+  uint32_t span=(m->ioin ? IOBASE : 0x10000)-lo;
+  uint64_t cycles=m->cycles, frame=cycles+FRAME/2, limit=0;
+
+next:
+  if (cycles >= limit) {
+    if (index != NULL) {
+      *index=HL;
+      h=sh;
+      l=sl;
+      index=NULL;
+    }
+    if (cycles >= frame) {
+      /* Vertical blanking, bit 7 of 8255 port C */
+      if (m->ioin)
+        mem[IOBASE+2]^=0x80;
+      frame+=FRAME/2;
+    }
+    if (cycles >= budget) {
+      m->why=STOP_BUDGET;
+      goto stop;
+    }
+    limit=(frame < budget) ? frame : budget;
+  }
+  m->ran[pc>>3]|=1<<(pc&7);
+  op=mem[pc++];
+  r++;
+  cycles+=tstates[op];
+  goto *ops[op];
+
+  o00: NEXT;
+  o01: c=IMM8; b=IMM8; NEXT;
+  o02: WR(BC,a); NEXT;
+  o03: SETPAIR(b,c,BC+1); NEXT;
+  o04: INC(b); NEXT;
+  o05: DEC(b); NEXT;
+  o06: b=IMM8; NEXT;
+  o07: a=(a<<1)|(a>>7); f=(f&(SF|ZF|PF))|(a&(YF|XF|CF)); NEXT;
+  o08: v=a; a=m->a_; m->a_=v; v=f; f=m->f_; m->f_=v; NEXT;
+  o09: ADD16(h,l,BC); NEXT;
+  o0a: a=RD(BC); NEXT;
+  o0b: SETPAIR(b,c,BC-1); NEXT;
+  o0c: INC(c); NEXT;
+  o0d: DEC(c); NEXT;
+  o0e: c=IMM8; NEXT;
+  o0f: f=(f&(SF|ZF|PF))|(a&CF); a=(a>>1)|(a<<7); f|=a&(YF|XF); NEXT;
+  o10: JR(--b != 0);
+  o11: e=IMM8; d=IMM8; NEXT;
+  o12: WR(DE,a); NEXT;
+  o13: SETPAIR(d,e,DE+1); NEXT;
+  o14: INC(d); NEXT;
+  o15: DEC(d); NEXT;
+  o16: d=IMM8; NEXT;
+  o17: v=a>>7; a=(a<<1)|(f&CF); f=(f&(SF|ZF|PF))|(a&(YF|XF))|v; NEXT;
+  o18: v=IMM8; pc+=(int8_t)v; NEXT;
+  o19: ADD16(h,l,DE); NEXT;
+  o1a: a=RD(DE); NEXT;
+  o1b: SETPAIR(d,e,DE-1); NEXT;
+  o1c: INC(e); NEXT;
+  o1d: DEC(e); NEXT;
+  o1e: e=IMM8; NEXT;
+  o1f: v=a&1; a=(a>>1)|(f<<7); f=(f&(SF|ZF|PF))|(a&(YF|XF))|v; NEXT;
+  o20: JR(!(f&ZF));
+  o21: l=IMM8; h=IMM8; NEXT;
+  o22: t=IMM16; WR(t,l); WR(t+1,h); NEXT;
+  o23: SETPAIR(h,l,HL+1); NEXT;
+  o24: INC(h); NEXT;
+  o25: DEC(h); NEXT;
+  o26: h=IMM8; NEXT;
+  o27: {
+         uint8_t diff=0, carry=f&CF;
+         if ((f&HF) || ((a&0x0f) > 9))
+           diff=0x06;
+         if (carry || (a > 0x99)) {
+           diff|=0x60;
+           carry=CF;
+         }
+         v=(f&NF) ? (((f&HF) && ((a&0x0f) < 6)) ? HF : 0) :
+                    (((a&0x0f) > 9) ? HF : 0);
+         a=(f&NF) ? a-diff : a+diff;
+         f=sz53p[a]|(f&NF)|carry|v;
+       }
+       NEXT;
+  o28: JR(f&ZF);
+  o29: ADD16(h,l,HL); NEXT;
+  o2a: t=IMM16; l=RD(t); h=RD(t+1); NEXT;
+  o2b: SETPAIR(h,l,HL-1); NEXT;
+  o2c: INC(l); NEXT;
+  o2d: DEC(l); NEXT;
+  o2e: l=IMM8; NEXT;
+  o2f: a=~a; f=(f&(SF|ZF|PF|CF))|HF|NF|(a&(YF|XF)); NEXT;
+  o30: JR(!(f&CF));
+  o31: sp=IMM16; NEXT;
+  o32: t=IMM16; WR(t,a); NEXT;
+  o33: sp++; NEXT;
+  o34: v=RD(HL); INC(v); WR(HL,v); NEXT;
+  o35: v=RD(HL); DEC(v); WR(HL,v); NEXT;
+  o36: v=IMM8; WR(HL,v); NEXT;
+  o37: f=(f&(SF|ZF|PF))|(a&(YF|XF))|CF; NEXT;
+  o38: JR(f&CF);
+  o39: ADD16(h,l,sp); NEXT;
+  o3a: t=IMM16; a=RD(t); NEXT;
+  o3b: sp--; NEXT;
+  o3c: INC(a); NEXT;
+  o3d: DEC(a); NEXT;
+  o3e: a=IMM8; NEXT;
+  o3f: f=((f&(SF|ZF|PF|CF))|((f&CF)<<4)|(a&(YF|XF)))^CF; NEXT;
+
+  o40: NEXT;           o41: b=c; NEXT;      o42: b=d; NEXT;      o43: b=e; NEXT;
+  o44: b=h; NEXT;      o45: b=l; NEXT;      o46: b=RD(HL); NEXT; o47: b=a; NEXT;
+  o48: c=b; NEXT;      o49: NEXT;           o4a: c=d; NEXT;      o4b: c=e; NEXT;
+  o4c: c=h; NEXT;      o4d: c=l; NEXT;      o4e: c=RD(HL); NEXT; o4f: c=a; NEXT;
+  o50: d=b; NEXT;      o51: d=c; NEXT;      o52: NEXT;           o53: d=e; NEXT;
+  o54: d=h; NEXT;      o55: d=l; NEXT;      o56: d=RD(HL); NEXT; o57: d=a; NEXT;
+  o58: e=b; NEXT;      o59: e=c; NEXT;      o5a: e=d; NEXT;      o5b: NEXT;
+  o5c: e=h; NEXT;      o5d: e=l; NEXT;      o5e: e=RD(HL); NEXT; o5f: e=a; NEXT;
+  o60: h=b; NEXT;      o61: h=c; NEXT;      o62: h=d; NEXT;      o63: h=e; NEXT;
+  o64: NEXT;           o65: h=l; NEXT;      o66: h=RD(HL); NEXT; o67: h=a; NEXT;
+  o68: l=b; NEXT;      o69: l=c; NEXT;      o6a: l=d; NEXT;      o6b: l=e; NEXT;
+  o6c: l=h; NEXT;      o6d: NEXT;           o6e: l=RD(HL); NEXT; o6f: l=a; NEXT;
+  o70: WR(HL,b); NEXT; o71: WR(HL,c); NEXT; o72: WR(HL,d); NEXT; o73: WR(HL,e); NEXT;
+  o74: WR(HL,h); NEXT; o75: WR(HL,l); NEXT; o76: HALT;           o77: WR(HL,a); NEXT;
+  o78: a=b; NEXT;      o79: a=c; NEXT;      o7a: a=d; NEXT;      o7b: a=e; NEXT;
+  o7c: a=h; NEXT;      o7d: a=l; NEXT;      o7e: a=RD(HL); NEXT; o7f: NEXT;
+
+  o80: ADD(b); NEXT;            o81: ADD(c); NEXT;
+  o82: ADD(d); NEXT;            o83: ADD(e); NEXT;
+  o84: ADD(h); NEXT;            o85: ADD(l); NEXT;
+  o86: ADD(RD(HL)); NEXT;       o87: ADD(a); NEXT;
+  o88: ADC(b); NEXT;            o89: ADC(c); NEXT;
+  o8a: ADC(d); NEXT;            o8b: ADC(e); NEXT;
+  o8c: ADC(h); NEXT;            o8d: ADC(l); NEXT;
+  o8e: ADC(RD(HL)); NEXT;       o8f: ADC(a); NEXT;
+  o90: SUB(b); NEXT;            o91: SUB(c); NEXT;
+  o92: SUB(d); NEXT;            o93: SUB(e); NEXT;
+  o94: SUB(h); NEXT;            o95: SUB(l); NEXT;
+  o96: SUB(RD(HL)); NEXT;       o97: SUB(a); NEXT;
+  o98: SBC(b); NEXT;            o99: SBC(c); NEXT;
+  o9a: SBC(d); NEXT;            o9b: SBC(e); NEXT;
+  o9c: SBC(h); NEXT;            o9d: SBC(l); NEXT;
+  o9e: SBC(RD(HL)); NEXT;       o9f: SBC(a); NEXT;
+  oa0: AND(b); NEXT;            oa1: AND(c); NEXT;
+  oa2: AND(d); NEXT;            oa3: AND(e); NEXT;
+  oa4: AND(h); NEXT;            oa5: AND(l); NEXT;
+  oa6: AND(RD(HL)); NEXT;       oa7: AND(a); NEXT;
+  oa8: XOR(b); NEXT;            oa9: XOR(c); NEXT;
+  oaa: XOR(d); NEXT;            oab: XOR(e); NEXT;
+  oac: XOR(h); NEXT;            oad: XOR(l); NEXT;
+  oae: XOR(RD(HL)); NEXT;       oaf: XOR(a); NEXT;
+  ob0: OR(b); NEXT;             ob1: OR(c); NEXT;
+  ob2: OR(d); NEXT;             ob3: OR(e); NEXT;
+  ob4: OR(h); NEXT;             ob5: OR(l); NEXT;
+  ob6: OR(RD(HL)); NEXT;        ob7: OR(a); NEXT;
+  ob8: CP(b); NEXT;             ob9: CP(c); NEXT;
+  oba: CP(d); NEXT;             obb: CP(e); NEXT;
+  obc: CP(h); NEXT;             obd: CP(l); NEXT;
+  obe: CP(RD(HL)); NEXT;        obf: CP(a); NEXT;
+
+  oc0: RET(COND(0));
+  oc1: POP(t); SETPAIR(b,c,t); NEXT;
+  oc2: JP(COND(0));
+  oc3: JP(true);
+  oc4: CALL(COND(0));
+  oc5: PUSH(BC); NEXT;
+  oc6: ADD(IMM8); NEXT;
+  oc7: RST(0x00);
+  oc8: RET(COND(1));
+  oc9: POP(pc); NEXT;
+  oca: JP(COND(1));
+  occ: CALL(COND(1));
+  ocd: t=IMM16; PUSH(pc); pc=t; NEXT;
+  oce: ADC(IMM8); NEXT;
+  ocf: RST(0x08);
+  od0: RET(COND(2));
+  od1: POP(t); SETPAIR(d,e,t); NEXT;
+  od2: JP(COND(2));
+  od3: v=IMM8;
+       bank_switch(m,v);
+       lo=m->romin ? ROMTOP : 0;
+       span=(m->ioin ? IOBASE : 0x10000)-lo;
+       NEXT;
+  od4: CALL(COND(2));
+  od5: PUSH(DE); NEXT;
+  od6: SUB(IMM8); NEXT;
+  od7: RST(0x10);
+  od8: RET(COND(3));
+  od9: v=b; b=m->b_; m->b_=v; v=c; c=m->c_; m->c_=v;
+       v=d; d=m->d_; m->d_=v; v=e; e=m->e_; m->e_=v;
+       v=h; h=m->h_; m->h_=v; v=l; l=m->l_; m->l_=v;
+       NEXT;
+  oda: JP(COND(3));
+  odb: pc++; a=0xff; NEXT;
+  odc: CALL(COND(3));
+  ode: SBC(IMM8); NEXT;
+  odf: RST(0x18);
+  oe0: RET(COND(4));
+  oe1: POP(t); SETPAIR(h,l,t); NEXT;
+  oe2: JP(COND(4));
+  oe3: v=RD(sp); WR(sp,l); l=v; v=RD(sp+1); WR(sp+1,h); h=v; NEXT;
+  oe4: CALL(COND(4));
+  oe5: PUSH(HL); NEXT;
+  oe6: AND(IMM8); NEXT;
+  oe7: RST(0x20);
+  oe8: RET(COND(5));
+  oe9: pc=HL; NEXT;
+  oea: JP(COND(5));
+  oeb: v=d; d=h; h=v; v=e; e=l; l=v; NEXT;
+  oec: CALL(COND(5));
+  oee: XOR(IMM8); NEXT;
+  oef: RST(0x28);
+  of0: RET(COND(6));
+  of1: POP(t); SETPAIR(a,f,t); NEXT;
+  of2: JP(COND(6));
+  of3: m->iff=false; NEXT;
+  of4: CALL(COND(6));
+  of5: PUSH((a<<8)|f); NEXT;
+  of6: OR(IMM8); NEXT;
+  of7: RST(0x30);
+  of8: RET(COND(7));
+  of9: sp=HL; NEXT;
+  ofa: JP(COND(7));
+  ofb: m->iff=true; NEXT;
+  ofc: CALL(COND(7));
+  ofe: CP(IMM8); NEXT;
+  off: RST(0x38);
+
+  ocb:
+  op=IMM8;
+  r++;
+  if ((op&7) == 6) {
+    v=cb_op(op,RD(HL),&f);
+    if ((op>>6) != 1) {
+      WR(HL,v);
+      cycles+=7;
+    }
+    else
+      cycles+=4;
+  }
+  else
+    switch (op&7) {
+      case 0: b=cb_op(op,b,&f); break;
+      case 1: c=cb_op(op,c,&f); break;
+      case 2: d=cb_op(op,d,&f); break;
+      case 3: e=cb_op(op,e,&f); break;
+      case 4: h=cb_op(op,h,&f); break;
+      case 5: l=cb_op(op,l,&f); break;
+      default: a=cb_op(op,a,&f);
+    }
+  cycles+=4;
+  NEXT;
+
+  oed:
+  op=IMM8;
+  r++;
+  cycles+=4;
+  switch (op) {
+    case 0x40: case 0x48: case 0x50: case 0x58:      // IN r,(C)
+    case 0x60: case 0x68: case 0x70: case 0x78:
+      if (op != 0x70)
+        SETREG((op>>3)&7,0xff);
+      f=(f&CF)|sz53p[0xff];
+      cycles+=4;
+      break;
+    case 0x41: case 0x49: case 0x51: case 0x59:      // OUT (C),r
+    case 0x61: case 0x69: case 0x71: case 0x79:
+      bank_switch(m,c);
+      lo=m->romin ? ROMTOP : 0;
+      span=(m->ioin ? IOBASE : 0x10000)-lo;
+      cycles+=4;
+      break;
+    case 0x42: case 0x52: case 0x62: case 0x72:      // SBC HL,rp
+    case 0x4a: case 0x5a: case 0x6a: case 0x7a: {    // ADC HL,rp
+      uint32_t x=HL, y, res;
+      switch ((op>>4)&3) {
+        case 0: y=BC; break;
+        case 1: y=DE; break;
+        case 2: y=HL; break;
+        default: y=sp;
+      }
+      if (op&8) {
+        res=x+y+(f&CF);
+        f=(((x^~y)&(x^res)&0x8000)>>13);
+      }
+      else {
+        res=x-y-(f&CF);
+        f=NF|(((x^y)&(x^res)&0x8000)>>13);
+      }
+      f|=((res>>16)&CF)|(((x^y^res)>>8)&HF)|((res>>8)&(SF|YF|XF))|
+         ((res&0xffff) ? 0 : ZF);
+      SETPAIR(h,l,res);
+      cycles+=7;
+      break;
+    }
+    case 0x43: case 0x53: case 0x63: case 0x73:      // LD (nn),rp
+      t=IMM16;
+      switch ((op>>4)&3) {
+        case 0: WR(t,c); WR(t+1,b); break;
+        case 1: WR(t,e); WR(t+1,d); break;
+        case 2: WR(t,l); WR(t+1,h); break;
+        default: WR(t,sp); WR(t+1,sp>>8);
+      }
+      cycles+=12;
+      break;
+    case 0x4b: case 0x5b: case 0x6b: case 0x7b:      // LD rp,(nn)
+      t=IMM16;
+      switch ((op>>4)&3) {
+        case 0: c=RD(t); b=RD(t+1); break;
+        case 1: e=RD(t); d=RD(t+1); break;
+        case 2: l=RD(t); h=RD(t+1); break;
+        default: sp=RD(t)|(RD(t+1)<<8);
+      }
+      cycles+=12;
+      break;
+    case 0x44: case 0x4c: case 0x54: case 0x5c:      // NEG
+    case 0x64: case 0x6c: case 0x74: case 0x7c:
+      v=a;
+      a=0;
+      SUB(v);
+      break;
+    case 0x45: case 0x4d: case 0x55: case 0x5d:      // RETN and RETI
+    case 0x65: case 0x6d: case 0x75: case 0x7d:
+      POP(pc);
+      cycles+=6;
+      break;
+    case 0x46: case 0x4e: case 0x56: case 0x5e:      // IM n
+    case 0x66: case 0x6e: case 0x76: case 0x7e:
+      break;
+    case 0x47: m->i=a;
+               cycles++;
+               break;
+    case 0x4f: r=m->r=a;
+               cycles++;
+               break;
+    case 0x57: a=m->i;
+               f=(f&CF)|sz53[a]|(m->iff ? PF : 0);
+               cycles++;
+               break;
+    case 0x5f: a=(r&0x7f)|(m->r&0x80);
+               f=(f&CF)|sz53[a]|(m->iff ? PF : 0);
+               cycles++;
+               break;
+    case 0x67: v=RD(HL);                             // RRD
+               WR(HL,(a<<4)|(v>>4));
+               a=(a&0xf0)|(v&0x0f);
+               f=(f&CF)|sz53p[a];
+               cycles+=10;
+               break;
+    case 0x6f: v=RD(HL);                             // RLD
+               WR(HL,(v<<4)|(a&0x0f));
+               a=(a&0xf0)|(v>>4);
+               f=(f&CF)|sz53p[a];
+               cycles+=10;
+               break;
+    case 0xa0: case 0xa8: case 0xb0: case 0xb8:      // LDI, LDD, LDIR, LDDR
+      v=RD(HL);
+      WR(DE,v);
+      t=(op&8) ? -1 : 1;
+      SETPAIR(h,l,HL+t);
+      SETPAIR(d,e,DE+t);
+      SETPAIR(b,c,BC-1);
+      v+=a;
+      f=(f&(SF|ZF|CF))|(BC ? PF : 0)|(v&XF)|((v<<4)&YF);
+      cycles+=8;
+      if ((op&0x10) && BC) {
+        pc-=2;
+        cycles+=5;
+      }
+      break;
+    case 0xa1: case 0xa9: case 0xb1: case 0xb9: {    // CPI, CPD, CPIR, CPDR
+      uint8_t res;
+      v=RD(HL);
+      res=a-v;
+      SETPAIR(h,l,HL+((op&8) ? -1 : 1));
+      SETPAIR(b,c,BC-1);
+      f=(f&CF)|NF|(sz53[res]&~(YF|XF))|((a^v^res)&HF)|(BC ? PF : 0);
+      res-=(f&HF) ? 1 : 0;
+      f|=(res&XF)|((res<<4)&YF);
+      cycles+=8;
+      if ((op&0x10) && BC && !(f&ZF)) {
+        pc-=2;
+        cycles+=5;
+      }
+      break;
+    }
+    case 0xa2: case 0xaa: case 0xb2: case 0xba:      // INI, IND, INIR, INDR
+      WR(HL,0xff);
+      SETPAIR(h,l,HL+((op&8) ? -1 : 1));
+      b--;
+      f=sz53[b]|NF;
+      cycles+=8;
+      if ((op&0x10) && b) {
+        pc-=2;
+        cycles+=5;
+      }
+      break;
+    case 0xa3: case 0xab: case 0xb3: case 0xbb:      // OUTI, OUTD, OTIR, OTDR
+      SETPAIR(h,l,HL+((op&8) ? -1 : 1));
+      b--;
+      f=sz53[b]|NF;
+      cycles+=8;
+      if ((op&0x10) && b) {
+        pc-=2;
+        cycles+=5;
+      }
+      break;
+    case TRAP:
+      if (m->romin && ((uint16_t)(pc-2) < ROMTOP)) {
+        t=pc-2;
+        goto monitor;
+      }
+      break;
+    default:                                         // Acts as NOP
+      break;
+  }
+  NEXT;
+
+  odd:
+  index=&ix;
+  goto indexed;
+  ofd:
+  index=&iy;
+  indexed:
+  op=IMM8;
+  r++;
+  switch (op) {
+    case 0x34: case 0x35: case 0x36:                 // INC, DEC, LD (IX+d)
+      t=*index+(int8_t)IMM8;
+      index=NULL;
+      if (op == 0x36) {
+        WR(t,IMM8);
+        cycles+=15;
+        NEXT;
+      }
+      v=RD(t);
+      if (op == 0x34)
+        INC(v);
+      else
+        DEC(v);
+      WR(t,v);
+      cycles+=19;
+      NEXT;
+    case 0x46: case 0x4e: case 0x56: case 0x5e:      // LD r,(IX+d)
+    case 0x66: case 0x6e: case 0x7e:
+      t=*index+(int8_t)IMM8;
+      index=NULL;
+      SETREG((op>>3)&7,RD(t));
+      cycles+=15;
+      NEXT;
+    case 0x70: case 0x71: case 0x72: case 0x73:      // LD (IX+d),r
+    case 0x74: case 0x75: case 0x77:
+      t=*index+(int8_t)IMM8;
+      index=NULL;
+      WR(t,REG(op&7));
+      cycles+=15;
+      NEXT;
+    case 0x86: case 0x8e: case 0x96: case 0x9e:      // ALU A,(IX+d)
+    case 0xa6: case 0xae: case 0xb6: case 0xbe:
+      t=*index+(int8_t)IMM8;
+      index=NULL;
+      v=RD(t);
+      ALU((op>>3)&7,v);
+      cycles+=15;
+      NEXT;
+    case 0xcb:                                       // Bit ops on (IX+d)
+      t=*index+(int8_t)IMM8;
+      index=NULL;
+      op=IMM8;
+      v=cb_op(op,RD(t),&f);
+      if ((op>>6) != 1) {
+        WR(t,v);
+        if ((op&7) != 6)
+          SETREG(op&7,v);
+        cycles+=19;
+      }
+      else
+        cycles+=16;
+      NEXT;
+    case 0xdd: case 0xfd: case 0xed:                 // The prefix is lost
+    case 0xeb: case 0xd9:                            // Only ever HL
+      index=NULL;
+      pc--;
+      NEXT;
+    default:
+      /* Anything else uses IX or IY in place of HL, H or L, so swap  */
+      /* it in for this one instruction and back again after it.      */
+      sh=h;
+      sl=l;
+      h=*index>>8;
+      l=*index;
+      limit=0;
+      cycles+=tstates[op];
+      goto *ops[op];
+  }
+
+  monitor:
+  /* The ROM is TRAP bytes, so a call into the monitor comes here with */
+  /* its address in t. The usual entry points are done as the SP-1002  */
+  /* and 1Z-013A monitors do them; anywhere else is going back to the  */
+  /* monitor for good.                                                 */
+  switch (t) {
+    case 0x0003: WR(DE,0x0d);                                  // GETL
+                 break;
+    case 0x0006: case 0x0009: print_char(m,'\n');              // LETNL, NL
+                 break;
+    case 0x000c: case 0x000f: print_char(m,' ');               // PRNTS, PRNTT
+                 break;
+    case 0x0012: print_char(m,(a == 0x0d) ? '\n' : sharp_char(a)); // PRNT
+                 break;
+    case 0x0015: case 0x0018:                                  // MSG, MSGX
+                 for (uint16_t s=DE,n=0;(RD(s) != 0x0d)&&(n<256);s++,n++)
+                   print_char(m,sharp_char(RD(s)));
+                 break;
+    case 0x001b: a=0;                                          // GETKY
+                 break;
+    case 0x001e: f&=~ZF;                                       // BRKEY
+                 break;
+    case 0x0021: case 0x0024: m->tapewrites++;                 // WRINF, WRDAT
+                 f&=~CF;
+                 break;
+    case 0x0027: case 0x002a: m->why=STOP_TAPE;                // RDINF, RDDAT
+                 m->where=t;
+                 goto stop;
+    case 0x002d: f&=~CF;                                       // VERFY
+                 break;
+    case 0x0030: case 0x0033: case 0x0038: case 0x003e:        // MELDY, TIMST,
+    case 0x0041: case 0x0044: case 0x0047:                     // interrupt, BELL,
+                 break;                                        // XTEMP, MSTA, MSTP
+    case 0x003b: a=0;                                          // TIMRD
+                 d=e=0;
+                 break;
+    default:     m->why=STOP_MONITOR;
+                 m->where=t;
+                 goto stop;
+  }
+  POP(pc);
+  cycles+=10;
+  NEXT;
+
+  halt:
+  pc--;
+  m->why=STOP_HALT;
+
+  stop:
+  if (index != NULL) {
+    *index=HL;
+    h=sh;
+    l=sl;
+  }
+  m->a=a; m->f=f; m->b=b; m->c=c; m->d=d; m->e=e; m->h=h; m->l=l;
+  m->pc=pc; m->sp=sp; m->ix=ix; m->iy=iy;
+  m->r=(m->r&0x80)|(r&0x7f);
+  m->cycles=cycles;
+}
+
+/* Load a tape into a new machine as the monitor leaves it: the header */
+/* at IBUFE, the body at its load address and the stack below the     */
+/* header, about to jump to the exec address. Returns NULL if the      */
+/* file can't be used, with the reason in problem.                     */
+machine *load_machine(char *mzf, uint8_t *header, const char **problem)
+{
+  FILE *fp=fopen(mzf,"r");
+  uint16_t size, load;
+  machine *m;
+
+  if (fp == NULL) {
+    *problem="not found";
+    return(NULL);
+  }
+  if (fread(header,1,MZFHEADERSIZE,fp) != MZFHEADERSIZE) {
+    *problem="has no tape header";
+    fclose(fp);
+    return(NULL);
+  }
+  if (header[0] != 0x01) {
+    *problem="is not a machine code tape";
+    fclose(fp);
+    return(NULL);
+  }
+
+  m=calloc(1,sizeof(machine));
+  size=(header[19]<<8)|header[18];
+  load=(header[21]<<8)|header[20];
+  memset(m->mem,TRAP,ROMTOP);
+  memset(m->mem+IOBASE,0xff,0x800);
+  memcpy(m->mem+IBUFE,header,MZFHEADERSIZE);
+  if (size > 0x10000-load)
+    size=0x10000-load;
+  if (fread(m->mem+load,1,size,fp) < size)
+    fprintf(stderr,"Warning: %s is shorter than its header says\n",mzf);
+  fclose(fp);
+
+  m->romin=m->ioin=true;
+  m->sp=IBUFE-2;               // Returning goes to 0x0000, the monitor
+  m->pc=(header[23]<<8)|header[22];
+  memcpy(m->loaded,m->mem,sizeof(m->mem));
+
+  return(m);
+}
+
+/* Memory as it was before the run, for RAM paged in since reading 0 */
+uint8_t before(machine *m, uint32_t addr)
+{
+  if (((addr < ROMTOP) && !m->romin) || ((addr >= VRAM) && !m->ioin))
+    return(0);
+
+  return(m->loaded[addr]);
+}
+
+/* Takes the tape's load and size only to match the other print_ranges */
+/* tests                                                                */
+bool changed(machine *m, uint32_t addr,
+             uint16_t load __attribute__((unused)),
+             uint16_t size __attribute__((unused)))
+{
+  if (((addr < ROMTOP) && m->romin) || ((addr >= IOBASE) && m->ioin))
+    return(false);
+
+  return(m->mem[addr] != before(m,addr));
+}
+
+bool ran_at(machine *m, uint32_t addr)
+{
+  return((addr >= ROMTOP) && (m->ran[addr>>3] & (1<<(addr&7))));
+}
+
+bool ran_outside(machine *m, uint32_t addr, uint16_t load, uint16_t size)
+{
+  return(ran_at(m,addr) && ((addr < load) || (addr >= (uint32_t)load+size)));
+}
+
+bool ran_changed(machine *m, uint32_t addr, uint16_t load, uint16_t size)
+{
+  return(ran_at(m,addr) && changed(m,addr,load,size));
+}
+
+/* Print the address ranges where want holds, joining runs that are */
+/* less than 16 bytes apart                                         */
+void print_ranges(FILE *fp, const char *title, machine *m, uint16_t load,
+                  uint16_t size,
+                  bool (*want)(machine *, uint32_t, uint16_t, uint16_t))
+{
+  uint32_t from=0, to=0, n=0, more=0;
+  bool inrange=false;
+
+  fprintf(fp,"  %s:",title);
+  for (uint32_t addr=0;addr<=0x10000;addr++) {
+    bool w=(addr < 0x10000) && want(m,addr,load,size);
+    if (w) {
+      if (!inrange)
+        from=addr;
+      inrange=true;
+      to=addr;
+    }
+    else if (inrange && ((addr >= 0x10000) || (addr-to >= 16))) {
+      if (n++ < MAXRANGES)
+        fprintf(fp," 0x%04x-0x%04x",from,to);
+      else
+        more++;
+      inrange=false;
+    }
+  }
+  if (n == 0)
+    fprintf(fp," none");
+  if (more > 0)
+    fprintf(fp," and %u more",more);
+  fprintf(fp,"\n");
+}
+
+/* Where each BASIC keeps its program, and how its lines are linked */
+typedef struct {
+  const char *name;
+  uint8_t type;                // Tape file type of a saved program
+  uint16_t start;
+  uint8_t term;                // Byte that ends each line
+  bool lengths;                // Lines start with their length
+} basicarea;
+
+const basicarea basics[3] = {
+  {"SP-5025 BASIC",0x02,0x4806,0x0d,false},
+  {"SA-5510 BASIC",0x02,0x505c,0x0d,false},
+  {"S-BASIC",0x05,0x6bcf,0x00,true}
+};
+
+/* Count the lines of a BASIC program in memory at ba->start, if there */
+/* is one and the run changed it. The end of the program, after the   */
+/* final zero link, goes in end.                                       */
+uint32_t basic_lines(machine *m, const basicarea *ba, uint32_t *end)
+{
+  uint32_t p=ba->start, lines=0, prev=0;
+  bool differs=false;
+
+  while (p+4 < VRAM) {
+    uint32_t link=m->mem[p]|(m->mem[p+1]<<8), num, next;
+    if (link == 0)
+      break;
+    num=m->mem[p+2]|(m->mem[p+3]<<8);
+    if ((lines > 0) && (num <= prev))
+      return(0);
+    if (ba->lengths) {
+      next=p+link;
+      if ((link < 5) || (link > 256) || (next > VRAM) ||
+          (m->mem[next-1] != ba->term))
+        return(0);
+    }
+    else {
+      for (next=p+4;(next < p+256) && (next < VRAM) &&
+                    (m->mem[next] != ba->term);next++);
+      if ((next >= VRAM) || (m->mem[next] != ba->term))
+        return(0);
+      next++;
+    }
+    prev=num;
+    lines++;
+    p=next;
+  }
+  if ((lines == 0) || (p+4 >= VRAM))
+    return(0);
+  *end=p+2;
+  for (uint32_t i=ba->start;(i < *end) && !differs;i++)
+    differs=(m->mem[i] != m->loaded[i]);
+
+  return(differs ? lines : 0);
+}
+
+/* Write memory from..to as a tape, with the name from header */
+bool write_tape(char *name, machine *m, uint8_t type, uint8_t *header,
+                uint16_t from, uint32_t to)
+{
+  uint8_t newheader[MZFHEADERSIZE]={0};
+  FILE *fp=fopen(name,"w");
+
+  if (fp == NULL) {
+    fprintf(stderr,"Error: unable to write %s\n",name);
+    return(false);
+  }
+  newheader[0]=type;
+  memcpy(newheader+1,header+1,17);
+  newheader[18]=(to-from)&0xff;
+  newheader[19]=(to-from)>>8;
+  newheader[20]=from&0xff;
+  newheader[21]=from>>8;
+  fwrite(newheader,1,MZFHEADERSIZE,fp);
+  fwrite(m->mem+from,1,to-from,fp);
+  fclose(fp);
+
+  return(true);
+}
+
+const char *stopreasons[4] = {
+  "ran out of cycles",
+  "went back to the monitor",
+  "asked for the next block from tape",
+  "halted"
+};
+
+/* Run one tape and return the report on it, to be freed by the caller. */
+/* With a snapshot directory, memory is written there as <tape>.mem and */
+/* any BASIC program found as <tape>.bas.mzf.                           */
+char *run_tape(char *mzf, uint64_t budget, char *snapdir, bool *ok)
+{
+  uint8_t header[MZFHEADERSIZE];
+  const char *problem="";
+  char *report=NULL, *base=strrchr(mzf,'/');
+  machine *m=load_machine(mzf,header,&problem);
+  uint16_t load, size;
+  size_t len;
+  FILE *fp;
+
+  *ok=(m != NULL);
+  fp=open_memstream(&report,&len);
+  if (m == NULL) {
+    fprintf(fp,"%s: %s\n",mzf,problem);
+    fclose(fp);
+    return(report);
+  }
+  base=(base != NULL) ? base+1 : mzf;
+  size=(header[19]<<8)|header[18];
+  load=(header[21]<<8)|header[20];
+
+  fprintf(fp,"%s: \"",mzf);
+  for (int i=1;(i<18)&&(header[i] != 0x0d);i++)
+    fputc(sharp_char(header[i]),fp);
+  fprintf(fp,"\", %u bytes at 0x%04x, exec 0x%04x\n",size,load,m->pc);
+
+  run(m,budget);
+
+  fprintf(fp,"  Ran %" PRIu64 " cycles and %s at 0x%04x\n",m->cycles,
+          stopreasons[m->why],
+          ((m->why == STOP_MONITOR) || (m->why == STOP_TAPE)) ? m->where :
+                                                                 m->pc);
+  if (m->tapewrites > 0)
+    fprintf(fp,"  Wrote %u tape blocks\n",m->tapewrites);
+  if (m->nprinted > 0) {
+    m->printed[m->nprinted]='\0';
+    fprintf(fp,"  Printed:\n");
+    for (char *line=strtok(m->printed,"\n");line!=NULL;line=strtok(NULL,"\n"))
+      fprintf(fp,"    %s\n",line);
+  }
+  print_ranges(fp,"Changed memory",m,load,size,changed);
+  print_ranges(fp,"Ran code outside the tape body",m,load,size,ran_outside);
+  print_ranges(fp,"Ran code it had written",m,load,size,ran_changed);
+
+  for (int i=0;i<3;i++) {
+    uint32_t end, lines=basic_lines(m,&basics[i],&end);
+    if (lines > 0) {
+      fprintf(fp,"  %s program at 0x%04x, %u lines, %u bytes\n",
+              basics[i].name,basics[i].start,lines,end-basics[i].start);
+      if (snapdir != NULL) {
+        char name[PATH_MAX];
+        snprintf(name,sizeof(name),"%s/%s.bas.mzf",snapdir,base);
+        write_tape(name,m,basics[i].type,header,basics[i].start,end);
+      }
+    }
+  }
+
+  /* The screen, if anything was put on it */
+  if (m->ioin && (memcmp(m->mem+VRAM,m->loaded+VRAM,SCRCOLS*SCRROWS) != 0)) {
+    int rows=SCRROWS;
+    while (rows > 0) {
+      bool blank=true;
+      for (int col=0;col<SCRCOLS;col++)
+        if (m->mem[VRAM+(rows-1)*SCRCOLS+col] != 0)
+          blank=false;
+      if (!blank)
+        break;
+      rows--;
+    }
+    fprintf(fp,"  Screen:\n");
+    for (int row=0;row<rows;row++) {
+      char text[SCRCOLS+1];
+      int n=0;
+      for (int col=0;col<SCRCOLS;col++)
+        text[col]=displaytext[m->mem[VRAM+row*SCRCOLS+col]];
+      for (n=SCRCOLS;(n > 0) && (text[n-1] == ' ');n--);
+      fprintf(fp,"    |%.*s\n",n,text);
+    }
+  }
+
+  if (snapdir != NULL) {
+    char name[PATH_MAX];
+    FILE *snap;
+    snprintf(name,sizeof(name),"%s/%s.mem",snapdir,base);
+    snap=fopen(name,"w");
+    if (snap == NULL)
+      fprintf(stderr,"Error: unable to write %s\n",name);
+    else {
+      fwrite(m->mem,1,sizeof(m->mem),snap);
+      fclose(snap);
+    }
+  }
+
+  fclose(fp);
+  free(m);
+
+  return(report);
+}
+
+/* Tapes are run by a pool of threads, and the reports printed in order */
+typedef struct {
+  char **files;
+  int count;
+  uint64_t budget;
+  char *snapdir;
+  atomic_int next;
+  char **reports;
+  bool *ok;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} batch;
+
+void *runner(void *arg)
+{
+  batch *bt=arg;
+  int n;
+
+  while ((n=atomic_fetch_add(&bt->next,1)) < bt->count) {
+    bool ok;
+    char *report=run_tape(bt->files[n],bt->budget,bt->snapdir,&ok);
+    pthread_mutex_lock(&bt->lock);
+    bt->reports[n]=report;
+    bt->ok[n]=ok;
+    pthread_cond_broadcast(&bt->done);
+    pthread_mutex_unlock(&bt->lock);
+  }
+
+  return(NULL);
+}
+
+int main(int argc, char **argv)
+{
+  int nthreads=sysconf(_SC_NPROCESSORS_ONLN), status=0, opt;
+  batch bt={0};
+  pthread_t *threads;
+
+  bt.budget=BUDGET;
+  while ((opt=getopt(argc,argv,"c:o:j:")) != -1) {
+    switch (opt) {
+      case 'c': bt.budget=strtoull(optarg,NULL,10);
+                break;
+      case 'o': bt.snapdir=optarg;
+                break;
+      case 'j': nthreads=atoi(optarg);
+                break;
+      default:  argc=0;
+    }
+  }
+  if (argc-optind < 1) {
+    fprintf(stderr,"Usage: %s [-c <cycles>] [-o <snapshot directory>]"
+                   " [-j <threads>] <mzf file> ...\n",argv[0]);
+    exit(1);
+  }
+
+  init_flags();
+  init_display();
+  bt.files=&argv[optind];
+  bt.count=argc-optind;
+  bt.reports=calloc(bt.count,sizeof(char *));
+  bt.ok=calloc(bt.count,sizeof(bool));
+  pthread_mutex_init(&bt.lock,NULL);
+  pthread_cond_init(&bt.done,NULL);
+  if (nthreads < 1)
+    nthreads=1;
+  if (nthreads > bt.count)
+    nthreads=bt.count;
+  threads=malloc(nthreads*sizeof(pthread_t));
+  for (int t=0;t<nthreads;t++)
+    pthread_create(&threads[t],NULL,runner,&bt);
+
+  for (int n=0;n<bt.count;n++) {
+    pthread_mutex_lock(&bt.lock);
+    while (bt.reports[n] == NULL)
+      pthread_cond_wait(&bt.done,&bt.lock);
+    pthread_mutex_unlock(&bt.lock);
+    fputs(bt.reports[n],stdout);
+    if (!bt.ok[n])
+      status=1;
+    free(bt.reports[n]);
+  }
+  for (int t=0;t<nthreads;t++)
+    pthread_join(threads[t],NULL);
+  free(threads);
+  free(bt.reports);
+  free(bt.ok);
+
+  return(status);
+}
+
+//MIT License
+
+//Copyright (c) 2026 Tim Holyoake
+
+//Permission is hereby granted, free of charge, to any person obtaining a copy
+//of this software and associated documentation files (the "Software"), to deal
+//in the Software without restriction, including without limitation the rights
+//to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//copies of the Software, and to permit persons to whom the Software is
+//furnished to do so, subject to the following conditions:
+
+//The above copyright notice and this permission notice shall be included in all
+//copies or substantial portions of the Software.
+
+//THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//SOFTWARE.